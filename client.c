@@ -8,13 +8,20 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <termios.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
 #define MAX_LINE 1024
+#define HISTORY_PAGE_SIZE 20
 #include "common.h"
+#include "proto.h"
+#include "stats.h"
 
 static int g_hist_header_needed = 1; 
 static int g_hist_boxw = 0;          
@@ -314,26 +321,58 @@ static void print_message_box(const char *title, const char *text) {
     print_box_menu(title ? title : "Message", items, 1);
 }
 
+// Each connection is served by one thread (the load generator runs one
+// per session), so a receive buffer per thread is enough.
+static __thread struct {
+    char buf[16384];
+    size_t start, len;
+} g_rx;
+
+static int rx_take_line(char *out, size_t cap) {
+    const char *p = g_rx.buf + g_rx.start;
+    size_t avail = g_rx.len - g_rx.start;
+    const char *nl = memchr(p, '\n', avail);
+    if (!nl && avail < cap - 1) return 0;
+    size_t len = nl ? (size_t)(nl - p) : cap - 1;
+    size_t used = nl ? len + 1 : len;
+    if (len > cap - 1) len = used = cap - 1;
+    memcpy(out, p, len);
+    out[len] = '\0';
+    g_rx.start += used;
+    if (g_rx.start == g_rx.len) g_rx.start = g_rx.len = 0;
+    return 1;
+}
+
+static ssize_t rx_fill(int fd) {
+    if (g_rx.start > 0) {
+        memmove(g_rx.buf, g_rx.buf + g_rx.start, g_rx.len - g_rx.start);
+        g_rx.len -= g_rx.start;
+        g_rx.start = 0;
+    }
+    for (;;) {
+        ssize_t n = recv(fd, g_rx.buf + g_rx.len, sizeof(g_rx.buf) - g_rx.len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) g_rx.len += (size_t)n;
+        return n;
+    }
+}
+
 static int recv_line(int fd, char *out, size_t cap) {
-    size_t pos = 0;
-    while (pos + 1 < cap) {
-        char c;
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n == 0) return 0;
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        if (c == '\n') break;
-        out[pos++] = c;
+    while (!rx_take_line(out, cap)) {
+        ssize_t n = rx_fill(fd);
+        if (n <= 0) return n == 0 ? 0 : -1;
     }
-    out[pos] = '\0';
     return 1;
 }
 
+// One send per command; splitting the newline off costs a second segment.
 static void send_line(int fd, const char *s) {
-    send(fd, s, strlen(s), 0);
-    send(fd, "\n", 1, 0);
+    char buf[MAX_LINE + 1];
+    size_t len = strlen(s);
+    if (len > sizeof(buf) - 1) len = sizeof(buf) - 1;
+    memcpy(buf, s, len);
+    buf[len++] = '\n';
+    send(fd, buf, len, 0);
 }
 
 static void read_password_masked(const char *prompt, char *out, size_t cap) {
@@ -371,9 +410,515 @@ static void read_password_masked(const char *prompt, char *out, size_t cap) {
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &oldt);
 }
 
+// Pipelined mode for scripts and gateways: every stdin line (normally
+// starting with "LOGIN <user> <password>") is sent as "#<n> <line>" without
+// waiting for replies, and the tagged replies are printed as they arrive.
+// The whole batch costs about one round trip instead of one per command.
+static int run_batch(int fd) {
+    char *q = NULL;
+    size_t qlen = 0, qcap = 0, qoff = 0;
+    char in[MAX_LINE], line[MAX_LINE];
+    int seq = 0;
+
+    while (fgets(in, sizeof(in), stdin)) {
+        in[strcspn(in, "\r\n")] = 0;
+        if (in[0] == '\0') continue;
+        if (qcap - qlen < sizeof(in) + 16) {
+            qcap = qcap ? qcap * 2 : 64 * 1024;
+            char *nq = (char *)realloc(q, qcap);
+            if (!nq) { free(q); return 1; }
+            q = nq;
+        }
+        qlen += (size_t)snprintf(q + qlen, qcap - qlen, "#%d %s\n", ++seq, in);
+    }
+    if (qlen == 0) shutdown(fd, SHUT_WR);
+
+    struct pollfd p;
+    p.fd = fd;
+    for (;;) {
+        p.events = POLLIN | (qoff < qlen ? POLLOUT : 0);
+        p.revents = 0;
+        if (poll(&p, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if ((p.revents & POLLOUT) && qoff < qlen) {
+            ssize_t n = send(fd, q + qoff, qlen - qoff, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0) qoff += (size_t)n;
+            else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) qoff = qlen;
+            // No more commands: the server finishes the queue and hangs up
+            if (qoff == qlen) shutdown(fd, SHUT_WR);
+        }
+        if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (rx_fill(fd) <= 0) break;
+            while (rx_take_line(line, sizeof(line))) puts(line);
+        }
+    }
+    if (g_rx.len > g_rx.start) printf("%.*s\n", (int)(g_rx.len - g_rx.start), g_rx.buf + g_rx.start);
+    free(q);
+    close(fd);
+    return 0;
+}
+
+static uint32_t g_frame_tag = 0;
+
+static int send_frame(int fd, int op, const void *body, size_t len) {
+    char buf[sizeof(proto_hdr) + PROTO_MAX_REQUEST];
+    proto_hdr h;
+    memset(&h, 0, sizeof(h));
+    h.len = (uint32_t)len;
+    h.op = (uint16_t)op;
+    h.tag = ++g_frame_tag;
+    memcpy(buf, &h, sizeof(h));
+    if (len) memcpy(buf + sizeof(h), body, len);
+    return send(fd, buf, sizeof(h) + len, 0) == (ssize_t)(sizeof(h) + len) ? 0 : -1;
+}
+
+// Reads one reply frame; the payload must fit in `cap` bytes.
+static int recv_frame(int fd, proto_hdr *h, void *body, size_t cap) {
+    for (;;) {
+        size_t avail = g_rx.len - g_rx.start;
+        if (avail >= sizeof(*h)) {
+            memcpy(h, g_rx.buf + g_rx.start, sizeof(*h));
+            if (h->len > cap || sizeof(*h) + h->len > sizeof(g_rx.buf)) return -1;
+            if (avail >= sizeof(*h) + h->len) {
+                memcpy(body, g_rx.buf + g_rx.start + sizeof(*h), h->len);
+                g_rx.start += sizeof(*h) + h->len;
+                if (g_rx.start == g_rx.len) g_rx.start = g_rx.len = 0;
+                return 0;
+            }
+        }
+        if (rx_fill(fd) <= 0) return -1;
+    }
+}
+
+static const char *frame_status_text(int status) {
+    switch (status) {
+    case BST_FAILED:        return "Request failed";
+    case BST_BAD_REQUEST:   return "Bad request";
+    case BST_NOT_LOGGED_IN: return "Not logged in";
+    case BST_FORBIDDEN:     return "Not allowed for this role";
+    default:                return "Unknown status";
+    }
+}
+
+static const char *txn_type_text(int type) {
+    switch (type) {
+    case TXN_DEPOSIT:      return "DEPOSIT";
+    case TXN_WITHDRAW:     return "WITHDRAW";
+    case TXN_TRANSFER_OUT: return "TRANSFER_OUT";
+    case TXN_TRANSFER_IN:  return "TRANSFER_IN";
+    case TXN_LOAN_CREDIT:  return "LOAN_CREDIT";
+    default:               return "UNKNOWN";
+    }
+}
+
+static void print_history_page(const proto_history_resp *r, const proto_txn *t) {
+    g_hist_header_needed = 1;
+    g_hist_boxw = 0;
+    for (int i = 0; i < r->count; i++) {
+        time_t tt = (time_t)t[i].ts;
+        struct tm tm;
+        localtime_r(&tt, &tm);
+        char ts[32], note[32] = "-", line[256];
+        strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+        if (t[i].type == TXN_TRANSFER_OUT) snprintf(note, sizeof(note), "to=%d", t[i].peer);
+        else if (t[i].type == TXN_TRANSFER_IN) snprintf(note, sizeof(note), "from=%d", t[i].peer);
+        snprintf(line, sizeof(line), "%s|acct=%d|%s|amt=%lld|bal=%lld|%s", ts, t[i].account_number,
+                 txn_type_text(t[i].type), (long long)t[i].amount, (long long)t[i].balance, note);
+        print_history_line(line);
+    }
+    if (g_hist_boxw > 0) print_border(g_hist_boxw, '=');
+    char end[64];
+    if (r->next_cursor >= 0) snprintf(end, sizeof(end), "HISTORY_END next cursor %lld", (long long)r->next_cursor);
+    else snprintf(end, sizeof(end), "HISTORY_END");
+    print_message_box("History", end);
+}
+
+// Interactive session over the proto.h framing. Only the commands that have
+// a binary form are offered.
+static int run_binary(int fd, const char *uname, const char *pw) {
+    char line[MAX_LINE];
+    send_line(fd, PROTO_SWITCH_CMD);
+    if (recv_line(fd, line, sizeof(line)) <= 0 || strcmp(line, PROTO_SWITCH_ACK) != 0) {
+        printf("Server does not support binary mode\n");
+        return 1;
+    }
+
+    proto_login_req lq;
+    memset(&lq, 0, sizeof(lq));
+    snprintf(lq.username, sizeof(lq.username), "%.*s", USERNAME_MAX - 1, uname);
+    snprintf(lq.password, sizeof(lq.password), "%.*s", PASSWORD_MAX - 1, pw);
+    proto_hdr h;
+    union {
+        proto_login_resp login;
+        proto_balance_resp bal;
+        struct { proto_history_resp r; proto_txn t[PROTO_HISTORY_MAX]; } hist;
+    } resp;
+    if (send_frame(fd, BOP_LOGIN, &lq, sizeof(lq)) != 0 || recv_frame(fd, &h, &resp, sizeof(resp)) != 0) {
+        printf("Disconnected\n");
+        return 0;
+    }
+    if (h.status != BST_OK) { printf("Login failed\n"); return 0; }
+    printf("LOGIN_OK ROLE %d\n", resp.login.role);
+
+    const char *items[] = {
+        "VIEW_BALANCE",
+        "DEPOSIT <amount>",
+        "WITHDRAW <amount>",
+        "TRANSFER <to_acct_no> <amount>",
+        "HISTORY [limit] [cursor]",
+        "VIEW_TXNS <acct_no> [limit] [cursor]",
+        "LOGOUT"
+    };
+    print_box_menu("Binary Mode", items, (int)(sizeof(items) / sizeof(items[0])));
+
+    for (;;) {
+        printf("> ");
+        char in[1024];
+        if (!fgets(in, sizeof(in), stdin)) break;
+        in[strcspn(in, "\r\n")] = 0;
+        char cmd[64] = {0};
+        if (sscanf(in, "%63s", cmd) != 1) continue;
+
+        int op, rc;
+        long long amt = 0;
+        int acct = 0;
+        if (!strcasecmp(cmd, "VIEW_BALANCE")) {
+            op = BOP_BALANCE;
+            rc = send_frame(fd, op, NULL, 0);
+        } else if (!strcasecmp(cmd, "DEPOSIT") || !strcasecmp(cmd, "WITHDRAW")) {
+            op = !strcasecmp(cmd, "DEPOSIT") ? BOP_DEPOSIT : BOP_WITHDRAW;
+            if (sscanf(in, "%*s %lld", &amt) != 1) { render_response_table("ERR Invalid amount"); continue; }
+            proto_amount_req q = { amt };
+            rc = send_frame(fd, op, &q, sizeof(q));
+        } else if (!strcasecmp(cmd, "TRANSFER")) {
+            op = BOP_TRANSFER;
+            if (sscanf(in, "%*s %d %lld", &acct, &amt) != 2) {
+                render_response_table("ERR Usage: TRANSFER <to_acct_no> <amount>");
+                continue;
+            }
+            proto_transfer_req q = { acct, 0, amt };
+            rc = send_frame(fd, op, &q, sizeof(q));
+        } else if (!strcasecmp(cmd, "HISTORY") || !strcasecmp(cmd, "VIEW_TXNS")) {
+            op = BOP_HISTORY;
+            proto_history_req q = { 0, PROTO_HISTORY_MAX, 0 };
+            long long cursor = 0;
+            if (!strcasecmp(cmd, "HISTORY")) {
+                sscanf(in, "%*s %d %lld", &q.limit, &cursor);
+            } else if (sscanf(in, "%*s %d %d %lld", &q.account_number, &q.limit, &cursor) < 1) {
+                render_response_table("ERR Usage: VIEW_TXNS <acct_no> [limit] [cursor]");
+                continue;
+            }
+            q.cursor = cursor;
+            rc = send_frame(fd, op, &q, sizeof(q));
+        } else if (!strcasecmp(cmd, "LOGOUT")) {
+            op = BOP_LOGOUT;
+            rc = send_frame(fd, op, NULL, 0);
+        } else {
+            render_response_table("ERR Not available in binary mode");
+            continue;
+        }
+        if (rc != 0 || recv_frame(fd, &h, &resp, sizeof(resp)) != 0) break;
+
+        if (h.status != BST_OK) {
+            snprintf(line, sizeof(line), "ERR %s", frame_status_text(h.status));
+            render_response_table(line);
+            continue;
+        }
+        if (op == BOP_LOGOUT) break;
+        if (op == BOP_BALANCE) snprintf(line, sizeof(line), "BALANCE acct=%d %lld", resp.bal.account_number, (long long)resp.bal.balance);
+        else if (op == BOP_DEPOSIT) snprintf(line, sizeof(line), "DEPOSITED acct=%d %lld NEW_BAL %lld", resp.bal.account_number, amt, (long long)resp.bal.balance);
+        else if (op == BOP_WITHDRAW) snprintf(line, sizeof(line), "WITHDREW acct=%d %lld NEW_BAL %lld", resp.bal.account_number, amt, (long long)resp.bal.balance);
+        else if (op == BOP_TRANSFER) snprintf(line, sizeof(line), "TRANSFER OK to acct=%d %lld", acct, amt);
+        else { print_history_page(&resp.hist.r, resp.hist.t); continue; }
+        render_response_table(line);
+    }
+
+    print_message_box("Session", "BYE");
+    close(fd);
+    return 0;
+}
+
+// Headless load generator (--load). Each session is a thread with its own
+// connection, logged in as a generated customer (<prefix><n>), issuing a
+// weighted mix of commands either back to back (closed loop) or on a fixed
+// schedule (--rate). Latency is timed from the scheduled send, so a slow
+// server is not hidden by the generator falling behind.
+enum { LOAD_BALANCE, LOAD_DEPOSIT, LOAD_WITHDRAW, LOAD_TRANSFER, LOAD_HISTORY, LOAD_CMDS };
+
+static const char *g_load_names[LOAD_CMDS] = { "VIEW_BALANCE", "DEPOSIT", "WITHDRAW", "TRANSFER", "HISTORY" };
+
+static struct {
+    struct sockaddr_in addr;
+    int sessions;
+    double duration, rate;         /* rate 0: closed loop */
+    int mix[LOAD_CMDS];
+    char prefix[32], password[64];
+    int *accounts;                 /* account number per session, 0 if unknown */
+    int stop, failed;
+    // Sessions wait until all have logged in (arrived) and main says go
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int arrived, go;
+    unsigned long long ok[LOAD_CMDS], errors[LOAD_CMDS];
+} g_load = { .sessions = 8, .duration = 10, .mix = { 50, 20, 10, 15, 5 }, .prefix = "load",
+              .mu = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER };
+
+static int load_connect(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&g_load.addr, sizeof(g_load.addr)) < 0) { close(fd); return -1; }
+    char line[MAX_LINE];
+    if (recv_line(fd, line, sizeof(line)) <= 0 || recv_line(fd, line, sizeof(line)) <= 0) { close(fd); return -1; }
+    return fd;
+}
+
+// Reads one command's reply. Returns 1 if it succeeded, 0 if it was an
+// error (a refused command gets only "ERR Server busy"), -1 on EOF.
+static int load_reply(int fd) {
+    char line[MAX_LINE];
+    int ok = 1;
+    for (;;) {
+        if (recv_line(fd, line, sizeof(line)) <= 0) return -1;
+        if (!strncmp(line, "OK Awaiting", 11)) return ok;
+        if (!strcmp(line, "ERR Server busy")) return 0;
+        if (!strncmp(line, "ERR", 3)) ok = 0;
+    }
+}
+
+static int load_login(const char *uname, const char *pw) {
+    char cmd[256], line[MAX_LINE];
+    int fd = load_connect();
+    if (fd < 0) return -1;
+    snprintf(cmd, sizeof(cmd), "LOGIN %s %s", uname, pw);
+    send_line(fd, cmd);
+    if (recv_line(fd, line, sizeof(line)) <= 0 || strncmp(line, "LOGIN_OK", 8) || load_reply(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Creates the session customers through an employee account; ones left
+// from an earlier run are reused.
+static int load_setup(const char *employee) {
+    char uname[USERNAME_MAX], pw[PASSWORD_MAX], cmd[256];
+    if (sscanf(employee, "%63[^:]:%127s", uname, pw) != 2) {
+        fprintf(stderr, "--employee wants <username>:<password>\n");
+        return -1;
+    }
+    int fd = load_login(uname, pw);
+    if (fd < 0) { fprintf(stderr, "load: employee login failed\n"); return -1; }
+    int created = 0;
+    for (int i = 0; i < g_load.sessions; i++) {
+        snprintf(cmd, sizeof(cmd), "ADD_CUSTOMER %s%d %s 1000000", g_load.prefix, i, g_load.password);
+        send_line(fd, cmd);
+        int rc = load_reply(fd);
+        if (rc < 0) { close(fd); return -1; }
+        created += rc;
+    }
+    send_line(fd, "LOGOUT");
+    close(fd);
+    printf("load: created %d of %d customer(s)\n", created, g_load.sessions);
+    return 0;
+}
+
+static uint32_t load_rand(uint32_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+// Weighted pick from the mix, leaving out command `skip` (-1 for none).
+// -1 if nothing is left to pick.
+static int load_pick(uint32_t *seed, int skip) {
+    int total = 0;
+    for (int i = 0; i < LOAD_CMDS; i++) total += i == skip ? 0 : g_load.mix[i];
+    if (total == 0) return -1;
+    int r = (int)(load_rand(seed) % (uint32_t)total);
+    for (int i = 0; i < LOAD_CMDS; i++) {
+        if (i == skip) continue;
+        if (r < g_load.mix[i]) return i;
+        r -= g_load.mix[i];
+    }
+    return LOAD_BALANCE;
+}
+
+// Transfer target for a session: the next session's account, skipping ones
+// that failed to log in. 0 if no other session has one.
+static int load_peer(int id) {
+    int own = g_load.accounts[id];
+    for (int i = 1; i < g_load.sessions; i++) {
+        int acct = g_load.accounts[(id + i) % g_load.sessions];
+        if (acct && acct != own) return acct;
+    }
+    return 0;
+}
+
+static void *load_session(void *arg) {
+    int id = (int)(intptr_t)arg;
+    char uname[64], cmd[128], line[MAX_LINE];
+    snprintf(uname, sizeof(uname), "%s%d", g_load.prefix, id);
+    int fd = load_login(uname, g_load.password);
+    if (fd >= 0) {
+        int acct = 0;
+        send_line(fd, "VIEW_BALANCE");
+        if (recv_line(fd, line, sizeof(line)) > 0) sscanf(line, "BALANCE acct=%d", &acct);
+        if (load_reply(fd) < 0 || acct == 0) { close(fd); fd = -1; }
+        g_load.accounts[id] = acct;
+    }
+    if (fd < 0) __atomic_fetch_add(&g_load.failed, 1, __ATOMIC_RELAXED);
+    // Every session has its account number once this returns
+    pthread_mutex_lock(&g_load.mu);
+    g_load.arrived++;
+    pthread_cond_broadcast(&g_load.cv);
+    while (!g_load.go) pthread_cond_wait(&g_load.cv, &g_load.mu);
+    pthread_mutex_unlock(&g_load.mu);
+    if (fd < 0) return NULL;
+
+    int metric[LOAD_CMDS];
+    for (int i = 0; i < LOAD_CMDS; i++) metric[i] = stats_metric(g_load_names[i]);
+    uint32_t seed = (uint32_t)id * 2654435761u + 1;
+    unsigned long long interval = g_load.rate > 0 ? (unsigned long long)(1e9 * g_load.sessions / g_load.rate) : 0;
+    unsigned long long next = stats_now() + (interval ? (unsigned long long)id * interval / (unsigned)g_load.sessions : 0);
+    int peer = load_peer(id);
+
+    while (!__atomic_load_n(&g_load.stop, __ATOMIC_RELAXED)) {
+        if (interval) {
+            struct timespec ts = { (time_t)(next / 1000000000ull), (long)(next % 1000000000ull) };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+        }
+        unsigned long long t = interval ? next : stats_now();
+        next += interval;
+        // Without a peer every transfer would be refused, so none are sent
+        int k = load_pick(&seed, peer ? -1 : LOAD_TRANSFER);
+        if (k < 0) break;
+        long long amount = 1 + load_rand(&seed) % 100;
+        if (k == LOAD_DEPOSIT || k == LOAD_WITHDRAW) snprintf(cmd, sizeof(cmd), "%s %lld", g_load_names[k], amount);
+        else if (k == LOAD_TRANSFER) snprintf(cmd, sizeof(cmd), "TRANSFER %d %lld", peer, amount);
+        else if (k == LOAD_HISTORY) snprintf(cmd, sizeof(cmd), "HISTORY %d", HISTORY_PAGE_SIZE);
+        else snprintf(cmd, sizeof(cmd), "%s", g_load_names[k]);
+        send_line(fd, cmd);
+        int rc = load_reply(fd);
+        if (rc < 0) { __atomic_fetch_add(&g_load.failed, 1, __ATOMIC_RELAXED); break; }
+        stats_since(metric[k], t);
+        __atomic_fetch_add(rc ? &g_load.ok[k] : &g_load.errors[k], 1, __ATOMIC_RELAXED);
+    }
+    send_line(fd, "LOGOUT");
+    close(fd);
+    return NULL;
+}
+
+static int print_latency(void *arg, const char *line) {
+    (void)arg;
+    printf("  %s\n", line);
+    return 0;
+}
+
+static int run_load(const char *ip, int port, int argc, char **argv) {
+    const char *employee = NULL;
+    int bad = 0;
+    for (int i = 0; i < argc && !bad; i++) {
+        if (!strcmp(argv[i], "--sessions") && i + 1 < argc && (g_load.sessions = atoi(argv[i + 1])) > 0) i++;
+        else if (!strcmp(argv[i], "--duration") && i + 1 < argc && (g_load.duration = atof(argv[i + 1])) > 0) i++;
+        else if (!strcmp(argv[i], "--rate") && i + 1 < argc && (g_load.rate = atof(argv[i + 1])) >= 0) i++;
+        else if (!strcmp(argv[i], "--mix") && i + 1 < argc &&
+                 sscanf(argv[i + 1], "%d,%d,%d,%d,%d", &g_load.mix[0], &g_load.mix[1], &g_load.mix[2],
+                        &g_load.mix[3], &g_load.mix[4]) == LOAD_CMDS) i++;
+        else if (!strcmp(argv[i], "--prefix") && i + 1 < argc) snprintf(g_load.prefix, sizeof(g_load.prefix), "%s", argv[++i]);
+        else if (!strcmp(argv[i], "--employee") && i + 1 < argc) employee = argv[++i];
+        else bad = 1;
+    }
+    int total = 0;
+    for (int i = 0; i < LOAD_CMDS; i++) {
+        if (g_load.mix[i] < 0) bad = 1;
+        total += g_load.mix[i];
+    }
+    if (g_load.mix[LOAD_TRANSFER] > 0 && g_load.sessions < 2) {
+        fprintf(stderr, "load: transfers in the mix need at least 2 sessions\n");
+        return 1;
+    }
+    if (bad || total <= 0) {
+        fprintf(stderr, "Usage: client <server_ip> <port> --load [--sessions <n>] [--duration <s>] [--rate <ops/s>]\n"
+                        "       [--mix <balance>,<deposit>,<withdraw>,<transfer>,<history>] [--prefix <name>]\n"
+                        "       [--employee <username>:<password>]\n");
+        return 1;
+    }
+    snprintf(g_load.password, sizeof(g_load.password), "%spw", g_load.prefix);
+    g_load.addr.sin_family = AF_INET;
+    g_load.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &g_load.addr.sin_addr) != 1) { fprintf(stderr, "bad ip\n"); return 1; }
+    if (employee && load_setup(employee) != 0) return 1;
+
+    g_load.accounts = (int *)calloc((size_t)g_load.sessions, sizeof(int));
+    pthread_t *th = (pthread_t *)calloc((size_t)g_load.sessions, sizeof(pthread_t));
+    if (!g_load.accounts || !th) return 1;
+    int started = 0;
+    for (; started < g_load.sessions; started++)
+        if (pthread_create(&th[started], NULL, load_session, (void *)(intptr_t)started) != 0) break;
+    // Release the sessions: to run once all have logged in, or straight to
+    // logout if not every thread could be started
+    pthread_mutex_lock(&g_load.mu);
+    if (started < g_load.sessions) g_load.stop = 1;
+    while (!g_load.stop && g_load.arrived < g_load.sessions) pthread_cond_wait(&g_load.cv, &g_load.mu);
+    g_load.go = 1;
+    pthread_cond_broadcast(&g_load.cv);
+    pthread_mutex_unlock(&g_load.mu);
+    if (started < g_load.sessions) {
+        fprintf(stderr, "load: could only start %d session thread(s)\n", started);
+        for (int i = 0; i < started; i++) pthread_join(th[i], NULL);
+        free(th);
+        free(g_load.accounts);
+        return 1;
+    }
+    int failed = __atomic_load_n(&g_load.failed, __ATOMIC_RELAXED);
+    if (failed == g_load.sessions) {
+        fprintf(stderr, "load: no session could log in (create the customers with --employee)\n");
+        for (int i = 0; i < started; i++) pthread_join(th[i], NULL);
+        free(th);
+        free(g_load.accounts);
+        return 1;
+    }
+    printf("load: %d session(s) for %.1f s, %s", g_load.sessions - failed, g_load.duration,
+           g_load.rate > 0 ? "" : "closed loop\n");
+    if (g_load.rate > 0) printf("%.0f ops/s\n", g_load.rate);
+    fflush(stdout);
+
+    unsigned long long t0 = stats_now();
+    struct timespec d = { (time_t)g_load.duration, (long)((g_load.duration - (double)(time_t)g_load.duration) * 1e9) };
+    while (nanosleep(&d, &d) != 0 && errno == EINTR) {}
+    __atomic_store_n(&g_load.stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < started; i++) pthread_join(th[i], NULL);
+    double secs = (double)(stats_now() - t0) / 1e9;
+
+    unsigned long long all = 0, errs = 0;
+    printf("%-14s %10s %10s %8s\n", "COMMAND", "OPS", "OPS/S", "ERRORS");
+    for (int i = 0; i < LOAD_CMDS; i++) {
+        unsigned long long n = g_load.ok[i] + g_load.errors[i];
+        if (!n) continue;
+        printf("%-14s %10llu %10.1f %8llu\n", g_load_names[i], n, (double)n / secs, g_load.errors[i]);
+        all += n;
+        errs += g_load.errors[i];
+    }
+    printf("%-14s %10llu %10.1f %8llu\n", "TOTAL", all, (double)all / secs, errs);
+    printf("latency:\n");
+    stats_report(print_latency, NULL);
+    if (__atomic_load_n(&g_load.failed, __ATOMIC_RELAXED) > 0)
+        printf("load: %d session(s) failed or were disconnected\n", g_load.failed);
+    free(th);
+    free(g_load.accounts);
+    return 0;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server_ip> <port>\n", argv[0]);
+    if (argc >= 4 && !strcmp(argv[3], "--load")) return run_load(argv[1], atoi(argv[2]), argc - 4, argv + 4);
+    int batch = (argc == 4 && !strcmp(argv[3], "--batch"));
+    int binary = (argc == 4 && !strcmp(argv[3], "--binary"));
+    if (argc != 3 && !batch && !binary) {
+        fprintf(stderr, "Usage: %s <server_ip> <port> [--batch | --binary | --load [options]]\n", argv[0]);
         return 1;
     }
 
@@ -392,6 +937,7 @@ int main(int argc, char **argv) {
 
     // connect to server
     if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("connect"); return 1; }
+    if (batch) return run_batch(fd);
 
     char line[MAX_LINE];
 
@@ -411,6 +957,7 @@ int main(int argc, char **argv) {
 
     char pw[256];
     read_password_masked("Enter password: ", pw, sizeof(pw));
+    if (binary) return run_binary(fd, uname, pw);
 
     char cmd[600];
     snprintf(cmd, sizeof(cmd), "LOGIN %s %s", uname, pw);
@@ -455,9 +1002,26 @@ int main(int argc, char **argv) {
         sscanf(in, "%63s", tmp);
         for (char *p = tmp; *p; ++p) *p = (char)toupper((unsigned char)*p);
 
-        if (!strcmp(tmp, "HISTORY") || !strcmp(tmp, "VIEW_TXNS")) {
+        // History commands given without a limit are fetched a page at a
+        // time: page_base is the command plus the page size, and the cursor
+        // from "HISTORY_END NEXT <cursor>" is appended for the next page.
+        char page_base[1100] = "";
+        if (!strcmp(tmp, "HISTORY") || !strcmp(tmp, "VIEW_TXNS") ||
+            !strcmp(tmp, "HISTORY_RANGE") || !strcmp(tmp, "VIEW_TXNS_RANGE")) {
             g_hist_header_needed = 1;
             g_hist_boxw = 0;
+            int want = !strcmp(tmp, "HISTORY") ? 1 : !strcmp(tmp, "VIEW_TXNS") ? 2 : !strcmp(tmp, "HISTORY_RANGE") ? 3 : 4;
+            int words = 0;
+            for (const char *p = in; *p; ) {
+                while (*p && isspace((unsigned char)*p)) p++;
+                if (!*p) break;
+                words++;
+                while (*p && !isspace((unsigned char)*p)) p++;
+            }
+            if (words == want) {
+                snprintf(page_base, sizeof(page_base), "%s %d", in, HISTORY_PAGE_SIZE);
+                snprintf(in, sizeof(in), "%s", page_base);
+            }
         }
 
         if (!strcmp(tmp, "ADD_CUSTOMER")) {
@@ -493,36 +1057,46 @@ int main(int argc, char **argv) {
             }
         }
 
-        send_line(fd, in);
-
         for (;;) {
-            int rr = recv_line(fd, line, sizeof(line));
-            if (rr <= 0) goto out;
+            long long next_page = -1;
+            send_line(fd, in);
 
-            if (!strncmp(line, "OK Awaiting", 11)) { break; }
-            if (!strncmp(line, "BYE", 3)) {
-                printf("%s\n", line);
-                goto out;
-            }
+            for (;;) {
+                int rr = recv_line(fd, line, sizeof(line));
+                if (rr <= 0) goto out;
+
+                if (!strncmp(line, "OK Awaiting", 11)) { break; }
+                if (!strncmp(line, "BYE", 3)) {
+                    printf("%s\n", line);
+                    goto out;
+                }
 
             
-            if (!strncmp(line, "HISTORY_END", 11)) {
-                if (g_hist_boxw > 0) {
-                    print_border(g_hist_boxw, '=');
+                if (!strncmp(line, "HISTORY_END", 11)) {
+                    if (g_hist_boxw > 0) {
+                        print_border(g_hist_boxw, '=');
+                    }
+                    g_hist_header_needed = 1;
+                    g_hist_boxw = 0;
+                    sscanf(line, "HISTORY_END NEXT %lld", &next_page);
+                    print_message_box("History", line);
+                    continue;
                 }
-                g_hist_header_needed = 1;
-                g_hist_boxw = 0;
-                print_message_box("History", line);
-                continue;
-            }
 
-            if (strstr(line, "acct=") && (strstr(line, "amt=") || strstr(line, "bal="))) {
-                print_history_line(line);
-                continue;
+                if (strstr(line, "acct=") && (strstr(line, "amt=") || strstr(line, "bal="))) {
+                    print_history_line(line);
+                    continue;
+                }
+
+                if (render_response_table(line)) continue;
+                print_message_box("Info", line);
             }
 
-            if (render_response_table(line)) continue;
-            print_message_box("Info", line);
+            if (next_page < 0 || !page_base[0]) break;
+            printf("-- Enter for the next page, q to stop -- ");
+            char ans[16];
+            if (!fgets(ans, sizeof(ans), stdin) || ans[0] == 'q' || ans[0] == 'Q') break;
+            snprintf(in, sizeof(in), "%.1000s %lld", page_base, next_page);
         }
     }
 
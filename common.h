@@ -18,7 +18,7 @@ typedef struct {
     int id;
     int role;             
     int active;            
-    int session_active;    
+    int session_active;    /* unused; sessions are tracked in memory */
     char username[USERNAME_MAX];
     char password[PASSWORD_MAX]; 
 } user_record;
@@ -30,6 +30,24 @@ typedef struct {
   long long balance;
 } account_record;
 
+typedef enum {
+    TXN_DEPOSIT = 1,
+    TXN_WITHDRAW,
+    TXN_TRANSFER_OUT,
+    TXN_TRANSFER_IN,
+    TXN_LOAN_CREDIT
+} txn_type;
+
+// One transactions.log entry in parsed form.
+typedef struct {
+    long long ts;
+    int acct_no;
+    int type;             /* txn_type */
+    int peer;             /* counterparty account for transfers, 0 otherwise */
+    long long amount;
+    long long balance;
+} txn_entry;
+
 typedef enum {
     LOAN_PENDING  = 0,
     LOAN_APPROVED = 1,
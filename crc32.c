@@ -0,0 +1,21 @@
+
+#define _XOPEN_SOURCE 700
+
+#include "crc32.h"
+
+static uint32_t g_crc_table[256];
+
+void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        g_crc_table[i] = c;
+    }
+}
+
+uint32_t crc32_buf(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t c = 0xFFFFFFFFu;
+    while (len--) c = g_crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
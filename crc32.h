@@ -0,0 +1,11 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32 (IEEE 802.3). crc32_init must run once before the first crc32_buf. */
+void crc32_init(void);
+uint32_t crc32_buf(const void *data, size_t len);
+
+#endif
@@ -3,20 +3,30 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "crc32.h"
 #include "db.h"
+#include "index.h"
+#include "lockprof.h"
+#include "sha256.h"
+#include "stats.h"
+#include "txnlog.h"
 #ifndef bzero
 #define bzero(ptr, sz) memset((ptr), 0, (sz))
 #endif
@@ -27,8 +37,35 @@
 #define TXN_LOG        "transactions.log"
 #define FEEDBACK_LOG   "feedback.log"
 #define JOURNAL_FILE   "accounts.journal"
+#define TXN_INDEX      "transactions.idx"
+#define TXN_MANIFEST   "transactions.manifest"
+#define IDS_FILE       "ids.db"
+#define SNAPSHOT_FILE  "snapshot.db"
+#define FORMAT_FILE    "format.db"
+
+// Passwords are stored as "pbkdf2-sha256$<iterations>$<salt>$<key>", salt
+// and key in hex. Records from before hold a bare DJB2 digest; db_login
+// still accepts one and rewrites it in the new form, as it does a hash
+// made with an iteration count other than the current one.
+#define KDF_PREFIX     "pbkdf2-sha256$"
+#define KDF_SALT_LEN   16
+#define KDF_ITERATIONS 10000
+
+static uint32_t g_kdf_iterations = KDF_ITERATIONS;
+
+void db_set_kdf_iterations(unsigned iterations) {
+    if (iterations > 0) g_kdf_iterations = iterations;
+}
+
+static int random_bytes(void *buf, size_t len) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, len);
+    close(fd);
+    return n == (ssize_t)len ? 0 : -1;
+}
 
-static void hash_password(const char *plain, char *hashed) {
+static void legacy_hash_password(const char *plain, char *hashed) {
     unsigned long hash = 5381;
     int c;
     const char *p = plain;
@@ -37,175 +74,2012 @@ static void hash_password(const char *plain, char *hashed) {
     snprintf(hashed, PASSWORD_MAX, "%lx", hash);
 }
 
+static void hex_encode(const unsigned char *p, size_t n, char *out) {
+    for (size_t i = 0; i < n; i++) sprintf(out + 2 * i, "%02x", p[i]);
+}
+
+static void hex_decode(const char *s, unsigned char *out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned v = 0;
+        sscanf(s + 2 * i, "%2x", &v);
+        out[i] = (unsigned char)v;
+    }
+}
+
+// Costs g_kdf_iterations PBKDF2 rounds; call it outside any lock.
+static int hash_password(const char *plain, char *hashed) {
+    unsigned char salt[KDF_SALT_LEN], key[SHA256_LEN];
+    if (random_bytes(salt, sizeof(salt)) != 0) return -1;
+    pbkdf2_sha256(plain, strlen(plain), salt, sizeof(salt), g_kdf_iterations, key, sizeof(key));
+    char shex[2 * KDF_SALT_LEN + 1], khex[2 * SHA256_LEN + 1];
+    hex_encode(salt, sizeof(salt), shex);
+    hex_encode(key, sizeof(key), khex);
+    snprintf(hashed, PASSWORD_MAX, KDF_PREFIX "%u$%s$%s", (unsigned)g_kdf_iterations, shex, khex);
+    return 0;
+}
+
+// 1 if plain matches the stored hash. *stale is set when the hash should
+// be rewritten with the current scheme and cost.
+static int verify_password(const char *plain, const char *stored_field, int *stale) {
+    char stored[PASSWORD_MAX];
+    memcpy(stored, stored_field, PASSWORD_MAX);
+    stored[PASSWORD_MAX - 1] = '\0';
+    const size_t plen = strlen(KDF_PREFIX);
+    if (strncmp(stored, KDF_PREFIX, plen) != 0) {
+        char legacy[PASSWORD_MAX];
+        legacy_hash_password(plain, legacy);
+        *stale = 1;
+        return strcmp(stored, legacy) == 0;
+    }
+
+    unsigned iters;
+    char shex[2 * KDF_SALT_LEN + 1], khex[2 * SHA256_LEN + 1];
+    if (sscanf(stored + plen, "%u$%32[0-9a-f]$%64[0-9a-f]", &iters, shex, khex) != 3 || iters == 0 ||
+        strlen(shex) != 2 * KDF_SALT_LEN || strlen(khex) != 2 * SHA256_LEN) return 0;
+    unsigned char salt[KDF_SALT_LEN], want[SHA256_LEN], got[SHA256_LEN];
+    hex_decode(shex, salt, sizeof(salt));
+    hex_decode(khex, want, sizeof(want));
+    pbkdf2_sha256(plain, strlen(plain), salt, sizeof(salt), iters, got, sizeof(got));
+    *stale = iters != g_kdf_iterations;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < sizeof(got); i++) diff |= got[i] ^ want[i];
+    return diff == 0;
+}
+
+
+// File I/O goes through these so each call lands in a phase histogram.
+static ssize_t timed_pread(int fd, void *buf, size_t len, off_t off) {
+    unsigned long long t = stats_now();
+    ssize_t n = pread(fd, buf, len, off);
+    stats_since(STAT_READ, t);
+    return n;
+}
+
+static ssize_t timed_pwrite(int fd, const void *buf, size_t len, off_t off) {
+    unsigned long long t = stats_now();
+    ssize_t n = pwrite(fd, buf, len, off);
+    stats_since(STAT_WRITE, t);
+    return n;
+}
+
+static ssize_t timed_write(int fd, const void *buf, size_t len) {
+    unsigned long long t = stats_now();
+    ssize_t n = write(fd, buf, len);
+    stats_since(STAT_WRITE, t);
+    return n;
+}
+
+static int timed_fsync(int fd) {
+    unsigned long long t = stats_now();
+    int rc = fsync(fd);
+    stats_since(STAT_FSYNC, t);
+    return rc;
+}
+
+static int timed_fdatasync(int fd) {
+    unsigned long long t = stats_now();
+    int rc = fdatasync(fd);
+    stats_since(STAT_FSYNC, t);
+    return rc;
+}
+
+// Shared handle table. Data files are opened once by db_init and stay open
+// until db_shutdown, so db_* calls do no open/close of their own and no
+// close() can silently drop the process's fcntl locks on a file.
+static struct {
+    int users;
+    int accounts;
+    int loans;
+    int txn;
+    int txn_idx;
+    int feedback;
+} g_fd = { -1, -1, -1, -1, -1, -1 };
+
+typedef int (*line_fn)(const char *line, size_t len, void *arg);
+
+// Streams the lines of a shared handle through fn using positional reads, so
+// concurrent readers never disturb each other's (or the appenders') offsets.
+// Each line is passed NUL-terminated with its newline; overlong lines are cut.
+static int scan_lines_from(int fd, off_t off, line_fn fn, void *arg) {
+    enum { SCAN_BUF = 64 * 1024 };
+    char *buf = (char *)malloc(SCAN_BUF + 1);
+    if (!buf) return -1;
+    size_t have = 0;
+    int rc = 0;
+    for (;;) {
+        ssize_t n = timed_pread(fd, buf + have, SCAN_BUF - have, off);
+        if (n < 0) { if (errno == EINTR) continue; rc = -1; break; }
+        off += n;
+        have += (size_t)n;
+        size_t start = 0;
+        char *nl;
+        while ((nl = memchr(buf + start, '\n', have - start)) != NULL) {
+            size_t len = (size_t)(nl - (buf + start)) + 1;
+            char saved = buf[start + len];
+            buf[start + len] = '\0';
+            rc = fn(buf + start, len, arg);
+            buf[start + len] = saved;
+            if (rc != 0) goto done;
+            start += len;
+        }
+        if (n == 0) break;
+        if (start == 0 && have == SCAN_BUF) {
+            buf[have] = '\0';
+            if ((rc = fn(buf, have, arg)) != 0) break;
+            have = 0;
+            continue;
+        }
+        memmove(buf, buf + start, have - start);
+        have -= start;
+    }
+done:
+    free(buf);
+    return rc;
+}
+
+static int scan_lines(int fd, line_fn fn, void *arg) {
+    return scan_lines_from(fd, 0, fn, arg);
+}
+
+static int ensure_file(const char *path, size_t rec_size) {
+    (void)rec_size; 
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    return fd;
+}
+
+// Lock profile names (lockprof.h) for the shared handles
+static const char *lock_file_name(int fd) {
+    if (fd == g_fd.users) return USERS_FILE;
+    if (fd == g_fd.accounts) return ACCOUNTS_FILE;
+    if (fd == g_fd.loans) return LOANS_FILE;
+    if (fd == g_fd.feedback) return FEEDBACK_LOG;
+    return "other_file";
+}
+
+// The lock helpers are macros so the lock profile can charge each
+// acquisition to the function that made it (__func__).
+static int lock_region_at(int fd, short type, off_t start, off_t len, const char *op) {
+    struct flock fl;
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    if (type == F_UNLCK) {
+        lockprof_released(lock_file_name(fd), -1);
+        return fcntl(fd, F_SETLKW, &fl);
+    }
+    unsigned long long t = stats_now();
+    int rc = fcntl(fd, F_SETLKW, &fl);
+    unsigned long long waited = stats_now() - t;
+    stats_record(STAT_LOCK_WAIT, waited);
+    if (rc == 0) lockprof_acquired(lock_file_name(fd), -1, type == F_WRLCK, op, waited);
+    return rc;
+}
+
+#define lock_region(fd, type, start, len) lock_region_at(fd, type, start, len, __func__)
+#define lock_file_excl(fd)                lock_region(fd, F_WRLCK, 0, 0)
+#define unlock_file(fd)                   lock_region(fd, F_UNLCK, 0, 0)
+
+// In-process rwlocks, profiled under the lock's own name ("g_seg.lock")
+static void rw_lock_at(pthread_rwlock_t *l, int excl, const char *name, const char *op) {
+    unsigned long long t = stats_now();
+    if (excl) pthread_rwlock_wrlock(l);
+    else pthread_rwlock_rdlock(l);
+    lockprof_acquired(name + (*name == '&'), -1, excl, op, stats_now() - t);
+}
+
+static void rw_unlock_at(pthread_rwlock_t *l, const char *name) {
+    lockprof_released(name + (*name == '&'), -1);
+    pthread_rwlock_unlock(l);
+}
+
+#define rw_rdlock(l) rw_lock_at(l, 0, #l, __func__)
+#define rw_wrlock(l) rw_lock_at(l, 1, #l, __func__)
+#define rw_unlock(l) rw_unlock_at(l, #l)
+
+// In-process mutexes, profiled the same way
+static void mu_lock_at(pthread_mutex_t *m, const char *name, const char *op) {
+    unsigned long long t = stats_now();
+    pthread_mutex_lock(m);
+    lockprof_acquired(name + (*name == '&'), -1, 1, op, stats_now() - t);
+}
+
+static void mu_unlock_at(pthread_mutex_t *m, const char *name) {
+    lockprof_released(name + (*name == '&'), -1);
+    pthread_mutex_unlock(m);
+}
+
+#define mu_lock(m)   mu_lock_at(m, #m, __func__)
+#define mu_unlock(m) mu_unlock_at(m, #m)
+
+// In-process account locks. fcntl locks belong to the process, so they never
+// exclude the server's own threads from each other; account reads and updates
+// instead take one of ACCT_LOCK_STRIPES rwlocks picked by account number.
+// Two-account operations lock stripes in ascending index order.
+#define ACCT_LOCK_STRIPES 1024
+static pthread_rwlock_t g_acct_stripes[ACCT_LOCK_STRIPES];
+
+static void acct_locks_init(void) {
+    for (int i = 0; i < ACCT_LOCK_STRIPES; i++) pthread_rwlock_init(&g_acct_stripes[i], NULL);
+}
+
+static unsigned acct_stripe(int acct_no) { return (unsigned)acct_no % ACCT_LOCK_STRIPES; }
+
+static const char g_stripe_name[] = "account_stripe";
+
+static void stripe_lock(unsigned s, int excl, const char *op) {
+    unsigned long long t = stats_now();
+    if (excl) pthread_rwlock_wrlock(&g_acct_stripes[s]);
+    else pthread_rwlock_rdlock(&g_acct_stripes[s]);
+    unsigned long long waited = stats_now() - t;
+    stats_record(STAT_STRIPE_WAIT, waited);
+    lockprof_acquired(g_stripe_name, (int)s, excl, op, waited);
+}
+
+static void stripe_unlock(unsigned s) {
+    lockprof_released(g_stripe_name, (int)s);
+    pthread_rwlock_unlock(&g_acct_stripes[s]);
+}
+
+#define acct_lock_shared(acct_no) stripe_lock(acct_stripe(acct_no), 0, __func__)
+#define acct_lock_excl(acct_no)   stripe_lock(acct_stripe(acct_no), 1, __func__)
+static void acct_unlock(int acct_no) { stripe_unlock(acct_stripe(acct_no)); }
+
+static void acct_lock_pair_excl_at(int acct_a, int acct_b, const char *op) {
+    unsigned sa = acct_stripe(acct_a), sb = acct_stripe(acct_b);
+    if (sa == sb) { stripe_lock(sa, 1, op); return; }
+    stripe_lock(sa < sb ? sa : sb, 1, op);
+    stripe_lock(sa < sb ? sb : sa, 1, op);
+}
+
+#define acct_lock_pair_excl(a, b) acct_lock_pair_excl_at(a, b, __func__)
+
+static void acct_unlock_pair(int acct_a, int acct_b) {
+    unsigned sa = acct_stripe(acct_a), sb = acct_stripe(acct_b);
+    stripe_unlock(sa);
+    if (sa != sb) stripe_unlock(sb);
+}
+
+
+// Resident user index: username -> offset (aux = user id) and id -> offset.
+// Built once at db_init; db_add_user_with_account is the only path that
+// appends users, every other write rewrites a record in place.
+static pthread_rwlock_t g_user_idx_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Held with the users.db file lock around every in-place rewrite of a user
+// record, which the file lock alone does not order between our threads.
+static pthread_mutex_t g_users_mu = PTHREAD_MUTEX_INITIALIZER;
+static str_index g_user_by_name;
+static int_index g_user_by_id;
+
+// A username as strncmp against the fixed-size field sees it: at most
+// USERNAME_MAX characters. Records and lookups are both keyed this way, so
+// a name matches exactly when it did against the on-disk field.
+static const char *user_key(const char *name, char key[USERNAME_MAX + 1]) {
+    size_t n = strnlen(name, USERNAME_MAX);
+    memcpy(key, name, n);
+    key[n] = '\0';
+    return key;
+}
+
+static int user_index_add(const user_record *u, off_t off) {
+    char key[USERNAME_MAX + 1];
+    if (str_index_put(&g_user_by_name, user_key(u->username, key), off, u->id) != 0) return -1;
+    return int_index_put(&g_user_by_id, u->id, off, 0);
+}
+
+// Indexes users.db from offset `from`, extending the index loaded from the
+// snapshot or, without one, building it from scratch.
+static int build_user_index(int ufd, off_t from, int loaded) {
+    off_t sz = lseek(ufd, 0, SEEK_END);
+    size_t n = sz > 0 ? (size_t)sz / sizeof(user_record) : 0;
+    if (!loaded && str_index_init(&g_user_by_name, n) != 0) return -1;
+    if (!loaded && int_index_init(&g_user_by_id, n) != 0) return -1;
+
+    off_t off = from;
+    user_record u;
+    while (timed_pread(ufd, &u, sizeof(u), off) == (ssize_t)sizeof(u)) {
+        if (user_index_add(&u, off) != 0) return -1;
+        off += sizeof(u);
+    }
+    return 0;
+}
+
+static int read_user_at(int fd, off_t off, user_record *out, off_t *off_out) {
+    user_record u;
+    if (timed_pread(fd, &u, sizeof(u), off) != (ssize_t)sizeof(u)) return -1;
+    if (out) *out = u;
+    if (off_out) *off_out = off;
+    return 0;
+}
+
+static int read_user_by_username(int fd, const char *username, user_record *out, off_t *off_out) {
+    off_t off;
+    char key[USERNAME_MAX + 1];
+    rw_rdlock(&g_user_idx_lock);
+    int rc = str_index_get(&g_user_by_name, user_key(username, key), &off, NULL);
+    rw_unlock(&g_user_idx_lock);
+    if (rc != 0) return -1;
+    return read_user_at(fd, off, out, off_out);
+}
+
+static int read_user_by_id(int fd, int uid, user_record *out, off_t *off_out) {
+    off_t off;
+    rw_rdlock(&g_user_idx_lock);
+    int rc = int_index_get(&g_user_by_id, uid, &off, NULL);
+    rw_unlock(&g_user_idx_lock);
+    if (rc != 0) return -1;
+    return read_user_at(fd, off, out, off_out);
+}
+
+// Session registry: user id -> session token, kept in memory only, so a
+// login writes nothing to disk and a restart begins with no sessions. The
+// table is striped by user id; a slot's off field holds the token. The
+// user_record session_active field is no longer read or written.
+#define SESSION_STRIPES 64
+
+static struct {
+    pthread_mutex_t mu;
+    int_index ix;
+    uint64_t next;        /* per-stripe counter mixed into tokens */
+} g_sessions[SESSION_STRIPES];
+static uint64_t g_session_key;
+
+static int sessions_init(void) {
+    if (random_bytes(&g_session_key, sizeof(g_session_key)) != 0)
+        g_session_key = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    for (int i = 0; i < SESSION_STRIPES; i++) {
+        pthread_mutex_init(&g_sessions[i].mu, NULL);
+        if (int_index_init(&g_sessions[i].ix, 16) != 0) return -1;
+    }
+    return 0;
+}
+
+static void sessions_free(void) {
+    for (int i = 0; i < SESSION_STRIPES; i++) int_index_free(&g_sessions[i].ix);
+}
+
+// splitmix64 finalizer over key + counter: unpredictable without the key
+static uint64_t session_token(uint64_t x) {
+    x += g_session_key + 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x ? x : 1;
+}
+
+// Registers a session for uid; -1 if it already has one.
+static int session_begin(int uid, uint64_t *token_out) {
+    unsigned s = (unsigned)uid % SESSION_STRIPES;
+    pthread_mutex_lock(&g_sessions[s].mu);
+    int rc = -1;
+    if (int_index_get(&g_sessions[s].ix, uid, NULL, NULL) != 0) {
+        uint64_t token = session_token(((uint64_t)s << 56) ^ ++g_sessions[s].next);
+        rc = int_index_put(&g_sessions[s].ix, uid, (off_t)token, 0);
+        if (rc == 0 && token_out) *token_out = token;
+    }
+    pthread_mutex_unlock(&g_sessions[s].mu);
+    return rc;
+}
+
+// Ends uid's session if it holds `token` (0 = whichever it is).
+static int session_end(int uid, uint64_t token) {
+    unsigned s = (unsigned)uid % SESSION_STRIPES;
+    pthread_mutex_lock(&g_sessions[s].mu);
+    off_t held;
+    int rc = int_index_get(&g_sessions[s].ix, uid, &held, NULL);
+    if (rc == 0 && token && (uint64_t)held != token) rc = -1;
+    if (rc == 0) int_index_del(&g_sessions[s].ix, uid);
+    pthread_mutex_unlock(&g_sessions[s].mu);
+    return rc;
+}
+
+// accounts.db layout. The original file is bare account_record slots. The
+// headered layout, written when the mmap mode is requested, starts with an
+// acct_file_header and keeps zeroed spare slots past `count`, so the file
+// grows ACCT_GROW_SLOTS at a time. In mmap mode the file is mapped once
+// over ACCT_MAP_RESERVE bytes of address space, which covers later growth,
+// so record addresses never move and reads and balance updates are plain
+// memory accesses. Durability comes from the journal; the mapping is only
+// msync'ed at checkpoints and when an account is created.
+#define ACCT_MAGIC       0x43434142u   /* "BACC" */
+#define ACCT_VERSION     1
+#define ACCT_GROW_SLOTS  65536
+#define ACCT_MAP_RESERVE ((size_t)1 << 34)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rec_size;     /* sizeof(account_record) */
+    uint32_t pad;
+    uint64_t count;        /* slots in use */
+    uint64_t reserved[5];
+} acct_file_header;
+
+static struct {
+    int want_mmap;
+    int headered;
+    off_t base;            /* offset of slot 0 */
+    uint64_t count;        /* pread mode; the mapped header otherwise */
+    off_t size;            /* file size, including spare slots */
+    char *map;             /* mmap mode: the file, from offset 0 */
+} g_acct;
+
+void db_set_mmap_accounts(int enable) {
+    g_acct.want_mmap = enable;
+}
+
+// Slot 0 offset and slot count of an open accounts.db in either layout.
+static int acct_layout(int fd, off_t *base, uint64_t *count) {
+    acct_file_header h;
+    off_t sz = lseek(fd, 0, SEEK_END);
+    if (timed_pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && h.magic == ACCT_MAGIC &&
+        h.version == ACCT_VERSION && h.rec_size == sizeof(account_record)) {
+        *base = sizeof(h);
+        *count = h.count;
+        return 1;
+    }
+    *base = 0;
+    *count = sz > 0 ? (uint64_t)sz / sizeof(account_record) : 0;
+    return 0;
+}
+
+static acct_file_header *acct_hdr(void) {
+    return (acct_file_header *)g_acct.map;
+}
+
+// With the mmap mode requested, rewrites a bare accounts.db in the headered
+// layout. Runs at startup after recovery, before the handle table is opened.
+static int accounts_prepare(void) {
+    if (!g_acct.want_mmap) return 0;
+    int fd = open(ACCOUNTS_FILE, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    off_t base;
+    uint64_t count;
+    if (acct_layout(fd, &base, &count)) { close(fd); return 0; }
+
+    char tmpname[] = "accounts.db.tmpXXXXXX";
+    int out = mkstemp(tmpname);
+    if (out < 0) { close(fd); return -1; }
+    fchmod(out, 0644);
+    acct_file_header h;
+    bzero(&h, sizeof(h));
+    h.magic = ACCT_MAGIC;
+    h.version = ACCT_VERSION;
+    h.rec_size = sizeof(account_record);
+    h.count = count;
+    int rc = timed_write(out, &h, sizeof(h)) == (ssize_t)sizeof(h) ? 0 : -1;
+    account_record a;
+    for (uint64_t i = 0; rc == 0 && i < count; i++) {
+        if (timed_pread(fd, &a, sizeof(a), (off_t)(i * sizeof(a))) != (ssize_t)sizeof(a) ||
+            timed_write(out, &a, sizeof(a)) != (ssize_t)sizeof(a)) rc = -1;
+    }
+    if (rc == 0 && timed_fsync(out) != 0) rc = -1;
+    close(out);
+    close(fd);
+    if (rc == 0 && rename(tmpname, ACCOUNTS_FILE) == 0) return 0;
+    unlink(tmpname);
+    return -1;
+}
+
+// Picks up the layout of the open accounts.db and maps it in mmap mode.
+static int accounts_map(void) {
+    g_acct.headered = acct_layout(g_fd.accounts, &g_acct.base, &g_acct.count);
+    g_acct.size = lseek(g_fd.accounts, 0, SEEK_END);
+    if (!g_acct.want_mmap || !g_acct.headered) return 0;
+    void *m = mmap(NULL, ACCT_MAP_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED, g_fd.accounts, 0);
+    if (m == MAP_FAILED) { perror("mmap accounts.db"); return -1; }
+    g_acct.map = (char *)m;
+    return 0;
+}
+
+static void accounts_unmap(void) {
+    if (!g_acct.map) return;
+    msync(g_acct.map, (size_t)g_acct.size, MS_SYNC);
+    munmap(g_acct.map, ACCT_MAP_RESERVE);
+    g_acct.map = NULL;
+}
+
+static int accounts_sync(void) {
+    if (g_acct.map) return msync(g_acct.map, (size_t)g_acct.size, MS_SYNC);
+    return timed_fsync(g_fd.accounts);
+}
+
+static int write_account_at(off_t off, const account_record *a) {
+    if (g_acct.map) {
+        memcpy(g_acct.map + off, a, sizeof(*a));
+        return 0;
+    }
+    return timed_pwrite(g_fd.accounts, a, sizeof(*a), off) == (ssize_t)sizeof(*a) ? 0 : -1;
+}
+
+// Appends a record and makes it durable. The caller holds g_acct_idx_lock
+// for writing, which serializes appenders.
+static int account_append(const account_record *a, off_t *off_out) {
+    int afd = g_fd.accounts;
+    if (!g_acct.headered) {
+        off_t off = lseek(afd, 0, SEEK_END);
+        if (timed_pwrite(afd, a, sizeof(*a), off) != (ssize_t)sizeof(*a)) return -1;
+        timed_fsync(afd);
+        *off_out = off;
+        return 0;
+    }
+
+    uint64_t count = g_acct.map ? acct_hdr()->count : g_acct.count;
+    off_t off = g_acct.base + (off_t)(count * sizeof(*a));
+    if (off + (off_t)sizeof(*a) > g_acct.size) {
+        off_t nsize = off + (off_t)(ACCT_GROW_SLOTS * sizeof(*a));
+        if (g_acct.map && nsize > (off_t)ACCT_MAP_RESERVE) return -1;
+        if (ftruncate(afd, nsize) != 0) return -1;
+        g_acct.size = nsize;
+    }
+    if (g_acct.map) {
+        memcpy(g_acct.map + off, a, sizeof(*a));
+        acct_hdr()->count = count + 1;
+        // The page holding the record, and the header page
+        long pg = sysconf(_SC_PAGESIZE);
+        off_t start = off / pg * pg;
+        if (msync(g_acct.map + start, (size_t)(off + (off_t)sizeof(*a) - start), MS_SYNC) != 0 ||
+            msync(g_acct.map, sizeof(acct_file_header), MS_SYNC) != 0) return -1;
+    } else {
+        uint64_t n = count + 1;
+        if (timed_pwrite(afd, a, sizeof(*a), off) != (ssize_t)sizeof(*a) ||
+            timed_pwrite(afd, &n, sizeof(n), offsetof(acct_file_header, count)) != (ssize_t)sizeof(n)) return -1;
+        timed_fsync(afd);
+        g_acct.count = n;
+    }
+    *off_out = off;
+    return 0;
+}
+
+// Resident account index, keyed both ways: user id -> offset (aux = account
+// number) and account number -> offset (aux = user id). Built at db_init after
+// the account-number migration; db_add_user_with_account appends to it.
+static pthread_rwlock_t g_acct_idx_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int_index g_acct_by_user;
+static int_index g_acct_by_number;
+
+static int account_index_add(const account_record *a, off_t off) {
+    if (int_index_put(&g_acct_by_user, a->user_id, off, a->account_number) != 0) return -1;
+    return int_index_put(&g_acct_by_number, a->account_number, off, a->user_id);
+}
+
+// Same for accounts.db.
+static int build_account_index(int afd, off_t from, int loaded) {
+    off_t base;
+    uint64_t n;
+    acct_layout(afd, &base, &n);
+    if (!loaded && int_index_init(&g_acct_by_user, (size_t)n) != 0) return -1;
+    if (!loaded && int_index_init(&g_acct_by_number, (size_t)n) != 0) return -1;
+
+    off_t off = from, end = base + (off_t)(n * sizeof(account_record));
+    account_record a;
+    while (off < end && timed_pread(afd, &a, sizeof(a), off) == (ssize_t)sizeof(a)) {
+        if (account_index_add(&a, off) != 0) return -1;
+        off += sizeof(a);
+    }
+    return 0;
+}
+
+static int read_account_at(int fd, off_t off, account_record *out, off_t *off_out) {
+    account_record a;
+    if (g_acct.map) memcpy(&a, g_acct.map + off, sizeof(a));
+    else if (timed_pread(fd, &a, sizeof(a), off) != (ssize_t)sizeof(a)) return -1;
+    if (out) *out = a;
+    if (off_out) *off_out = off;
+    return 0;
+}
+
+static int account_slot_by_user(int uid, off_t *off_out, int *acct_no_out) {
+    rw_rdlock(&g_acct_idx_lock);
+    int rc = int_index_get(&g_acct_by_user, uid, off_out, acct_no_out);
+    rw_unlock(&g_acct_idx_lock);
+    return rc;
+}
+
+static int account_slot_by_number(int acct_no, off_t *off_out) {
+    rw_rdlock(&g_acct_idx_lock);
+    int rc = int_index_get(&g_acct_by_number, acct_no, off_out, NULL);
+    rw_unlock(&g_acct_idx_lock);
+    return rc;
+}
+
+// Id and account-number allocator (ids.db). A sequence reserves ID_BLOCK
+// values at a time by persisting its new high-water mark, so handing one
+// out is a counter bump under a mutex and a crash only skips the unused
+// rest of a block. A clean shutdown stores the exact next values; a missing
+// or damaged file is rebuilt from the data files. Counters are 64-bit, but
+// values stop at INT_MAX because the record fields are int.
+#define ID_MAGIC   0x53444942u   /* "BIDS" */
+#define ID_VERSION 1
+#define ID_BLOCK   1024
+
+enum { SEQ_USER, SEQ_ACCOUNT, SEQ_ACCOUNT_NO, SEQ_LOAN, SEQ_COUNT };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hi[SEQ_COUNT];   /* no value at or above hi has been handed out */
+    uint32_t pad;
+    uint32_t crc;
+} id_file;
+
+static struct {
+    pthread_mutex_t mu;
+    int fd;
+    uint64_t next[SEQ_COUNT];
+    uint64_t hi[SEQ_COUNT];
+} g_ids = { .mu = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static int id_store(const uint64_t *hi) {
+    id_file f;
+    bzero(&f, sizeof(f));
+    f.magic = ID_MAGIC;
+    f.version = ID_VERSION;
+    memcpy(f.hi, hi, sizeof(f.hi));
+    f.crc = crc32_buf(&f, sizeof(f));
+    if (timed_pwrite(g_ids.fd, &f, sizeof(f), 0) != (ssize_t)sizeof(f)) return -1;
+    return timed_fdatasync(g_ids.fd);
+}
+
+// Largest int field in a file of fixed-size records starting at `start`.
+// Startup only.
+static int max_record_field(int fd, off_t start, size_t rec_sz, size_t field_off, int floor) {
+    char *buf = (char *)malloc(rec_sz);
+    int max = floor;
+    for (off_t off = start; buf && timed_pread(fd, buf, rec_sz, off) == (ssize_t)rec_sz; off += (off_t)rec_sz) {
+        int v;
+        memcpy(&v, buf + field_off, sizeof(v));
+        if (v > max) max = v;
+    }
+    free(buf);
+    return max;
+}
+
+static int id_alloc_load(void) {
+    g_ids.fd = open(IDS_FILE, O_RDWR | O_CREAT, 0644);
+    if (g_ids.fd < 0) return -1;
+
+    id_file f;
+    uint32_t crc = 0;
+    int ok = timed_pread(g_ids.fd, &f, sizeof(f), 0) == (ssize_t)sizeof(f) && f.magic == ID_MAGIC && f.version == ID_VERSION;
+    if (ok) {
+        crc = f.crc;
+        f.crc = 0;
+        ok = crc32_buf(&f, sizeof(f)) == crc;
+    }
+    if (ok) {
+        memcpy(g_ids.next, f.hi, sizeof(g_ids.next));
+    } else {
+        // Spare account slots are zeroed, so they never raise the maximum
+        off_t abase = g_acct.base;
+        g_ids.next[SEQ_USER] = (uint64_t)max_record_field(g_fd.users, 0, sizeof(user_record), offsetof(user_record, id), 0) + 1;
+        g_ids.next[SEQ_ACCOUNT] = (uint64_t)max_record_field(g_fd.accounts, abase, sizeof(account_record),
+                                                             offsetof(account_record, id), 0) + 1;
+        g_ids.next[SEQ_ACCOUNT_NO] = (uint64_t)max_record_field(g_fd.accounts, abase, sizeof(account_record),
+                                                                offsetof(account_record, account_number), 1000) + 1;
+        g_ids.next[SEQ_LOAN] = (uint64_t)max_record_field(g_fd.loans, 0, sizeof(loan_record), offsetof(loan_record, id), 0) + 1;
+        fprintf(stderr, "ids.db: rebuilt from the data files\n");
+    }
+    memcpy(g_ids.hi, g_ids.next, sizeof(g_ids.hi));
+    return id_store(g_ids.hi);
+}
+
+// Next value of a sequence, or -1 if it cannot be reserved or would not
+// fit an int.
+static int id_next(int seq) {
+    int id = -1;
+    pthread_mutex_lock(&g_ids.mu);
+    if (g_ids.next[seq] == g_ids.hi[seq]) {
+        uint64_t hi[SEQ_COUNT];
+        memcpy(hi, g_ids.hi, sizeof(hi));
+        hi[seq] += ID_BLOCK;
+        if (id_store(hi) == 0) g_ids.hi[seq] = hi[seq];
+    }
+    if (g_ids.next[seq] < g_ids.hi[seq] && g_ids.next[seq] <= INT_MAX) id = (int)g_ids.next[seq]++;
+    pthread_mutex_unlock(&g_ids.mu);
+    return id;
+}
+
+static void id_alloc_close(void) {
+    if (g_ids.fd < 0) return;
+    pthread_mutex_lock(&g_ids.mu);
+    id_store(g_ids.next);
+    close(g_ids.fd);
+    g_ids.fd = -1;
+    pthread_mutex_unlock(&g_ids.mu);
+}
+
+typedef struct {
+    int32_t acct_no;
+    int32_t type;
+    int32_t peer;         /* counterparty account for transfers, 0 otherwise */
+    int32_t pad;
+    int64_t amount;
+    int64_t balance;
+} txn_rec;
+
+// transactions.log format (txnlog.h). It is decided per file: a log that
+// starts with the binary header holds fixed-width records, anything else
+// text lines. db_set_binary_txn_log selects binary for a new log and has
+// db_init convert an existing text log.
+static struct {
+    int want_binary;
+    int binary;            /* format of the head segment */
+    uint64_t next_seq;     /* binary only; appends are serialised by the WAL mutex */
+} g_tlog;
+
+#define TLOG_START ((off_t)sizeof(txnlog_header))
+#define TLOG_REC   ((off_t)sizeof(txnlog_rec))
+
+void db_set_binary_txn_log(int enable) {
+    g_tlog.want_binary = enable;
+}
+
+// The log is a chain of segments. transactions.log is the head, the only
+// one written to; a checkpoint that finds it over the size limit renames
+// it to transactions.log.<id> and starts a new head. Closed segments are
+// never written again and are listed, with their time range, in
+// transactions.manifest. Positions handed to the index and history code
+// are (segment id << TXN_SEG_SHIFT) | offset, so they keep increasing in
+// log order and a pre-segment log is simply segment 0.
+#define TXN_SEG_SHIFT     40
+#define TXN_POS(id, off)  (((off_t)(id) << TXN_SEG_SHIFT) | (off))
+#define TXN_POS_SEG(pos)  ((uint32_t)((pos) >> TXN_SEG_SHIFT))
+#define TXN_POS_OFF(pos)  ((pos) & (((off_t)1 << TXN_SEG_SHIFT) - 1))
+#define TXN_SEG_MAGIC     0x464D5442u   /* "BTMF" */
+#define TXN_SEG_VERSION   1
+#define TXN_SEGMENT_BYTES (64LL * 1024 * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t crc;          /* over the header (crc zeroed) and the entries */
+} txn_manifest_header;
+
+typedef struct {
+    uint32_t id;
+    int32_t binary;
+    int64_t size;
+    int64_t min_ts;        /* first and last entry; the log is in time order */
+    int64_t max_ts;
+    uint64_t last_seq;     /* binary segments */
+} txn_segment;
+
+static struct {
+    pthread_rwlock_t lock; /* guards the table and g_fd.txn against rotation */
+    txn_segment *segs;     /* closed segments, ids 0..n-1 */
+    int *fds;              /* opened on first read, -1 until then */
+    size_t n, cap;
+    pthread_mutex_t open_mu;
+    off_t max_bytes;       /* head size that triggers rotation, 0 = never */
+} g_seg = { .lock = PTHREAD_RWLOCK_INITIALIZER, .open_mu = PTHREAD_MUTEX_INITIALIZER, .max_bytes = TXN_SEGMENT_BYTES };
+
+void db_set_txn_segment_bytes(long long bytes) {
+    g_seg.max_bytes = bytes > 0 ? (off_t)bytes : 0;
+}
+
+static const char *seg_path(uint32_t id, char *buf, size_t cap) {
+    snprintf(buf, cap, TXN_LOG ".%06u", id);
+    return buf;
+}
+
+static uint32_t seg_head_id(void) {
+    return (uint32_t)g_seg.n;
+}
+
+static int seg_push(const txn_segment *s, int fd) {
+    if (g_seg.n == g_seg.cap) {
+        size_t ncap = g_seg.cap ? g_seg.cap * 2 : 16;
+        txn_segment *ns = (txn_segment *)realloc(g_seg.segs, ncap * sizeof(*ns));
+        if (ns) g_seg.segs = ns;
+        int *nf = ns ? (int *)realloc(g_seg.fds, ncap * sizeof(*nf)) : NULL;
+        if (nf) g_seg.fds = nf;
+        if (!ns || !nf) return -1;
+        g_seg.cap = ncap;
+    }
+    g_seg.segs[g_seg.n] = *s;
+    g_seg.fds[g_seg.n++] = fd;
+    return 0;
+}
+
+static int txn_manifest_write(const txn_segment *segs, size_t n) {
+    size_t len = sizeof(txn_manifest_header) + n * sizeof(txn_segment);
+    char *buf = (char *)calloc(1, len);
+    if (!buf) return -1;
+    txn_manifest_header *h = (txn_manifest_header *)buf;
+    h->magic = TXN_SEG_MAGIC;
+    h->version = TXN_SEG_VERSION;
+    h->count = (uint32_t)n;
+    if (n) memcpy(buf + sizeof(*h), segs, n * sizeof(txn_segment));
+    h->crc = crc32_buf(buf, len);
+
+    char tmpname[] = "transactions.manifest.tmpXXXXXX";
+    int fd = mkstemp(tmpname);
+    if (fd < 0) { free(buf); return -1; }
+    fchmod(fd, 0644);
+    int rc = timed_write(fd, buf, len) == (ssize_t)len && timed_fsync(fd) == 0 ? 0 : -1;
+    close(fd);
+    free(buf);
+    if (rc == 0 && rename(tmpname, TXN_MANIFEST) != 0) rc = -1;
+    if (rc != 0) unlink(tmpname);
+    return rc;
+}
+
+// Replaces transactions.log with an empty head in the given format.
+static int txn_head_create(int binary) {
+    char tmpname[] = "transactions.log.tmpXXXXXX";
+    int fd = mkstemp(tmpname);
+    if (fd < 0) return -1;
+    fchmod(fd, 0644);
+    txnlog_header h;
+    txnlog_header_init(&h);
+    int rc = (!binary || timed_write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h)) && timed_fsync(fd) == 0 ? 0 : -1;
+    close(fd);
+    if (rc == 0 && rename(tmpname, TXN_LOG) != 0) rc = -1;
+    if (rc != 0) unlink(tmpname);
+    return rc;
+}
+
+// Loads the manifest and finishes a rotation that a crash interrupted.
+// Runs before journal recovery, which works on the head alone.
+static int txn_segments_load(void) {
+    int fd = open(TXN_MANIFEST, O_RDONLY);
+    if (fd >= 0) {
+        txn_manifest_header h;
+        off_t sz = lseek(fd, 0, SEEK_END);
+        char *buf = sz >= (off_t)sizeof(h) ? (char *)malloc((size_t)sz) : NULL;
+        int ok = buf && timed_pread(fd, buf, (size_t)sz, 0) == (ssize_t)sz;
+        close(fd);
+        if (ok) {
+            memcpy(&h, buf, sizeof(h));
+            uint32_t crc = h.crc;
+            ((txn_manifest_header *)buf)->crc = 0;
+            ok = h.magic == TXN_SEG_MAGIC && h.version == TXN_SEG_VERSION &&
+                 (off_t)(sizeof(h) + h.count * sizeof(txn_segment)) == sz && crc32_buf(buf, (size_t)sz) == crc;
+        }
+        for (uint32_t i = 0; ok && i < h.count; i++) {
+            txn_segment s;
+            memcpy(&s, buf + sizeof(h) + i * sizeof(s), sizeof(s));
+            ok = s.id == i && seg_push(&s, -1) == 0;
+        }
+        free(buf);
+        if (!ok) { fprintf(stderr, "transactions.manifest: unreadable\n"); return -1; }
+    }
+
+    char path[64];
+    struct stat hs, ss;
+    for (size_t i = 0; i < g_seg.n; i++) {
+        if (stat(seg_path((uint32_t)i, path, sizeof(path)), &ss) != 0) {
+            fprintf(stderr, "%s: missing\n", path);
+            return -1;
+        }
+    }
+    // Rotation links the head to its segment name, records it in the
+    // manifest and then swaps in a new head; redo or undo a partial one
+    if (g_seg.n > 0 && stat(TXN_LOG, &hs) == 0 && hs.st_ino == ss.st_ino && hs.st_dev == ss.st_dev &&
+        txn_head_create(g_seg.segs[g_seg.n - 1].binary) != 0) return -1;
+    unlink(seg_path(seg_head_id(), path, sizeof(path)));
+    return 0;
+}
+
+static void txn_segments_free(void) {
+    rw_wrlock(&g_seg.lock);
+    for (size_t i = 0; i < g_seg.n; i++) if (g_seg.fds[i] >= 0) close(g_seg.fds[i]);
+    free(g_seg.segs);
+    free(g_seg.fds);
+    g_seg.segs = NULL;
+    g_seg.fds = NULL;
+    g_seg.n = g_seg.cap = 0;
+    rw_unlock(&g_seg.lock);
+}
+
+// Descriptor and format of a segment; the caller holds g_seg.lock (or runs
+// at startup). Closed segments are opened the first time something reads them.
+static int seg_open_locked(uint32_t id, int *binary) {
+    if (id == seg_head_id()) {
+        *binary = g_tlog.binary;
+        return g_fd.txn;
+    }
+    if (id > seg_head_id()) return -1;
+    *binary = g_seg.segs[id].binary;
+    pthread_mutex_lock(&g_seg.open_mu);
+    if (g_seg.fds[id] < 0) {
+        char path[64];
+        g_seg.fds[id] = open(seg_path(id, path, sizeof(path)), O_RDONLY);
+    }
+    pthread_mutex_unlock(&g_seg.open_mu);
+    return g_seg.fds[id];
+}
+
+// Size of a segment, given the head's; -1 past the head.
+static off_t seg_size(uint32_t id, off_t head_size) {
+    if (id < seg_head_id()) return (off_t)g_seg.segs[id].size;
+    return id == seg_head_id() ? head_size : -1;
+}
+
+static ssize_t txn_pread(off_t pos, void *buf, size_t len, int *binary) {
+    int bin = 0;
+    rw_rdlock(&g_seg.lock);
+    int fd = seg_open_locked(TXN_POS_SEG(pos), &bin);
+    ssize_t n = fd >= 0 ? timed_pread(fd, buf, len, TXN_POS_OFF(pos)) : -1;
+    rw_unlock(&g_seg.lock);
+    if (binary) *binary = bin;
+    return n;
+}
+
+static int txn_file_binary(int fd) {
+    txnlog_header h;
+    return timed_pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && txnlog_header_valid(&h);
+}
+
+// Sequence number that follows the last closed binary segment.
+static uint64_t seg_next_seq(void) {
+    for (size_t i = g_seg.n; i-- > 0;)
+        if (g_seg.segs[i].binary) return g_seg.segs[i].last_seq + 1;
+    return 1;
+}
+
+// Works out the format of an open head and, for a binary one, drops a torn
+// trailing record and finds the next sequence number.
+static int txn_log_detect(int tfd) {
+    g_tlog.binary = txn_file_binary(tfd);
+    g_tlog.next_seq = seg_next_seq();
+    if (!g_tlog.binary) return 0;
+
+    off_t sz = lseek(tfd, 0, SEEK_END);
+    off_t whole = TLOG_START + (sz - TLOG_START) / TLOG_REC * TLOG_REC;
+    if (whole != sz && ftruncate(tfd, whole) != 0) return -1;
+    for (off_t off = whole - TLOG_REC; off >= TLOG_START; off -= TLOG_REC) {
+        txnlog_rec r;
+        txn_entry e;
+        if (timed_pread(tfd, &r, sizeof(r), off) == (ssize_t)sizeof(r) && txnlog_decode(&r, &e) == 0) {
+            g_tlog.next_seq = r.seq + 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+static ssize_t parse_txn_buf(char *line, ssize_t n, txn_entry *e) {
+    if (n <= 0) return -1;
+    line[n] = '\0';
+    char *nl = memchr(line, '\n', (size_t)n);
+    if (!nl) return -1;
+    *nl = '\0';
+    if (txnlog_parse_line(line, e) != 0) return -1;
+    return nl - line + 1;
+}
+
+// Reads the entry at log position pos. Returns its length, or -1.
+static ssize_t read_txn_entry(off_t pos, txn_entry *e) {
+    union { char line[512]; txnlog_rec rec; } u;
+    int binary;
+    ssize_t n = txn_pread(pos, u.line, sizeof(u.line) - 1, &binary);
+    if (binary) return n >= (ssize_t)sizeof(u.rec) && txnlog_decode(&u.rec, e) == 0 ? (ssize_t)sizeof(u.rec) : -1;
+    return parse_txn_buf(u.line, n, e);
+}
+
+// First and last entry of a segment, for its manifest time range.
+static int seg_edges(int fd, int binary, off_t size, txn_entry *first, txn_entry *last) {
+    union { char line[512]; txnlog_rec rec; } u;
+    if (binary) {
+        if (size < TLOG_START + TLOG_REC) return -1;
+        if (timed_pread(fd, &u.rec, sizeof(u.rec), TLOG_START) != (ssize_t)sizeof(u.rec) || txnlog_decode(&u.rec, first) != 0) return -1;
+        if (timed_pread(fd, &u.rec, sizeof(u.rec), size - TLOG_REC) != (ssize_t)sizeof(u.rec) || txnlog_decode(&u.rec, last) != 0) return -1;
+        return 0;
+    }
+    if (parse_txn_buf(u.line, timed_pread(fd, u.line, sizeof(u.line) - 1, 0), first) < 0) return -1;
+    off_t from = size > (off_t)sizeof(u.line) - 1 ? size - ((off_t)sizeof(u.line) - 1) : 0;
+    ssize_t n = timed_pread(fd, u.line, (size_t)(size - from), from);
+    if (n < 2 || u.line[n - 1] != '\n') return -1;
+    ssize_t start = n - 1;
+    while (start > 0 && u.line[start - 1] != '\n') start--;
+    if (start == 0 && from > 0) return -1;
+    return parse_txn_buf(u.line + start, n - start, last) < 0 ? -1 : 0;
+}
+
+typedef int (*txn_fn)(const txn_entry *e, off_t pos, size_t len, void *arg);
+
+typedef struct {
+    txn_fn fn;
+    void *arg;
+    off_t pos;
+} txn_scan_ctx;
+
+static int txn_scan_text_line(const char *line, size_t len, void *arg) {
+    txn_scan_ctx *x = (txn_scan_ctx *)arg;
+    txn_entry e;
+    int rc = 0;
+    if (line[len - 1] == '\n' && txnlog_parse_line(line, &e) == 0) rc = x->fn(&e, x->pos, len, x->arg);
+    x->pos += (off_t)len;
+    return rc;
+}
+
+// Visits every entry of one file from offset `from` on, in log order,
+// passing base + offset as the position. Binary records are decoded
+// straight from the read buffer.
+static int txn_scan(int tfd, int binary, off_t base, off_t from, txn_fn fn, void *arg) {
+    if (!binary) {
+        txn_scan_ctx x = { fn, arg, base + from };
+        return scan_lines_from(tfd, from, txn_scan_text_line, &x);
+    }
+
+    enum { BATCH = 1024 };
+    txnlog_rec *buf = (txnlog_rec *)malloc(BATCH * sizeof(txnlog_rec));
+    if (!buf) return -1;
+    if (from < TLOG_START) from = TLOG_START;
+    int rc = 0;
+    for (;;) {
+        ssize_t n = timed_pread(tfd, buf, BATCH * sizeof(txnlog_rec), from);
+        if (n < 0) { if (errno == EINTR) continue; rc = -1; break; }
+        size_t cnt = (size_t)n / sizeof(txnlog_rec);
+        if (cnt == 0) break;
+        for (size_t i = 0; i < cnt; i++, from += TLOG_REC) {
+            txn_entry e;
+            if (txnlog_decode(&buf[i], &e) != 0) {
+                fprintf(stderr, "transactions.log: bad record at offset %lld\n", (long long)from);
+                goto done;
+            }
+            if ((rc = fn(&e, base + from, sizeof(txnlog_rec), arg)) != 0) goto done;
+        }
+    }
+done:
+    free(buf);
+    return rc;
+}
+
+// txn_scan across segments, starting at log position pos. Startup only.
+static int txn_scan_from(off_t pos, off_t head_size, txn_fn fn, void *arg) {
+    for (uint32_t id = TXN_POS_SEG(pos); id <= seg_head_id(); id++) {
+        off_t from = id == TXN_POS_SEG(pos) ? TXN_POS_OFF(pos) : 0;
+        if (from >= seg_size(id, head_size)) continue;
+        int binary;
+        int fd = seg_open_locked(id, &binary);
+        if (fd < 0) return -1;
+        int rc = txn_scan(fd, binary, TXN_POS(id, 0), from, fn, arg);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+// Index positions outside [*lo, *hi) cannot hold the first entry with
+// ts >= from_ts: segments ending before from_ts are skipped, and every
+// entry from the first segment starting at or after it qualifies.
+static void seg_seek_bounds(long long from_ts, off_t *lo, off_t *hi) {
+    rw_rdlock(&g_seg.lock);
+    uint32_t id = 0;
+    while (id < g_seg.n && g_seg.segs[id].max_ts < from_ts) id++;
+    *lo = TXN_POS(id, 0);
+    while (id < g_seg.n && g_seg.segs[id].min_ts < from_ts) id++;
+    *hi = id < g_seg.n ? TXN_POS(id, 0) : TXN_POS(seg_head_id() + 1, 0);
+    rw_unlock(&g_seg.lock);
+}
+
+// Position where entries newer than to_ts must begin: the first closed
+// segment that starts after it (the end of the log otherwise).
+static off_t seg_range_end(long long to_ts) {
+    rw_rdlock(&g_seg.lock);
+    uint32_t id = 0;
+    while (id < g_seg.n && g_seg.segs[id].min_ts <= to_ts) id++;
+    off_t end = id < g_seg.n ? TXN_POS(id, 0) : TXN_POS(seg_head_id() + 1, 0);
+    rw_unlock(&g_seg.lock);
+    return end;
+}
+
+// Per-account index of transactions.log (transactions.idx).
+//
+// Every log line gets a 16-byte tix_entry holding its account and byte
+// offset, appended in log order. In memory each account has a growable
+// offset array, so a history request preads just that account's lines.
+// The file is a cache of the log: on startup it is validated against the
+// log, the unindexed tail is caught up, and it is rebuilt from scratch if
+// it is missing or does not match.
+typedef struct {
+    int32_t acct_no;
+    int32_t pad;
+    int64_t off;
+} tix_entry;
+
+typedef struct {
+    off_t *offs;
+    size_t n, cap;
+} tix_list;
+
+static struct {
+    pthread_rwlock_t lock;
+    int_index by_acct;     /* acct_no -> position in lists (aux) */
+    tix_list *lists;
+    size_t nlists, cap;
+    off_t log_end;         /* log position of the next append */
+    int active;            /* set once loaded; append_txn then keeps it current */
+} g_tix = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+// Caller holds g_tix.lock for writing (or runs single-threaded at startup).
+static int tix_add(int acct_no, off_t off) {
+    int slot;
+    if (int_index_get(&g_tix.by_acct, acct_no, NULL, &slot) != 0) {
+        if (g_tix.nlists == g_tix.cap) {
+            size_t ncap = g_tix.cap ? g_tix.cap * 2 : 256;
+            tix_list *nl = (tix_list *)realloc(g_tix.lists, ncap * sizeof(*nl));
+            if (!nl) return -1;
+            g_tix.lists = nl;
+            g_tix.cap = ncap;
+        }
+        slot = (int)g_tix.nlists;
+        if (int_index_put(&g_tix.by_acct, acct_no, 0, slot) != 0) return -1;
+        memset(&g_tix.lists[g_tix.nlists++], 0, sizeof(tix_list));
+    }
+    tix_list *l = &g_tix.lists[slot];
+    if (l->n == l->cap) {
+        size_t ncap = l->cap ? l->cap * 2 : 8;
+        off_t *no = (off_t *)realloc(l->offs, ncap * sizeof(off_t));
+        if (!no) return -1;
+        l->offs = no;
+        l->cap = ncap;
+    }
+    l->offs[l->n++] = off;
+    return 0;
+}
+
+// Called from append_txn for live appends, which only the WAL committer
+// thread makes, so log_end is the position the entry was just written at.
+static void txn_index_append(int acct_no, size_t len) {
+    tix_entry e = { acct_no, 0, (int64_t)g_tix.log_end };
+    rw_wrlock(&g_tix.lock);
+    tix_add(acct_no, g_tix.log_end);
+    g_tix.log_end += (off_t)len;
+    rw_unlock(&g_tix.lock);
+    if (timed_write(g_fd.txn_idx, &e, sizeof(e)) != (ssize_t)sizeof(e)) {
+        // A short index file is caught up from the log on the next start
+    }
+}
+
+// Copies up to max offsets of an account starting at position `from`.
+// *total receives the account's entry count. Returns NULL when nothing was
+// copied (check *n_out / *total to tell empty from failure).
+static off_t *txn_index_copy(int acct_no, size_t from, size_t max, size_t *n_out, size_t *total) {
+    off_t *out = NULL;
+    int slot;
+    *n_out = *total = 0;
+    rw_rdlock(&g_tix.lock);
+    if (int_index_get(&g_tix.by_acct, acct_no, NULL, &slot) == 0) {
+        tix_list *l = &g_tix.lists[slot];
+        *total = l->n;
+        size_t n = from < l->n ? l->n - from : 0;
+        if (n > max) n = max;
+        if (n > 0 && (out = (off_t *)malloc(n * sizeof(off_t))) != NULL) {
+            memcpy(out, l->offs + from, n * sizeof(off_t));
+            *n_out = n;
+        }
+    }
+    rw_unlock(&g_tix.lock);
+    return out;
+}
+
+// Index position of the account's first entry at or after log position pos.
+static size_t txn_index_lower_bound(int acct_no, off_t pos) {
+    size_t lo = 0, hi = 0;
+    int slot;
+    rw_rdlock(&g_tix.lock);
+    if (int_index_get(&g_tix.by_acct, acct_no, NULL, &slot) == 0) {
+        tix_list *l = &g_tix.lists[slot];
+        hi = l->n;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (l->offs[mid] < pos) lo = mid + 1;
+            else hi = mid;
+        }
+    }
+    rw_unlock(&g_tix.lock);
+    return lo;
+}
+
+typedef struct {
+    tix_entry buf[1024];
+    size_t nbuf;
+    size_t added;
+    int failed;
+} tix_scan_ctx;
+
+static void tix_scan_flush(tix_scan_ctx *x) {
+    size_t len = x->nbuf * sizeof(tix_entry);
+    if (len && timed_write(g_fd.txn_idx, x->buf, len) != (ssize_t)len) x->failed = 1;
+    x->nbuf = 0;
+}
+
+static int tix_scan_entry(const txn_entry *e, off_t off, size_t len, void *arg) {
+    tix_scan_ctx *x = (tix_scan_ctx *)arg;
+    (void)len;
+    if (tix_add(e->acct_no, off) != 0) return -1;
+    tix_entry t = { e->acct_no, 0, (int64_t)off };
+    x->buf[x->nbuf++] = t;
+    x->added++;
+    if (x->nbuf == sizeof(x->buf) / sizeof(x->buf[0])) tix_scan_flush(x);
+    return 0;
+}
+
+// Loads the persisted entries that still match the log and returns the log
+// position where indexing has to resume.
+static off_t txn_index_load_file(off_t head_size) {
+    off_t isz = lseek(g_fd.txn_idx, 0, SEEK_END);
+    size_t count = isz > 0 ? (size_t)isz / sizeof(tix_entry) : 0;
+    tix_entry *ents = count ? (tix_entry *)malloc(count * sizeof(tix_entry)) : NULL;
+    if (!ents || timed_pread(g_fd.txn_idx, ents, count * sizeof(tix_entry), 0) != (ssize_t)(count * sizeof(tix_entry))) {
+        free(ents);
+        return isz == 0 || ftruncate(g_fd.txn_idx, 0) == 0 ? 0 : -1;
+    }
+
+    // Entries must be strictly increasing positions inside the log
+    size_t valid = 0;
+    while (valid < count && ents[valid].acct_no > 0 && ents[valid].off >= 0 &&
+           TXN_POS_OFF(ents[valid].off) < seg_size(TXN_POS_SEG(ents[valid].off), head_size) &&
+           (valid == 0 || ents[valid].off > ents[valid - 1].off))
+        valid++;
+
+    // The last one must still start an entry for the same account
+    off_t resume = 0;
+    if (valid > 0) {
+        char prev = '\n';
+        txn_entry e;
+        ssize_t len;
+        off_t last = (off_t)ents[valid - 1].off, off = TXN_POS_OFF(last);
+        int binary;
+        seg_open_locked(TXN_POS_SEG(last), &binary);
+        int aligned = binary ? off >= TLOG_START && (off - TLOG_START) % TLOG_REC == 0
+                             : off == 0 || (txn_pread(last - 1, &prev, 1, NULL) == 1 && prev == '\n');
+        if (aligned && (len = read_txn_entry(last, &e)) > 0 && e.acct_no == ents[valid - 1].acct_no)
+            resume = last + (off_t)len;
+        else
+            valid = 0;
+    }
+    for (size_t i = 0; i < valid; i++) {
+        if (tix_add(ents[i].acct_no, (off_t)ents[i].off) != 0) { valid = 0; resume = 0; break; }
+    }
+    free(ents);
+    if ((off_t)(valid * sizeof(tix_entry)) != isz && ftruncate(g_fd.txn_idx, (off_t)(valid * sizeof(tix_entry))) != 0) return -1;
+    return resume;
+}
+
+static int txn_index_load(void) {
+    if (int_index_init(&g_tix.by_acct, 1024) != 0) return -1;
+    off_t head_size = lseek(g_fd.txn, 0, SEEK_END);
+
+    off_t resume = txn_index_load_file(head_size);
+    if (resume < 0) return -1;
+
+    tix_scan_ctx *x = (tix_scan_ctx *)calloc(1, sizeof(*x));
+    if (!x) return -1;
+    int rc = txn_scan_from(resume, head_size, tix_scan_entry, x);
+    tix_scan_flush(x);
+    if (x->failed) rc = -1;
+    if (x->added > 0 && rc == 0)
+        fprintf(stderr, "txn index: indexed %zu entr%s of transactions.log\n", x->added, x->added == 1 ? "y" : "ies");
+    free(x);
+
+    g_tix.log_end = TXN_POS(seg_head_id(), head_size);
+    g_tix.active = 1;
+    return rc;
+}
+
+static void txn_index_free(void) {
+    rw_wrlock(&g_tix.lock);
+    g_tix.active = 0;
+    for (size_t i = 0; i < g_tix.nlists; i++) free(g_tix.lists[i].offs);
+    free(g_tix.lists);
+    g_tix.lists = NULL;
+    g_tix.nlists = g_tix.cap = 0;
+    int_index_free(&g_tix.by_acct);
+    rw_unlock(&g_tix.lock);
+}
+
+static int append_txn(int tfd, time_t ts, const txn_rec *t) {
+    txn_entry e = { (long long)ts, t->acct_no, t->type, t->peer, (long long)t->amount, (long long)t->balance };
+    union { char line[512]; txnlog_rec rec; } u;
+    int n;
+    if (g_tlog.binary) {
+        txnlog_encode(&e, g_tlog.next_seq++, &u.rec);
+        n = (int)sizeof(u.rec);
+    } else {
+        n = txnlog_format_line(&e, u.line, sizeof(u.line));
+    }
+    if (timed_write(tfd, &u, (size_t)n) != n) return -1;
+    if (g_tix.active) txn_index_append(t->acct_no, (size_t)n);
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    uint64_t seq;
+    txnlog_rec buf[1024];
+    size_t n;
+    int failed;
+} txn_convert_ctx;
+
+static void txn_convert_flush(txn_convert_ctx *x) {
+    size_t len = x->n * sizeof(txnlog_rec);
+    if (len && timed_write(x->fd, x->buf, len) != (ssize_t)len) x->failed = 1;
+    x->n = 0;
+}
+
+static int txn_convert_entry(const txn_entry *e, off_t off, size_t len, void *arg) {
+    txn_convert_ctx *x = (txn_convert_ctx *)arg;
+    (void)off; (void)len;
+    txnlog_encode(e, x->seq++, &x->buf[x->n++]);
+    if (x->n == sizeof(x->buf) / sizeof(x->buf[0])) txn_convert_flush(x);
+    return x->failed ? -1 : 0;
+}
+
+// With db_set_binary_txn_log on, gives an empty log the binary header and
+// rewrites a text head as binary records; closed segments keep their format.
+// Runs at startup before the handle table is opened; a binary log is left
+// as it is either way.
+static int txn_log_prepare(void) {
+    int tfd = open(TXN_LOG, O_RDWR | O_CREAT, 0644);
+    if (tfd < 0) return -1;
+    if (txn_log_detect(tfd) != 0 || !g_tlog.want_binary || g_tlog.binary) { close(tfd); return 0; }
+
+    char tmpname[] = "transactions.log.tmpXXXXXX";
+    txn_convert_ctx *x = (txn_convert_ctx *)calloc(1, sizeof(*x));
+    if (!x || (x->fd = mkstemp(tmpname)) < 0) { free(x); close(tfd); return -1; }
+    fchmod(x->fd, 0644);
+    x->seq = seg_next_seq();
+
+    txnlog_header h;
+    txnlog_header_init(&h);
+    int rc = timed_write(x->fd, &h, sizeof(h)) == (ssize_t)sizeof(h) ? 0 : -1;
+    if (rc == 0) rc = txn_scan(tfd, 0, 0, 0, txn_convert_entry, x);
+    txn_convert_flush(x);
+    if (x->failed || timed_fsync(x->fd) != 0) rc = -1;
+    close(x->fd);
+    close(tfd);
+    if (rc == 0 && rename(tmpname, TXN_LOG) == 0) {
+        unlink(TXN_INDEX);
+        if (x->seq > seg_next_seq())
+            fprintf(stderr, "transactions.log: converted %llu entries to binary\n", (unsigned long long)(x->seq - seg_next_seq()));
+    } else {
+        unlink(tmpname);
+        rc = -1;
+    }
+    free(x);
+    return rc;
+}
+
+
+// Startup snapshot (snapshot.db): the user and account indexes as of the
+// last checkpoint, with the data file positions they cover. db_init loads
+// it and indexes only the records appended since, instead of reading every
+// record of users.db and accounts.db. Keys never change in place and
+// records are never removed, so a snapshot stays valid for as long as the
+// files still hold what it covers; anything else falls back to a full scan.
+#define SNAP_MAGIC   0x50414E53u   /* "SNAP" */
+#define SNAP_VERSION 1
+
+static int g_snap_ready;   /* set once db_init has built complete indexes */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t users_end;     /* users.db bytes covered */
+    int64_t accounts_base; /* accounts.db layout the offsets belong to */
+    int64_t accounts_end;  /* accounts.db bytes covered */
+    uint64_t nusers;       /* snap_user entries that follow */
+    uint64_t by_user_cap;  /* then the two account index slot arrays */
+    uint64_t by_number_cap;
+    uint32_t pad;
+    uint32_t crc;          /* over the header (crc zeroed) and the payload */
+} snap_header;
+
+typedef struct {
+    int32_t id;
+    int32_t pad;
+    int64_t off;
+    char username[USERNAME_MAX];
+} snap_user;
+
+static off_t accounts_end(void) {
+    if (!g_acct.headered) return lseek(g_fd.accounts, 0, SEEK_END);
+    uint64_t count = g_acct.map ? acct_hdr()->count : g_acct.count;
+    return g_acct.base + (off_t)(count * sizeof(account_record));
+}
+
+static int snapshot_write(void) {
+    if (!g_snap_ready) return 0;
+    rw_rdlock(&g_user_idx_lock);
+    rw_rdlock(&g_acct_idx_lock);
+    snap_header h;
+    bzero(&h, sizeof(h));
+    h.magic = SNAP_MAGIC;
+    h.version = SNAP_VERSION;
+    h.users_end = lseek(g_fd.users, 0, SEEK_END);
+    h.accounts_base = g_acct.base;
+    h.accounts_end = accounts_end();
+    h.nusers = g_user_by_name.count;
+    h.by_user_cap = g_acct_by_user.cap;
+    h.by_number_cap = g_acct_by_number.cap;
+    size_t len = sizeof(h) + h.nusers * sizeof(snap_user) + (h.by_user_cap + h.by_number_cap) * sizeof(int_slot);
+    char *buf = (char *)calloc(1, len);
+    if (buf) {
+        // The name index holds everything: key = username, aux = id
+        snap_user *su = (snap_user *)(buf + sizeof(h));
+        size_t n = 0;
+        for (size_t i = 0; i < g_user_by_name.cap && n < h.nusers; i++) {
+            const str_slot *sl = &g_user_by_name.slots[i];
+            if (!sl->key) continue;
+            su[n].id = sl->aux;
+            su[n].off = (int64_t)sl->off;
+            memcpy(su[n].username, sl->key, strnlen(sl->key, USERNAME_MAX));   /* a full field has no NUL */
+            n++;
+        }
+        char *p = (char *)(su + h.nusers);
+        memcpy(p, g_acct_by_user.slots, h.by_user_cap * sizeof(int_slot));
+        memcpy(p + h.by_user_cap * sizeof(int_slot), g_acct_by_number.slots, h.by_number_cap * sizeof(int_slot));
+    }
+    rw_unlock(&g_acct_idx_lock);
+    rw_unlock(&g_user_idx_lock);
+    if (!buf) return -1;
+
+    memcpy(buf, &h, sizeof(h));
+    ((snap_header *)buf)->crc = crc32_buf(buf, len);
+    char tmpname[] = "snapshot.db.tmpXXXXXX";
+    int fd = mkstemp(tmpname);
+    int rc = fd >= 0 && timed_write(fd, buf, len) == (ssize_t)len && timed_fsync(fd) == 0 ? 0 : -1;
+    if (fd >= 0) { fchmod(fd, 0644); close(fd); }
+    free(buf);
+    if (rc == 0 && rename(tmpname, SNAPSHOT_FILE) != 0) rc = -1;
+    if (rc != 0 && fd >= 0) unlink(tmpname);
+    return rc;
+}
+
+// Loads the indexes from snapshot.db and reports where users.db and
+// accounts.db have to be indexed from. Returns -1, with the indexes
+// untouched, when there is no snapshot that matches the files.
+static int snapshot_load(off_t *users_from, off_t *accounts_from) {
+    int fd = open(SNAPSHOT_FILE, O_RDONLY);
+    if (fd < 0) return -1;
+    off_t sz = lseek(fd, 0, SEEK_END);
+    char *buf = sz >= (off_t)sizeof(snap_header) ? (char *)malloc((size_t)sz) : NULL;
+    int ok = buf && timed_pread(fd, buf, (size_t)sz, 0) == (ssize_t)sz;
+    close(fd);
+
+    snap_header h;
+    if (ok) {
+        memcpy(&h, buf, sizeof(h));
+        ((snap_header *)buf)->crc = 0;
+        ok = h.magic == SNAP_MAGIC && h.version == SNAP_VERSION &&
+             (uint64_t)sz == sizeof(h) + h.nusers * sizeof(snap_user) + (h.by_user_cap + h.by_number_cap) * sizeof(int_slot) &&
+             crc32_buf(buf, (size_t)sz) == h.crc &&
+             h.users_end <= lseek(g_fd.users, 0, SEEK_END) &&
+             h.accounts_base == g_acct.base && h.accounts_end <= accounts_end();
+    }
+    if (ok) {
+        const snap_user *su = (const snap_user *)(buf + sizeof(h));
+        const int_slot *by_user = (const int_slot *)(su + h.nusers);
+        ok = str_index_init(&g_user_by_name, (size_t)h.nusers) == 0 && int_index_init(&g_user_by_id, (size_t)h.nusers) == 0;
+        for (uint64_t i = 0; ok && i < h.nusers; i++) {
+            user_record u;
+            bzero(&u, sizeof(u));
+            u.id = su[i].id;
+            memcpy(u.username, su[i].username, USERNAME_MAX);
+            ok = user_index_add(&u, (off_t)su[i].off) == 0;
+        }
+        if (ok) ok = int_index_load(&g_acct_by_user, by_user, (size_t)h.by_user_cap) == 0;
+        if (ok) ok = int_index_load(&g_acct_by_number, by_user + h.by_user_cap, (size_t)h.by_number_cap) == 0;
+        if (!ok) {
+            str_index_free(&g_user_by_name);
+            int_index_free(&g_user_by_id);
+            int_index_free(&g_acct_by_user);
+            int_index_free(&g_acct_by_number);
+        }
+    }
+    free(buf);
+    if (!ok) return -1;
+    *users_from = (off_t)h.users_end;
+    *accounts_from = (off_t)h.accounts_end;
+    return 0;
+}
+
+// Write-ahead redo log (accounts.journal).
+//
+// Every account mutation is described by one wal_record carrying the new
+// account images and the transaction-log entries it produces. Records are
+// queued in memory and a single committer thread writes each batch with one
+// write() + fdatasync(), so concurrent clients share the cost of a flush.
+// Callers keep their account stripes locked until their record is durable and
+// only then pwrite accounts.db, which therefore never holds unlogged state.
+//
+// The journal header records how much of transactions.log was durable at the
+// last checkpoint. Recovery truncates the log back to that point and replays
+// every intact record, re-applying balances and re-appending their lines.
+#define WAL_HDR_MAGIC        0x4C415742u   /* "BWAL" */
+#define WAL_REC_MAGIC        0x52415742u   /* "BWAR" */
+#define WAL_VERSION          1
+#define WAL_CHECKPOINT_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t txn_log_off;  /* transactions.log size covered by the last checkpoint */
+    uint64_t next_lsn;
+    uint32_t pad;
+    uint32_t crc;
+} wal_header;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;          /* over the record with crc zeroed */
+    uint64_t lsn;
+    int64_t  ts;
+    int32_t  nupd;
+    int32_t  ntxn;
+    int64_t  upd_off[2];
+    account_record upd[2];
+    txn_rec  txn[2];
+} wal_record;
+
+static struct {
+    pthread_mutex_t mu;
+    pthread_cond_t  work;      /* committer: records are pending */
+    pthread_cond_t  durable;   /* writers: durable_lsn advanced */
+    pthread_cond_t  gate;      /* checkpoint quiesce */
+    pthread_t thread;
+    int jfd;
+    char *buf, *spare;
+    size_t len, cap;
+    uint64_t next_lsn;
+    uint64_t durable_lsn;
+    int64_t last_ts;       /* keeps transactions.log timestamps non-decreasing */
+    off_t woff;            /* journal offset of the next batch */
+    off_t jsize;           /* journal size including queued records */
+    int inflight;
+    int ckpt_pending;
+    int running;
+    int failed;
+} g_wal = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .durable = PTHREAD_COND_INITIALIZER,
+    .gate = PTHREAD_COND_INITIALIZER,
+    .jfd = -1,
+};
+
+static void wal_record_init(wal_record *r) {
+    bzero(r, sizeof(*r));
+    r->magic = WAL_REC_MAGIC;
+    r->ts = (int64_t)time(NULL);
+}
+
+static void wal_add_update(wal_record *r, off_t off, const account_record *a) {
+    r->upd_off[r->nupd] = (int64_t)off;
+    r->upd[r->nupd] = *a;
+    r->nupd++;
+}
+
+static void wal_add_txn(wal_record *r, int acct_no, int type, long long amount, long long balance, int peer) {
+    txn_rec *t = &r->txn[r->ntxn++];
+    t->acct_no = acct_no;
+    t->type = type;
+    t->peer = peer;
+    t->amount = amount;
+    t->balance = balance;
+}
+
+static int wal_record_valid(const wal_record *r, uint64_t expect_lsn) {
+    if (r->magic != WAL_REC_MAGIC || r->lsn != expect_lsn) return 0;
+    if (r->nupd < 0 || r->nupd > 2 || r->ntxn < 0 || r->ntxn > 2) return 0;
+    wal_record tmp = *r;
+    tmp.crc = 0;
+    return crc32_buf(&tmp, sizeof(tmp)) == r->crc;
+}
+
+static int wal_write_header(int jfd, uint64_t txn_log_off, uint64_t next_lsn) {
+    wal_header h;
+    bzero(&h, sizeof(h));
+    h.magic = WAL_HDR_MAGIC;
+    h.version = WAL_VERSION;
+    h.txn_log_off = txn_log_off;
+    h.next_lsn = next_lsn;
+    h.crc = crc32_buf(&h, sizeof(h));
+    if (timed_pwrite(jfd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) return -1;
+    if (ftruncate(jfd, sizeof(h)) != 0) return -1;
+    return timed_fdatasync(jfd);
+}
+
+static int wal_read_header(int jfd, wal_header *h) {
+    if (timed_pread(jfd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h)) return -1;
+    uint32_t crc = h->crc;
+    h->crc = 0;
+    if (h->magic != WAL_HDR_MAGIC || h->version != WAL_VERSION || crc32_buf(h, sizeof(*h)) != crc) return -1;
+    h->crc = crc;
+    return 0;
+}
+
+// Applies one durable record to accounts.db. Replays are idempotent because
+// records carry absolute balances rather than deltas.
+static int wal_apply_updates(int afd, const wal_record *r) {
+    for (int i = 0; i < r->nupd; i++) {
+        if (timed_pwrite(afd, &r->upd[i], sizeof(r->upd[i]), (off_t)r->upd_off[i]) != (ssize_t)sizeof(r->upd[i]))
+            return -1;
+    }
+    return 0;
+}
+
+static int recover_accounts_from_journal(void) {
+    int jfd = open(JOURNAL_FILE, O_RDWR | O_CREAT, 0644);
+    if (jfd < 0) return -1;
+
+    wal_header h;
+    if (wal_read_header(jfd, &h) != 0) {
+        // Missing or pre-WAL journal: nothing to replay
+        close(jfd);
+        return 0;
+    }
+
+    int afd = open(ACCOUNTS_FILE, O_RDWR);
+    int tfd = open(TXN_LOG, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (afd < 0 || tfd < 0) { if (afd >= 0) close(afd); if (tfd >= 0) close(tfd); close(jfd); return -1; }
+
+    // Lines past the checkpoint may be missing or torn; the journal is the
+    // authority for them, so drop and regenerate.
+    off_t tsz = lseek(tfd, 0, SEEK_END);
+    if (tsz > (off_t)h.txn_log_off) {
+        if (ftruncate(tfd, (off_t)h.txn_log_off) != 0) { close(afd); close(tfd); close(jfd); return -1; }
+        // Indexed offsets past the cut may now land mid-line
+        unlink(TXN_INDEX);
+    }
+    if (txn_log_detect(tfd) != 0) { close(afd); close(tfd); close(jfd); return -1; }
+
+    off_t off = sizeof(h);
+    uint64_t lsn = h.next_lsn;
+    wal_record r;
+    int replayed = 0;
+    while (timed_pread(jfd, &r, sizeof(r), off) == (ssize_t)sizeof(r) && wal_record_valid(&r, lsn)) {
+        wal_apply_updates(afd, &r);
+        for (int i = 0; i < r.ntxn; i++) append_txn(tfd, (time_t)r.ts, &r.txn[i]);
+        off += sizeof(r);
+        lsn++;
+        replayed++;
+    }
+
+    int rc = 0;
+    if (timed_fsync(afd) != 0 || timed_fsync(tfd) != 0) rc = -1;
+    tsz = lseek(tfd, 0, SEEK_END);
+    if (rc == 0 && wal_write_header(jfd, (uint64_t)tsz, lsn) != 0) rc = -1;
+    if (replayed > 0) fprintf(stderr, "journal: replayed %d record(s)\n", replayed);
+
+    close(afd);
+    close(tfd);
+    close(jfd);
+    return rc;
+}
+
+static void *wal_committer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_wal.mu);
+    for (;;) {
+        while (g_wal.len == 0 && g_wal.running) pthread_cond_wait(&g_wal.work, &g_wal.mu);
+        if (g_wal.len == 0 && !g_wal.running) break;
+
+        // Swap buffers so writers can keep queueing while this batch flushes
+        char *batch = g_wal.buf;
+        size_t blen = g_wal.len;
+        uint64_t last = g_wal.next_lsn - 1;
+        off_t at = g_wal.woff;
+        g_wal.buf = g_wal.spare;
+        g_wal.spare = batch;
+        g_wal.len = 0;
+        g_wal.woff += (off_t)blen;
+        // After a failure nothing more is made durable: those writers have
+        // been refused already
+        int ok = !g_wal.failed;
+        pthread_mutex_unlock(&g_wal.mu);
+
+        ok = ok && timed_pwrite(g_wal.jfd, batch, blen, at) == (ssize_t)blen && timed_fdatasync(g_wal.jfd) == 0;
+        if (!ok) {
+            // Its writers are refused, so recovery must not replay the batch
+            // from whatever reached the journal: best effort
+            memset(batch, 0, blen);
+            if (timed_pwrite(g_wal.jfd, batch, blen, at) == (ssize_t)blen) timed_fsync(g_wal.jfd);
+        }
+        // Only durable records reach transactions.log and its index, in LSN
+        // order. A failed append leaves the lines to journal replay on the
+        // next start, so no further checkpoint may cover them.
+        int logged = 1;
+        for (size_t i = 0; ok && i < blen / sizeof(wal_record); i++) {
+            const wal_record *r = (const wal_record *)batch + i;
+            for (int k = 0; k < r->ntxn; k++)
+                if (append_txn(g_fd.txn, (time_t)r->ts, &r->txn[k]) != 0) logged = 0;
+        }
 
-static int ensure_file(const char *path, size_t rec_size) {
-    (void)rec_size; 
-    int fd = open(path, O_RDWR | O_CREAT, 0644);
-    if (fd < 0) return -1;
-    return fd;
+        pthread_mutex_lock(&g_wal.mu);
+        if (ok) g_wal.durable_lsn = last;
+        if (!ok || !logged) g_wal.failed = 1;
+        pthread_cond_broadcast(&g_wal.durable);
+    }
+    pthread_mutex_unlock(&g_wal.mu);
+    return NULL;
 }
 
-static int lock_region(int fd, short type, off_t start, off_t len) {
-    struct flock fl;
-    fl.l_type = type;
-    fl.l_whence = SEEK_SET;
-    fl.l_start = start;
-    fl.l_len = len;
-    return fcntl(fd, F_SETLKW, &fl);
+// Opens the journal after recovery and migration have run, stamps a fresh
+// header and starts the committer thread.
+static int wal_start(void) {
+    g_wal.jfd = open(JOURNAL_FILE, O_RDWR | O_CREAT, 0644);
+    if (g_wal.jfd < 0) return -1;
+
+    wal_header h;
+    uint64_t lsn = wal_read_header(g_wal.jfd, &h) == 0 ? h.next_lsn : 1;
+    off_t tsz = lseek(g_fd.txn, 0, SEEK_END);
+    if (timed_fsync(g_fd.txn) != 0 || wal_write_header(g_wal.jfd, (uint64_t)tsz, lsn) != 0) return -1;
+
+    g_wal.cap = 64 * sizeof(wal_record);
+    g_wal.buf = (char *)malloc(g_wal.cap);
+    g_wal.spare = (char *)malloc(g_wal.cap);
+    if (!g_wal.buf || !g_wal.spare) return -1;
+    g_wal.len = 0;
+    g_wal.next_lsn = lsn;
+    g_wal.durable_lsn = lsn - 1;
+    g_wal.woff = g_wal.jsize = sizeof(wal_header);
+    // Continue from the newest logged time, so a clock set back across a
+    // restart cannot leave the log out of time order
+    txn_entry first, last;
+    if (seg_edges(g_fd.txn, g_tlog.binary, tsz, &first, &last) == 0) g_wal.last_ts = last.ts;
+    else if (g_seg.n > 0) g_wal.last_ts = g_seg.segs[g_seg.n - 1].max_ts;
+    g_wal.running = 1;
+    if (pthread_create(&g_wal.thread, NULL, wal_committer, NULL) != 0) { g_wal.running = 0; return -1; }
+    return 0;
 }
 
-static int lock_file_shared(int fd) { return lock_region(fd, F_RDLCK, 0, 0); }
-static int lock_file_excl(int fd)   { return lock_region(fd, F_WRLCK, 0, 0); }
-static int unlock_file(int fd)      { return lock_region(fd, F_UNLCK, 0, 0); }
-
-
-// Journaling disabled: provide no-op stubs to retain lenient behavior
-typedef struct { int kind; off_t off1, off2; long long old_bal1, old_bal2; int acct_no1, acct_no2; off_t user_off1, loan_off1; user_record old_user1; loan_record old_loan1; } journal_entry;
-static int journal_open_locked(int *out_fd) { int fd = open("/dev/null", O_RDWR); if (fd < 0) return -1; if (out_fd) *out_fd = fd; return 0; }
-static int journal_write_and_sync(int jfd, const journal_entry *je) { (void)jfd; (void)je; return 0; }
-static int journal_clear(int jfd) { (void)jfd; return 0; }
-static int recover_accounts_from_journal(void) { return 0; }
+// Writers bracket their whole mutation with wal_enter/wal_leave so that a
+// checkpoint can wait until every logged record has reached accounts.db.
+static void wal_enter(void) {
+    pthread_mutex_lock(&g_wal.mu);
+    while (g_wal.ckpt_pending) pthread_cond_wait(&g_wal.gate, &g_wal.mu);
+    g_wal.inflight++;
+    pthread_mutex_unlock(&g_wal.mu);
+}
 
-static int read_user_by_username(int fd, const char *username, user_record *out, off_t *off_out) {
-    off_t off = 0;
-    user_record u;
-    ssize_t rs;
-    while ((rs = pread(fd, &u, sizeof(u), off)) == (ssize_t)sizeof(u)) {
-        if (strncmp(u.username, username, USERNAME_MAX) == 0) {
-            if (out) *out = u;
-            if (off_out) *off_out = off;
-            return 0;
-        }
-        off += sizeof(u);
-    }
-    return -1;
+static void wal_leave(void) {
+    pthread_mutex_lock(&g_wal.mu);
+    if (--g_wal.inflight == 0 && g_wal.ckpt_pending) pthread_cond_broadcast(&g_wal.gate);
+    pthread_mutex_unlock(&g_wal.mu);
 }
 
-static int read_user_by_id(int fd, int uid, user_record *out, off_t *off_out) {
-    off_t off = 0;
-    user_record u;
-    ssize_t rs;
-    while ((rs = pread(fd, &u, sizeof(u), off)) == (ssize_t)sizeof(u)) {
-        if (u.id == uid) {
-            if (out) *out = u;
-            if (off_out) *off_out = off;
-            return 0;
-        }
-        off += sizeof(u);
+// Queues a record and blocks until it is durable. The committer appends
+// the record's transaction lines to transactions.log once it is, so history
+// readers never see an uncommitted entry.
+static int wal_commit(wal_record *r) {
+    pthread_mutex_lock(&g_wal.mu);
+    if (g_wal.failed || !g_wal.running) { pthread_mutex_unlock(&g_wal.mu); return -1; }
+    if (g_wal.len + sizeof(*r) > g_wal.cap) {
+        size_t ncap = g_wal.cap * 2;
+        char *nb = (char *)realloc(g_wal.buf, ncap);
+        char *ns = nb ? (char *)realloc(g_wal.spare, ncap) : NULL;
+        if (nb) g_wal.buf = nb;
+        if (ns) g_wal.spare = ns;
+        if (!nb || !ns) { pthread_mutex_unlock(&g_wal.mu); return -1; }
+        g_wal.cap = ncap;
     }
-    return -1;
+    r->lsn = g_wal.next_lsn++;
+    // Stamped in LSN order so history range queries can binary-search the log
+    if (r->ts < g_wal.last_ts) r->ts = g_wal.last_ts;
+    g_wal.last_ts = r->ts;
+    r->crc = 0;
+    r->crc = crc32_buf(r, sizeof(*r));
+    memcpy(g_wal.buf + g_wal.len, r, sizeof(*r));
+    g_wal.len += sizeof(*r);
+    g_wal.jsize += sizeof(*r);
+    pthread_cond_signal(&g_wal.work);
+
+    while (g_wal.durable_lsn < r->lsn && !g_wal.failed) pthread_cond_wait(&g_wal.durable, &g_wal.mu);
+    int rc = g_wal.durable_lsn >= r->lsn ? 0 : -1;
+    pthread_mutex_unlock(&g_wal.mu);
+    return rc;
 }
 
-static int read_account_by_user(int fd, int uid, account_record *out, off_t *off_out) {
-    off_t off = 0;
-    account_record a;
-    ssize_t rs;
-    while ((rs = pread(fd, &a, sizeof(a), off)) == (ssize_t)sizeof(a)) {
-        if (a.user_id == uid) {
-            if (out) *out = a;
-            if (off_out) *off_out = off;
-            return 0;
-        }
-        off += sizeof(a);
+// Closes the head as the next segment and starts a new one. Runs inside a
+// checkpoint, so no appends are in flight; readers are held off only while
+// the table and g_fd.txn are swapped.
+static int txn_log_rotate(void) {
+    uint32_t id = seg_head_id();
+    txn_segment s;
+    txn_entry first, last;
+    bzero(&s, sizeof(s));
+    s.id = id;
+    s.binary = g_tlog.binary;
+    s.size = lseek(g_fd.txn, 0, SEEK_END);
+    s.last_seq = g_tlog.binary ? g_tlog.next_seq - 1 : 0;
+    if (seg_edges(g_fd.txn, s.binary, (off_t)s.size, &first, &last) != 0) return -1;
+    s.min_ts = first.ts;
+    s.max_ts = last.ts;
+
+    char path[64];
+    txn_segment *all = (txn_segment *)malloc((g_seg.n + 1) * sizeof(*all));
+    if (!all) return -1;
+    if (g_seg.n) memcpy(all, g_seg.segs, g_seg.n * sizeof(*all));
+    all[g_seg.n] = s;
+    int rc = link(TXN_LOG, seg_path(id, path, sizeof(path)));
+    if (rc == 0 && (rc = txn_manifest_write(all, g_seg.n + 1)) != 0) unlink(path);
+    int nfd = -1;
+    if (rc == 0 && (txn_head_create(s.binary) != 0 || (nfd = open(TXN_LOG, O_RDWR | O_APPEND)) < 0)) {
+        // Back out so the old head stays the head
+        if (txn_manifest_write(g_seg.segs, g_seg.n) == 0) unlink(path);
+        rc = -1;
     }
-    return -1;
+    free(all);
+    if (rc != 0) return -1;
+
+    rw_wrlock(&g_seg.lock);
+    if (seg_push(&s, g_fd.txn) == 0) g_fd.txn = nfd;
+    else rc = -1;
+    rw_unlock(&g_seg.lock);
+    if (rc != 0) { close(nfd); return -1; }
+
+    rw_wrlock(&g_tix.lock);
+    g_tix.log_end = TXN_POS(id + 1, lseek(nfd, 0, SEEK_END));
+    rw_unlock(&g_tix.lock);
+    fprintf(stderr, "transactions.log: closed segment %s (%lld bytes)\n", path, (long long)s.size);
+    return 0;
 }
 
-static int read_account_by_account_number(int afd, int acct_no, account_record *out, off_t *off_out) {
-    off_t off = 0;
-    account_record a;
-    ssize_t rs;
-    while ((rs = pread(afd, &a, sizeof(a), off)) == (ssize_t)sizeof(a)) {
-        if (a.account_number == acct_no) {
-            if (out) *out = a;
-            if (off_out) *off_out = off;
-            return 0;
-        }
-        off += sizeof(a);
-    }
-    return -1;
+static int txn_head_full(void) {
+    off_t size = TXN_POS_OFF(g_tix.log_end);
+    return g_seg.max_bytes > 0 && size >= g_seg.max_bytes && size > (g_tlog.binary ? TLOG_START : 0);
 }
 
-static int next_id_from_file(int fd, size_t rec_sz, int id_offset) {
-    off_t sz = lseek(fd, 0, SEEK_END);
-    if (sz <= 0 || sz < (off_t)rec_sz) return 1;
-    char *buf = (char *)malloc(rec_sz);
-    if (!buf) return 1;
-    if (pread(fd, buf, rec_sz, sz - (off_t)rec_sz) != (ssize_t)rec_sz) {
-        free(buf);
-        return 1;
+// Quiesce writers, make accounts.db and transactions.log durable and restart
+// the journal. wal_maybe_checkpoint does this once the journal passes
+// WAL_CHECKPOINT_BYTES or the head segment is due for rotation; shutdown
+// forces one.
+static void wal_checkpoint(int force) {
+    pthread_mutex_lock(&g_wal.mu);
+    // Once failed, the journal is all that covers the last records: its
+    // header must not be restamped past them
+    if (g_wal.failed || g_wal.ckpt_pending || (!force && g_wal.jsize < WAL_CHECKPOINT_BYTES && !txn_head_full())) {
+        pthread_mutex_unlock(&g_wal.mu);
+        return;
     }
-    int id = 0;
-    memcpy(&id, buf + id_offset, sizeof(int));
-    free(buf);
-    if (id < 0 || id > 10000) return 1;
-    return id + 1;
+    g_wal.ckpt_pending = 1;
+    // Writers stay inflight until their record is durable and applied
+    while (g_wal.inflight > 0) pthread_cond_wait(&g_wal.gate, &g_wal.mu);
+    pthread_mutex_unlock(&g_wal.mu);
+
+    int ok = accounts_sync() == 0 && timed_fsync(g_fd.txn) == 0;
+    if (ok) {
+        off_t tsz = lseek(g_fd.txn, 0, SEEK_END);
+        ok = wal_write_header(g_wal.jfd, (uint64_t)tsz, g_wal.next_lsn) == 0;
+    }
+    // The journal now covers nothing past the head, so it can be closed;
+    // the header is restamped with the new head's size
+    int failed = 0;
+    if (ok && txn_head_full() && txn_log_rotate() == 0)
+        failed = wal_write_header(g_wal.jfd, (uint64_t)lseek(g_fd.txn, 0, SEEK_END), g_wal.next_lsn) != 0;
+
+    pthread_mutex_lock(&g_wal.mu);
+    if (failed) g_wal.failed = 1;
+    if (ok) g_wal.woff = g_wal.jsize = sizeof(wal_header);
+    g_wal.ckpt_pending = 0;
+    pthread_cond_broadcast(&g_wal.gate);
+    pthread_mutex_unlock(&g_wal.mu);
+
+    // Writers are already running again; the snapshot only needs the
+    // index locks
+    if (ok && snapshot_write() != 0) fprintf(stderr, "snapshot.db: write failed\n");
 }
 
-static int next_account_number(int afd) {
-    int maxno = 1000;
-    off_t off = 0;
-    account_record a;
-    ssize_t rs;
-    while ((rs = pread(afd, &a, sizeof(a), off)) == (ssize_t)sizeof(a)) {
-        if (a.account_number > maxno) maxno = a.account_number;
-        off += sizeof(a);
-    }
-    return maxno + 1;
+static void wal_maybe_checkpoint(void) { wal_checkpoint(0); }
+
+static void wal_stop(void) {
+    if (!g_wal.running) return;
+    wal_checkpoint(1);
+    pthread_mutex_lock(&g_wal.mu);
+    g_wal.running = 0;
+    pthread_cond_signal(&g_wal.work);
+    pthread_mutex_unlock(&g_wal.mu);
+    pthread_join(g_wal.thread, NULL);
+    close(g_wal.jfd);
+    g_wal.jfd = -1;
+    free(g_wal.buf);
+    free(g_wal.spare);
+    g_wal.buf = g_wal.spare = NULL;
 }
 
-static int append_txn(int tfd, int account_number, const char *type, long long amount, long long new_bal, const char *note) {
-    time_t now = time(NULL);
-    char line[512];
-    snprintf(line, sizeof(line), "%ld|acct=%d|%s|amt=%lld|bal=%lld|%s\n",
-             (long)now, account_number, type, amount, new_bal, note ? note : "-");
-    if (write(tfd, line, strlen(line)) < 0) return -1;
-    fsync(tfd);
-    return 0;
+
+// Data format version (format.db). Files that have a header carry their
+// own layout version; this one records which one-shot migrations the data
+// directory has been through, so a normal boot reads it and moves on.
+// Steps run in order and each stamps the version it reaches; a step that
+// is interrupted runs again on the next boot.
+#define FORMAT_MAGIC   0x544D4642u   /* "BFMT" */
+#define FORMAT_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pad;
+    uint32_t crc;
+} format_header;
+
+typedef struct {
+    uint32_t version;         /* format version the step produces */
+    const char *name;
+    int (*run)(void);
+} migration_step;
+
+// Version recorded in format.db; 0 when there is none, which runs every step.
+static uint32_t format_load(void) {
+    format_header h;
+    int fd = open(FORMAT_FILE, O_RDONLY);
+    if (fd < 0) return 0;
+    int ok = timed_pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && h.magic == FORMAT_MAGIC;
+    close(fd);
+    if (!ok) return 0;
+    uint32_t crc = h.crc;
+    h.crc = 0;
+    return crc32_buf(&h, sizeof(h)) == crc ? h.version : 0;
 }
 
+static int format_store(uint32_t version) {
+    format_header h;
+    bzero(&h, sizeof(h));
+    h.magic = FORMAT_MAGIC;
+    h.version = version;
+    h.crc = crc32_buf(&h, sizeof(h));
+    char tmpname[] = "format.db.tmpXXXXXX";
+    int fd = mkstemp(tmpname);
+    int rc = fd >= 0 && timed_write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && timed_fsync(fd) == 0 ? 0 : -1;
+    if (fd >= 0) { fchmod(fd, 0644); close(fd); }
+    if (rc == 0 && rename(tmpname, FORMAT_FILE) != 0) rc = -1;
+    if (rc != 0 && fd >= 0) unlink(tmpname);
+    return rc;
+}
 
-typedef struct { int old_no; int new_no; } acct_remap;
+// Version 1: account numbers below 1000 predate the 1000+ numbering and
+// are renumbered past the current maximum. The remap table is keyed by
+// the old number (aux = new number, off = the account's slot).
+static int remap_account(const int_index *remap, int *acct_no) {
+    int to;
+    if (*acct_no >= 1000 || int_index_get(remap, *acct_no, NULL, &to) != 0) return 0;
+    *acct_no = to;
+    return 1;
+}
 
-static int migrate_account_numbers_if_needed(void) {
-    int afd = open(ACCOUNTS_FILE, O_RDWR);
-    int tfd = open(TXN_LOG, O_RDWR | O_CREAT, 0644);
-    if (afd < 0) { if (tfd >= 0) close(tfd); return -1; }
-    if (tfd < 0) { close(afd); return -1; }
+static int remap_entry(const int_index *remap, txn_entry *e) {
+    int changed = remap_account(remap, &e->acct_no);
+    if (e->type == TXN_TRANSFER_OUT || e->type == TXN_TRANSFER_IN) changed |= remap_account(remap, &e->peer);
+    return changed;
+}
 
-    if (lock_file_excl(afd) < 0) { close(afd); close(tfd); return -1; }
+// Applies the remap to one log file and reports its new size. Binary
+// records are fixed-width, so they are rewritten in place a block at a
+// time; a text file is streamed through a temporary copy.
+static int migrate_log_file(const char *path, const int_index *remap, off_t *size) {
+    int tfd = open(path, O_RDWR | O_CREAT, 0644);
+    if (tfd < 0) return -1;
 
-    // First pass: find any accounts with account_number < 1000
-    acct_remap remaps[1024]; int rcount = 0;
-    int maxno = 1000;
-    off_t off = 0; account_record a;
-    while (pread(afd, &a, sizeof(a), off) == (ssize_t)sizeof(a)) {
-        if (a.account_number > maxno) maxno = a.account_number;
-        off += sizeof(a);
-    }
-    off = 0;
-    while (pread(afd, &a, sizeof(a), off) == (ssize_t)sizeof(a)) {
-        if (a.account_number < 1000) {
-            if (rcount < (int)(sizeof(remaps)/sizeof(remaps[0]))) {
-                remaps[rcount].old_no = a.account_number;
-                remaps[rcount].new_no = ++maxno;
-                a.account_number = remaps[rcount].new_no;
-                pwrite(afd, &a, sizeof(a), off);
-                rcount++;
+    if (txn_file_binary(tfd)) {
+        txnlog_rec recs[256];
+        txn_entry e;
+        ssize_t got;
+        off_t off;
+        for (off = TLOG_START; (got = timed_pread(tfd, recs, sizeof(recs), off)) >= TLOG_REC; off += got) {
+            got -= got % TLOG_REC;
+            int dirty = 0;
+            for (size_t i = 0; i < (size_t)(got / TLOG_REC); i++) {
+                if (txnlog_decode(&recs[i], &e) != 0 || !remap_entry(remap, &e)) continue;
+                txnlog_encode(&e, recs[i].seq, &recs[i]);
+                dirty = 1;
             }
+            if (dirty && timed_pwrite(tfd, recs, (size_t)got, off) != got) { close(tfd); return -1; }
         }
-        off += sizeof(a);
+        int rc = timed_fsync(tfd);
+        *size = lseek(tfd, 0, SEEK_END);
+        close(tfd);
+        return rc;
     }
-    fsync(afd);
-    unlock_file(afd);
-    close(afd);
-
-    if (rcount == 0) { close(tfd); return 0; }
 
-    // Rewrite transactions.log applying the remaps
-    FILE *in = fdopen(tfd, "r+");
+    FILE *in = fdopen(tfd, "r");
     if (!in) { close(tfd); return -1; }
-    fseek(in, 0, SEEK_SET);
 
     char tmpname[] = "transactions.log.tmpXXXXXX";
     int tmpfd = mkstemp(tmpname);
@@ -214,63 +2088,176 @@ static int migrate_account_numbers_if_needed(void) {
     if (!out) { close(tmpfd); unlink(tmpname); fclose(in); return -1; }
 
     char *line = NULL; size_t n = 0;
-    while (getline(&line, &n, in) != -1) {
-        // For each mapping, replace acct=old with acct=new
-        for (int i = 0; i < rcount; i++) {
-            char tagold[32], tagnew[32];
-            snprintf(tagold, sizeof(tagold), "acct=%d", remaps[i].old_no);
-            snprintf(tagnew, sizeof(tagnew), "acct=%d", remaps[i].new_no);
-            char *pos;
-            while ((pos = strstr(line, tagold)) != NULL) {
-                size_t before = (size_t)(pos - line);
-                char buf[2048];
-                size_t lold = strlen(tagold), lnew = strlen(tagnew);
-                size_t llen = strlen(line);
-                if (before + lnew + (llen - before - lold) + 1 >= sizeof(buf)) break;
-                memcpy(buf, line, before);
-                memcpy(buf + before, tagnew, lnew);
-                memcpy(buf + before + lnew, pos + lold, llen - before - lold + 1);
-                free(line);
-                line = strdup(buf);
-                if (!line) break;
-            }
-        }
-        if (line) fputs(line, out);
+    ssize_t len;
+    txn_entry e;
+    char buf[512];
+    while ((len = getline(&line, &n, in)) != -1) {
+        // Lines that do not parse are copied through untouched
+        if (txnlog_parse_line(line, &e) == 0 && e.type != 0 && remap_entry(remap, &e))
+            fwrite(buf, 1, (size_t)txnlog_format_line(&e, buf, sizeof(buf)), out);
+        else
+            fwrite(line, 1, (size_t)len, out);
     }
     free(line);
-    fflush(out);
-    fsync(tmpfd);
+    fclose(in);
+    int rc = fflush(out) == 0 && !ferror(out) && timed_fsync(tmpfd) == 0 ? 0 : -1;
+    *size = ftell(out);
     fclose(out);
+    if (rc == 0 && rename(tmpname, path) != 0) rc = -1;
+    if (rc != 0) unlink(tmpname);
+    return rc;
+}
 
-    // Truncate and replace original log
-    fclose(in); // closes tfd
-    if (rename(tmpname, TXN_LOG) != 0) {
-        unlink(tmpname);
+static int migrate_account_numbers(void) {
+    int afd = open(ACCOUNTS_FILE, O_RDWR);
+    if (afd < 0) return errno == ENOENT ? 0 : -1;
+    if (lock_file_excl(afd) < 0) { close(afd); return -1; }
+
+    off_t base, off, end;
+    uint64_t count;
+    acct_layout(afd, &base, &count);
+    end = base + (off_t)(count * sizeof(account_record));
+    account_record a;
+    int maxno = 1000;
+    size_t legacy = 0;
+    for (off = base; off < end && timed_pread(afd, &a, sizeof(a), off) == (ssize_t)sizeof(a); off += sizeof(a)) {
+        if (a.account_number < 1000) legacy++;
+        else if (a.account_number > maxno) maxno = a.account_number;
+    }
+    if (legacy == 0) { unlock_file(afd); close(afd); return 0; }
+
+    // Numbers are assigned in file order, so a rerun after an interrupted
+    // migration computes the same table
+    int_index remap;
+    int rc = int_index_init(&remap, legacy);
+    for (off = base; rc == 0 && off < end && timed_pread(afd, &a, sizeof(a), off) == (ssize_t)sizeof(a); off += sizeof(a))
+        if (a.account_number < 1000 && int_index_get(&remap, a.account_number, NULL, NULL) != 0)
+            rc = int_index_put(&remap, a.account_number, off, ++maxno);
+
+    // Everything derived from account numbers is rebuilt at startup
+    unlink(TXN_INDEX);
+    unlink(SNAPSHOT_FILE);
+    unlink(IDS_FILE);
+
+    // Logs before accounts: until the accounts are rewritten a rerun still
+    // sees the legacy numbers, and remapped log entries no longer match
+    char path[64];
+    for (uint32_t id = 0; rc == 0 && id <= seg_head_id(); id++) {
+        off_t size;
+        if (id == seg_head_id()) rc = migrate_log_file(TXN_LOG, &remap, &size);
+        else if ((rc = migrate_log_file(seg_path(id, path, sizeof(path)), &remap, &size)) == 0) g_seg.segs[id].size = size;
+    }
+    if (rc == 0 && g_seg.n > 0) rc = txn_manifest_write(g_seg.segs, g_seg.n);
+
+    for (off = base; rc == 0 && off < end && timed_pread(afd, &a, sizeof(a), off) == (ssize_t)sizeof(a); off += sizeof(a)) {
+        if (a.account_number >= 1000) continue;
+        off_t first;
+        int to;
+        int_index_get(&remap, a.account_number, &first, &to);
+        // A duplicated legacy number keeps its log entries on the first account
+        a.account_number = first == off ? to : ++maxno;
+        if (timed_pwrite(afd, &a, sizeof(a), off) != (ssize_t)sizeof(a)) rc = -1;
+    }
+    if (rc == 0) rc = timed_fsync(afd);
+    unlock_file(afd);
+    close(afd);
+    int_index_free(&remap);
+    if (rc == 0) fprintf(stderr, "accounts.db: renumbered %zu legacy account(s)\n", legacy);
+    return rc;
+}
+
+static const migration_step g_migrations[] = {
+    { 1, "renumber legacy accounts", migrate_account_numbers },
+};
+
+static int migrate_data(void) {
+    uint32_t version = format_load();
+    if (version == FORMAT_VERSION) return 0;
+    if (version > FORMAT_VERSION) {
+        fprintf(stderr, "format.db: data format %u is newer than this server (%u)\n", version, FORMAT_VERSION);
         return -1;
     }
+    for (size_t i = 0; i < sizeof(g_migrations) / sizeof(g_migrations[0]); i++) {
+        const migration_step *m = &g_migrations[i];
+        if (m->version <= version) continue;
+        if (m->run() != 0 || format_store(m->version) != 0) {
+            fprintf(stderr, "format.db: migration to version %u (%s) failed\n", m->version, m->name);
+            return -1;
+        }
+        version = m->version;
+    }
     return 0;
 }
 
+static void close_handles(void) {
+    int *fds[] = { &g_fd.users, &g_fd.accounts, &g_fd.loans, &g_fd.txn, &g_fd.txn_idx, &g_fd.feedback };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) close(*fds[i]);
+        *fds[i] = -1;
+    }
+}
+
+static int open_handles(void) {
+    g_fd.users = ensure_file(USERS_FILE, sizeof(user_record));
+    g_fd.accounts = ensure_file(ACCOUNTS_FILE, sizeof(account_record));
+    g_fd.loans = ensure_file(LOANS_FILE, sizeof(loan_record));
+    g_fd.txn = open(TXN_LOG, O_RDWR | O_CREAT | O_APPEND, 0644);
+    g_fd.txn_idx = open(TXN_INDEX, O_RDWR | O_CREAT | O_APPEND, 0644);
+    g_fd.feedback = open(FEEDBACK_LOG, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (g_fd.users < 0 || g_fd.accounts < 0 || g_fd.loans < 0 || g_fd.txn < 0 || g_fd.txn_idx < 0 || g_fd.feedback < 0) {
+        close_handles();
+        return -1;
+    }
+    return 0;
+}
 
 int db_init(void) {
-    int ufd = ensure_file(USERS_FILE, sizeof(user_record));
-    if (ufd < 0) return -1;
-    int afd = ensure_file(ACCOUNTS_FILE, sizeof(account_record));
-    if (afd < 0) { close(ufd); return -1; }
-    int lfd = ensure_file(LOANS_FILE, sizeof(loan_record));
-    if (lfd < 0) { close(ufd); close(afd); return -1; }
-    int tfd = open(TXN_LOG, O_RDWR | O_CREAT | O_APPEND, 0644);
-    if (tfd < 0) { close(ufd); close(afd); close(lfd); return -1; }
-    int ffd = open(FEEDBACK_LOG, O_RDWR | O_CREAT | O_APPEND, 0644);
-    if (ffd < 0) { close(ufd); close(afd); close(lfd); close(tfd); return -1; }
+    acct_locks_init();
+    crc32_init();
+    if (sessions_init() != 0) { sessions_free(); return -1; }
+
+    if (txn_segments_load() != 0) return -1;
+
+    // Crash recovery: replay committed account updates from the journal
+    if (recover_accounts_from_journal() != 0) {
+        fprintf(stderr, "journal recovery failed\n");
+        return -1;
+    }
+
+    // One-shot data migrations. They may replace transactions.log, so the
+    // handle table is opened afterwards.
+    if (migrate_data() != 0) return -1;
+
+    if (txn_log_prepare() != 0) {
+        fprintf(stderr, "transactions.log: binary conversion failed\n");
+        return -1;
+    }
+    if (accounts_prepare() != 0) {
+        fprintf(stderr, "accounts.db: conversion for mmap failed\n");
+        return -1;
+    }
 
-    // Crash recovery: restore any in-flight account updates from journal
-    recover_accounts_from_journal();
+    if (open_handles() != 0) return -1;
+    if (txn_log_detect(g_fd.txn) != 0) { close_handles(); return -1; }
+    int ufd = g_fd.users;
 
-    // Data migration: normalize legacy account numbers (<1000)
-    migrate_account_numbers_if_needed();
+    if (txn_index_load() != 0) { txn_index_free(); close_handles(); return -1; }
+
+    if (wal_start() != 0) { txn_index_free(); close_handles(); return -1; }
+
+    if (accounts_map() != 0) { db_shutdown(); return -1; }
+
+    // Index from the snapshot, then just the records appended after it
+    off_t users_from = 0, accounts_from = g_acct.base;
+    int loaded = snapshot_load(&users_from, &accounts_from) == 0;
+    if (loaded) {
+        long long nu = (long long)((lseek(ufd, 0, SEEK_END) - users_from) / (off_t)sizeof(user_record));
+        long long na = (long long)((accounts_end() - accounts_from) / (off_t)sizeof(account_record));
+        if (nu > 0 || na > 0) fprintf(stderr, "snapshot.db: indexing %lld user(s) and %lld account(s) added since\n", nu, na);
+    }
+    if (build_account_index(g_fd.accounts, accounts_from, loaded) != 0) { db_shutdown(); return -1; }
 
-    if (lock_file_excl(ufd) < 0) { close(ufd); close(afd); close(lfd); close(tfd); close(ffd); return -1; }
+    if (lock_file_excl(ufd) < 0) { db_shutdown(); return -1; }
     off_t sz = lseek(ufd, 0, SEEK_END);
     if (sz == 0) {
         user_record admin;
@@ -278,285 +2265,232 @@ int db_init(void) {
         admin.id = 1;
         admin.role = ROLE_ADMIN;
         admin.active = 1;
-        admin.session_active = 0;
         strncpy(admin.username, "admin", USERNAME_MAX - 1);
         char hpw[PASSWORD_MAX];
-        hash_password("admin", hpw);
+        if (hash_password("admin", hpw) != 0) { unlock_file(ufd); db_shutdown(); return -1; }
         snprintf(admin.password, sizeof(admin.password), "%s", hpw);
-        pwrite(ufd, &admin, sizeof(admin), 0);
-        fsync(ufd);
+        timed_pwrite(ufd, &admin, sizeof(admin), 0);
+        timed_fsync(ufd);
+    }
+    if (build_user_index(ufd, users_from, loaded) != 0) {
+        unlock_file(ufd); db_shutdown(); return -1;
     }
     unlock_file(ufd);
 
-    close(ufd);
-    close(afd);
-    close(lfd);
-    close(tfd);
-    close(ffd);
+    if (id_alloc_load() != 0) { db_shutdown(); return -1; }
+    g_snap_ready = 1;
     return 0;
 }
 
-int db_login(const char *username, const char *password, user_record *out) {
-    int ufd = open(USERS_FILE, O_RDWR);
-    if (ufd < 0) return -1;
-    if (lock_file_excl(ufd) < 0) { close(ufd); return -1; }
+void db_shutdown(void) {
+    wal_stop();
+    accounts_unmap();
+    id_alloc_close();
+    txn_index_free();
+    txn_segments_free();
+    sessions_free();
+    timed_fsync(g_fd.users);
+    timed_fsync(g_fd.loans);
+    timed_fsync(g_fd.feedback);
+    close_handles();
+}
 
+// Rewrites a verified password in the current scheme unless it changed in
+// the meantime. Best effort: the login stands either way.
+static void rehash_password(off_t off, const user_record *seen, const char *plain) {
+    char hpw[PASSWORD_MAX] = "";
+    if (hash_password(plain, hpw) != 0) return;
+    int ufd = g_fd.users;
+    mu_lock(&g_users_mu);
+    if (lock_file_excl(ufd) < 0) { mu_unlock(&g_users_mu); return; }
     user_record u;
-    off_t off;
-    int rc = read_user_by_username(ufd, username, &u, &off);
-    char hpw[PASSWORD_MAX];
-    hash_password(password, hpw);
-    if (rc != 0 || !u.active || strncmp(u.password, hpw, PASSWORD_MAX) != 0 || u.session_active) {
-        unlock_file(ufd);
-        close(ufd);
-        return -1;
+    if (read_user_at(ufd, off, &u, NULL) == 0 && memcmp(u.password, seen->password, PASSWORD_MAX) == 0) {
+        // Only the password field, so the rest of the record is never
+        // written back from this read
+        off_t poff = off + (off_t)offsetof(user_record, password);
+        if (timed_pwrite(ufd, hpw, sizeof(hpw), poff) == (ssize_t)sizeof(hpw)) timed_fsync(ufd);
     }
-
-    // Journal user change (session_active)
-    int jfd;
-    if (journal_open_locked(&jfd) != 0) { unlock_file(ufd); close(ufd); return -1; }
-    journal_entry je; bzero(&je, sizeof(je));
-    je.kind = 10; je.user_off1 = off; je.old_user1 = u;
-    if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); unlock_file(ufd); close(ufd); return -1; }
-
-    u.session_active = 1;
-    if (pwrite(ufd, &u, sizeof(u), off) != (ssize_t)sizeof(u)) { unlock_file(ufd); close(ufd); unlock_file(jfd); close(jfd); return -1; }
-    fsync(ufd);
-
-    journal_clear(jfd);
-    unlock_file(jfd);
-    close(jfd);
     unlock_file(ufd);
-    close(ufd);
-    if (out) *out = u;
-    return 0;
+    mu_unlock(&g_users_mu);
 }
 
-int db_logout(int user_id) {
-    int ufd = open(USERS_FILE, O_RDWR);
-    if (ufd < 0) return -1;
-    if (lock_file_excl(ufd) < 0) { close(ufd); return -1; }
-
+int db_login(const char *username, const char *password, user_record *out, uint64_t *token_out) {
     user_record u;
     off_t off;
-    int rc = read_user_by_id(ufd, user_id, &u, &off);
-    if (rc == 0) {
-        int jfd;
-        if (journal_open_locked(&jfd) != 0) { unlock_file(ufd); close(ufd); return -1; }
-        journal_entry je; bzero(&je, sizeof(je));
-        je.kind = 10; je.user_off1 = off; je.old_user1 = u;
-        if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); unlock_file(ufd); close(ufd); return -1; }
-
-        u.session_active = 0;
-        if (pwrite(ufd, &u, sizeof(u), off) != (ssize_t)sizeof(u)) { unlock_file(ufd); close(ufd); unlock_file(jfd); close(jfd); return -1; }
-        fsync(ufd);
-
-        journal_clear(jfd);
-        unlock_file(jfd);
-        close(jfd);
-    }
+    int stale = 0;
+    if (read_user_by_username(g_fd.users, username, &u, &off) != 0 || !u.active) return -1;
+    if (!verify_password(password, u.password, &stale)) return -1;
+    if (stale) rehash_password(off, &u, password);
+    if (session_begin(u.id, token_out) != 0) return -1;
+    if (out) *out = u;
+    return 0;
+}
 
-    unlock_file(ufd);
-    close(ufd);
-    return rc;
+int db_logout(int user_id, uint64_t token) {
+    return session_end(user_id, token);
 }
 
 
 int db_get_balance(int user_id, long long *bal_out) {
-    int afd = open(ACCOUNTS_FILE, O_RDWR);
-    if (afd < 0) return -1;
-    if (lock_file_shared(afd) < 0) { close(afd); return -1; }
+    off_t off;
+    int acct_no;
+    if (account_slot_by_user(user_id, &off, &acct_no) != 0) return -1;
+    int afd = g_fd.accounts;
+    acct_lock_shared(acct_no);
 
     account_record a;
-    off_t off;
-    int rc = read_account_by_user(afd, user_id, &a, &off);
+    int rc = read_account_at(afd, off, &a, NULL);
     if (rc == 0 && bal_out) *bal_out = a.balance;
 
-    unlock_file(afd);
-    close(afd);
+    acct_unlock(acct_no);
     return rc;
 }
 
 int db_deposit(int user_id, long long amount, long long *new_bal) {
     if (amount <= 0) return -1;
-    int afd = open(ACCOUNTS_FILE, O_RDWR);
-    int tfd = open(TXN_LOG, O_WRONLY | O_APPEND);
-    int jfd = -1;
-    if (afd < 0 || tfd < 0) { if (afd >= 0) close(afd); if (tfd >= 0) close(tfd); return -1; }
-    if (lock_file_excl(afd) < 0) { close(afd); close(tfd); return -1; }
+    int afd = g_fd.accounts;
 
     account_record a;
     off_t off;
-    if (read_account_by_user(afd, user_id, &a, &off) != 0) {
-        unlock_file(afd); close(afd); close(tfd); return -1;
+    int acct_no;
+    if (account_slot_by_user(user_id, &off, &acct_no) != 0) return -1;
+    wal_enter();
+    acct_lock_excl(acct_no);
+    if (read_account_at(afd, off, &a, NULL) != 0) {
+        acct_unlock(acct_no); wal_leave(); return -1;
     }
 
-    // Journal old state
-    if (journal_open_locked(&jfd) != 0) { unlock_file(afd); close(afd); close(tfd); return -1; }
-    journal_entry je; bzero(&je, sizeof(je));
-    je.kind = 1; je.off1 = off; je.old_bal1 = a.balance; je.acct_no1 = a.account_number;
-    if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); unlock_file(afd); close(afd); close(tfd); return -1; }
-
     a.balance += amount;
-    if (pwrite(afd, &a, sizeof(a), off) != (ssize_t)sizeof(a)) {
-        // leave journal for recovery
-        unlock_file(afd); close(afd); close(tfd); unlock_file(jfd); close(jfd); return -1;
-    }
-    fsync(afd);
+    wal_record r;
+    wal_record_init(&r);
+    wal_add_update(&r, off, &a);
+    wal_add_txn(&r, a.account_number, TXN_DEPOSIT, amount, a.balance, 0);
 
-    // Clear journal (commit)
-    journal_clear(jfd);
-    unlock_file(jfd);
-    close(jfd);
+    // Commit first: accounts.db only ever receives logged state
+    int rc = wal_commit(&r);
+    if (rc == 0 && write_account_at(off, &a) != 0) rc = -1;
 
-    append_txn(tfd, a.account_number, "DEPOSIT", amount, a.balance, "-");
+    acct_unlock(acct_no);
+    wal_leave();
+    if (rc != 0) return -1;
+    wal_maybe_checkpoint();
 
     if (new_bal) *new_bal = a.balance;
-    unlock_file(afd);
-    close(afd);
-    close(tfd);
     return 0;
 }
 
 int db_withdraw(int user_id, long long amount, long long *new_bal) {
     if (amount <= 0) return -1;
-    int afd = open(ACCOUNTS_FILE, O_RDWR);
-    int tfd = open(TXN_LOG, O_WRONLY | O_APPEND);
-    int jfd = -1;
-    if (afd < 0 || tfd < 0) { if (afd >= 0) close(afd); if (tfd >= 0) close(tfd); return -1; }
-    if (lock_file_excl(afd) < 0) { close(afd); close(tfd); return -1; }
+    int afd = g_fd.accounts;
 
     account_record a;
     off_t off;
-    if (read_account_by_user(afd, user_id, &a, &off) != 0) {
-        unlock_file(afd); close(afd); close(tfd); return -1;
+    int acct_no;
+    if (account_slot_by_user(user_id, &off, &acct_no) != 0) return -1;
+    wal_enter();
+    acct_lock_excl(acct_no);
+    if (read_account_at(afd, off, &a, NULL) != 0) {
+        acct_unlock(acct_no); wal_leave(); return -1;
     }
     if (a.balance < amount) {
-        unlock_file(afd); close(afd); close(tfd); return -1;
+        acct_unlock(acct_no); wal_leave(); return -1;
     }
 
-    // Journal old state
-    if (journal_open_locked(&jfd) != 0) { unlock_file(afd); close(afd); close(tfd); return -1; }
-    journal_entry je; bzero(&je, sizeof(je));
-    je.kind = 1; je.off1 = off; je.old_bal1 = a.balance; je.acct_no1 = a.account_number;
-    if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); unlock_file(afd); close(afd); close(tfd); return -1; }
-
     a.balance -= amount;
-    if (pwrite(afd, &a, sizeof(a), off) != (ssize_t)sizeof(a)) {
-        // leave journal for recovery
-        unlock_file(afd); close(afd); close(tfd); unlock_file(jfd); close(jfd); return -1;
-    }
-    fsync(afd);
+    wal_record r;
+    wal_record_init(&r);
+    wal_add_update(&r, off, &a);
+    wal_add_txn(&r, a.account_number, TXN_WITHDRAW, amount, a.balance, 0);
 
-    // Clear journal (commit)
-    journal_clear(jfd);
-    unlock_file(jfd);
-    close(jfd);
+    int rc = wal_commit(&r);
+    if (rc == 0 && write_account_at(off, &a) != 0) rc = -1;
 
-    append_txn(tfd, a.account_number, "WITHDRAW", amount, a.balance, "-");
+    acct_unlock(acct_no);
+    wal_leave();
+    if (rc != 0) return -1;
+    wal_maybe_checkpoint();
 
     if (new_bal) *new_bal = a.balance;
-    unlock_file(afd);
-    close(afd);
-    close(tfd);
     return 0;
 }
 
 int db_transfer_to_account(int from_user_id, int to_account_number, long long amount) {
     if (amount <= 0) return -1;
 
-    int afd = open(ACCOUNTS_FILE, O_RDWR);
-    int tfd = open(TXN_LOG, O_WRONLY | O_APPEND);
-    int jfd = -1;
-    if (afd < 0 || tfd < 0) { if (afd >= 0) close(afd); if (tfd >= 0) close(tfd); return -1; }
-    if (lock_file_excl(afd) < 0) { close(afd); close(tfd); return -1; }
+    int afd = g_fd.accounts;
 
     account_record from, to;
     off_t offfrom, offto;
-    if (read_account_by_user(afd, from_user_id, &from, &offfrom) != 0) {
-        unlock_file(afd); close(afd); close(tfd); return -1;
-    }
-    if (read_account_by_account_number(afd, to_account_number, &to, &offto) != 0) {
-        unlock_file(afd); close(afd); close(tfd); return -1;
+    int from_no;
+    if (account_slot_by_user(from_user_id, &offfrom, &from_no) != 0 ||
+        account_slot_by_number(to_account_number, &offto) != 0) {
+        return -1;
     }
-    if (from.account_number == to.account_number) {
-        unlock_file(afd); close(afd); close(tfd); return -1;
+    if (from_no == to_account_number) return -1;
+
+    wal_enter();
+    acct_lock_pair_excl(from_no, to_account_number);
+    if (read_account_at(afd, offfrom, &from, NULL) != 0 ||
+        read_account_at(afd, offto, &to, NULL) != 0) {
+        acct_unlock_pair(from_no, to_account_number); wal_leave(); return -1;
     }
     if (from.balance < amount) {
-        unlock_file(afd); close(afd); close(tfd); return -1;
+        acct_unlock_pair(from_no, to_account_number); wal_leave(); return -1;
     }
 
-    // Journal old states of both records
-    if (journal_open_locked(&jfd) != 0) { unlock_file(afd); close(afd); close(tfd); return -1; }
-    journal_entry je; bzero(&je, sizeof(je));
-    je.kind = 2; je.off1 = offfrom; je.old_bal1 = from.balance; je.acct_no1 = from.account_number;
-    je.off2 = offto;    je.old_bal2 = to.balance;   je.acct_no2 = to.account_number;
-    if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); unlock_file(afd); close(afd); close(tfd); return -1; }
-
     from.balance -= amount;
     to.balance   += amount;
 
-    if (pwrite(afd, &from, sizeof(from), offfrom) != (ssize_t)sizeof(from) ||
-        pwrite(afd, &to,   sizeof(to),   offto)   != (ssize_t)sizeof(to)) {
-        // leave journal for recovery
-        unlock_file(afd); close(afd); close(tfd); unlock_file(jfd); close(jfd); return -1;
-    }
-    fsync(afd);
-
-    // Clear journal (commit)
-    journal_clear(jfd);
-    unlock_file(jfd);
-    close(jfd);
+    wal_record r;
+    wal_record_init(&r);
+    wal_add_update(&r, offfrom, &from);
+    wal_add_update(&r, offto, &to);
+    wal_add_txn(&r, from.account_number, TXN_TRANSFER_OUT, amount, from.balance, to.account_number);
+    wal_add_txn(&r, to.account_number,   TXN_TRANSFER_IN,  amount, to.balance,   from.account_number);
 
-    char note_out[64]; snprintf(note_out, sizeof(note_out), "to=%d", to.account_number);
-    char note_in[64];  snprintf(note_in,  sizeof(note_in),  "from=%d", from.account_number);
-    append_txn(tfd, from.account_number, "TRANSFER_OUT", amount, from.balance, note_out);
-    append_txn(tfd, to.account_number,   "TRANSFER_IN",  amount, to.balance,   note_in);
+    int rc = wal_commit(&r);
+    if (rc == 0 && (write_account_at(offfrom, &from) != 0 || write_account_at(offto, &to) != 0)) rc = -1;
 
-    unlock_file(afd);
-    close(afd);
-    close(tfd);
+    acct_unlock_pair(from_no, to_account_number);
+    wal_leave();
+    if (rc != 0) return -1;
+    wal_maybe_checkpoint();
     return 0;
 }
 
 int db_change_password(int user_id, const char *new_password) {
-    int ufd = open(USERS_FILE, O_RDWR);
-    if (ufd < 0) return -1;
-    if (lock_file_excl(ufd) < 0) { close(ufd); return -1; }
+    char hpw[PASSWORD_MAX];
+    if (hash_password(new_password, hpw) != 0) return -1;
+    int ufd = g_fd.users;
+    mu_lock(&g_users_mu);
+    if (lock_file_excl(ufd) < 0) { mu_unlock(&g_users_mu); return -1; }
 
     user_record u;
     off_t off;
     if (read_user_by_id(ufd, user_id, &u, &off) != 0) {
-        unlock_file(ufd); close(ufd); return -1;
+        unlock_file(ufd); mu_unlock(&g_users_mu); return -1;
     }
-    int jfd;
-    if (journal_open_locked(&jfd) != 0) { unlock_file(ufd); close(ufd); return -1; }
-    journal_entry je; bzero(&je, sizeof(je));
-    je.kind = 10; je.user_off1 = off; je.old_user1 = u;
-    if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); unlock_file(ufd); close(ufd); return -1; }
 
-    char hpw[PASSWORD_MAX];
-    hash_password(new_password, hpw);
     snprintf(u.password, sizeof(u.password), "%s", hpw);
-    u.password[PASSWORD_MAX - 1] = 0;
-    if (pwrite(ufd, &u, sizeof(u), off) != (ssize_t)sizeof(u)) { unlock_file(ufd); close(ufd); unlock_file(jfd); close(jfd); return -1; }
-    fsync(ufd);
-
-    journal_clear(jfd);
-    unlock_file(jfd);
-    close(jfd);
+    if (timed_pwrite(ufd, &u, sizeof(u), off) != (ssize_t)sizeof(u)) { unlock_file(ufd); mu_unlock(&g_users_mu); return -1; }
+    timed_fsync(ufd);
 
     unlock_file(ufd);
-    close(ufd);
+    mu_unlock(&g_users_mu);
     return 0;
 }
 
+// loans.db is rewritten and appended under its file lock, which does not
+// exclude our own threads; this does, for every writer.
+static pthread_mutex_t g_loans_mu = PTHREAD_MUTEX_INITIALIZER;
+
 int db_apply_loan(int customer_user_id, long long amount, int *loan_id_out) {
-    int lfd = open(LOANS_FILE, O_RDWR);
-    if (lfd < 0) return -1;
-    if (lock_file_excl(lfd) < 0) { close(lfd); return -1; }
+    int lfd = g_fd.loans;
+    mu_lock(&g_loans_mu);
+    if (lock_file_excl(lfd) < 0) { mu_unlock(&g_loans_mu); return -1; }
 
-    int id = next_id_from_file(lfd, sizeof(loan_record), offsetof(loan_record, id));
+    int id = id_next(SEQ_LOAN);
+    if (id < 0) { unlock_file(lfd); mu_unlock(&g_loans_mu); return -1; }
     loan_record L;
     bzero(&L, sizeof(L));
     L.id = id;
@@ -566,211 +2500,220 @@ int db_apply_loan(int customer_user_id, long long amount, int *loan_id_out) {
     L.status = LOAN_PENDING;
 
     off_t off = lseek(lfd, 0, SEEK_END);
-    pwrite(lfd, &L, sizeof(L), off);
-    fsync(lfd);
+    if (timed_pwrite(lfd, &L, sizeof(L), off) != (ssize_t)sizeof(L)) {
+        unlock_file(lfd); mu_unlock(&g_loans_mu); return -1;
+    }
+    timed_fsync(lfd);
 
     unlock_file(lfd);
-    close(lfd);
+    mu_unlock(&g_loans_mu);
 
     if (loan_id_out) *loan_id_out = id;
     return 0;
 }
 
-int db_send_history(int fd, int user_id) {
-    int afd = open(ACCOUNTS_FILE, O_RDONLY);
-    int tfd = open(TXN_LOG, O_RDONLY);
-    if (afd < 0 || tfd < 0) { if (afd >= 0) close(afd); if (tfd >= 0) close(tfd); return -1; }
-    if (lock_file_shared(afd) < 0) { close(afd); close(tfd); return -1; }
-
-    account_record a;
-    off_t off;
-    if (read_account_by_user(afd, user_id, &a, &off) != 0) {
-        unlock_file(afd); close(afd); close(tfd); return -1;
-    }
-
-    int acct_no = a.account_number;
-    unlock_file(afd);
-    close(afd);
-
-    FILE *fp = fdopen(tfd, "r");
-    if (!fp) { close(tfd); return -1; }
-
-    char *line = NULL;
-    size_t n = 0;
-    char tag[32];
-    snprintf(tag, sizeof(tag), "acct=%d", acct_no);
-
-    while (getline(&line, &n, fp) != -1) {
-        if (!strstr(line, tag)) continue;
-
-        char *pbar = strchr(line, '|');
-        if (!pbar) continue;
-
-        long long secs = 0;
-        if (sscanf(line, "%lld", &secs) != 1) continue;
-
-        time_t tt = (time_t)secs;
-        struct tm tm;
-        localtime_r(&tt, &tm);
-        char ts[32];
-        strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
-
-        char outbuf[1024];
-        snprintf(outbuf, sizeof(outbuf), "%s%s", ts, pbar);
-        send(fd, outbuf, strlen(outbuf), 0);
-    }
-
-    free(line);
-    fclose(fp);
-    return 0;
+int db_send_history(db_emit_fn emit, void *arg, int user_id) {
+    int acct_no;
+    if (db_get_account_number(user_id, &acct_no) != 0) return -1;
+    return db_send_history_by_account(emit, arg, acct_no);
 }
 
 int db_append_feedback(int user_id, const char *text) {
-    int ffd = open(FEEDBACK_LOG, O_WRONLY | O_APPEND);
-    if (ffd < 0) return -1;
+    int ffd = g_fd.feedback;
     time_t now = time(NULL);
     char buf[1024];
     int n = snprintf(buf, sizeof(buf), "%ld|uid=%d|%s\n", (long)now, user_id, text ? text : "-");
-    if (write(ffd, buf, n) != n) { close(ffd); return -1; }
-    fsync(ffd);
-    close(ffd);
+    if (timed_write(ffd, buf, n) != n) return -1;
+    timed_fsync(ffd);
     return 0;
 }
 
 int db_add_user_with_account(const char *username, const char *password, int role, int active, long long initial_balance,
                              int *new_user_id, int *new_account_number) {
-    int ufd = open(USERS_FILE, O_RDWR);
-    int afd = open(ACCOUNTS_FILE, O_RDWR);
-    if (ufd < 0 || afd < 0) { if (ufd >= 0) close(ufd); if (afd >= 0) close(afd); return -1; }
+    char hpw[PASSWORD_MAX];
+    if (hash_password(password, hpw) != 0) return -1;
+    int ufd = g_fd.users;
 
-    // Create user
-    if (lock_file_excl(ufd) < 0) { close(ufd); close(afd); return -1; }
+    // Create user; the index write lock also serializes concurrent creators
+    if (lock_file_excl(ufd) < 0) return -1;
+    rw_wrlock(&g_user_idx_lock);
 
-    user_record exists;
-    off_t dummy;
-    if (read_user_by_username(ufd, username, &exists, &dummy) == 0) {
-        unlock_file(ufd); close(ufd); close(afd); return -1;
+    char key[USERNAME_MAX + 1];
+    if (str_index_get(&g_user_by_name, user_key(username, key), NULL, NULL) == 0) {
+        rw_unlock(&g_user_idx_lock);
+        unlock_file(ufd); return -1;
     }
 
-    int uid = next_id_from_file(ufd, sizeof(user_record), offsetof(user_record, id));
+    int uid = id_next(SEQ_USER);
+    if (uid < 0) {
+        rw_unlock(&g_user_idx_lock);
+        unlock_file(ufd); return -1;
+    }
     user_record u;
     bzero(&u, sizeof(u));
     u.id = uid;
     u.role = role;
     u.active = active ? 1 : 0;
-    u.session_active = 0;
     strncpy(u.username, username, USERNAME_MAX - 1);
-    char hpw[PASSWORD_MAX];
-    hash_password(password, hpw);
     snprintf(u.password, sizeof(u.password), "%s", hpw);
 
     off_t uoff = lseek(ufd, 0, SEEK_END);
-    pwrite(ufd, &u, sizeof(u), uoff);
-    fsync(ufd);
+    if (timed_pwrite(ufd, &u, sizeof(u), uoff) != (ssize_t)sizeof(u)) {
+        rw_unlock(&g_user_idx_lock);
+        unlock_file(ufd); return -1;
+    }
+    timed_fsync(ufd);
+    user_index_add(&u, uoff);
+    rw_unlock(&g_user_idx_lock);
     unlock_file(ufd);
-    close(ufd);
 
     int acct_no = -1;
 
     if (role == ROLE_CUSTOMER) {
-        if (lock_file_excl(afd) < 0) { close(afd); return -1; }
-
-        int aid = next_id_from_file(afd, sizeof(account_record), offsetof(account_record, id));
+        // The index write lock serializes appenders; a new account is not
+        // reachable by other threads until it has been indexed.
+        rw_wrlock(&g_acct_idx_lock);
+
+        int aid = id_next(SEQ_ACCOUNT);
+        acct_no = aid < 0 ? -1 : id_next(SEQ_ACCOUNT_NO);
+        if (acct_no < 0) {
+            rw_unlock(&g_acct_idx_lock);
+            return -1;
+        }
         account_record a;
         bzero(&a, sizeof(a));
         a.id = aid;
         a.user_id = uid;
-        a.account_number = next_account_number(afd);
-        acct_no = a.account_number;
+        a.account_number = acct_no;
         a.balance = initial_balance;
 
-        off_t aoff = lseek(afd, 0, SEEK_END);
-        pwrite(afd, &a, sizeof(a), aoff);
-        fsync(afd);
-        unlock_file(afd);
+        off_t aoff;
+        if (account_append(&a, &aoff) != 0) {
+            rw_unlock(&g_acct_idx_lock);
+            return -1;
+        }
+        account_index_add(&a, aoff);
+        rw_unlock(&g_acct_idx_lock);
     }
 
-    close(afd);
-
     if (new_user_id) *new_user_id = uid;
     if (new_account_number) *new_account_number = acct_no;
     return 0;
 }
 
-int db_send_history_by_account(int fd, int account_number) {
-    int tfd = open(TXN_LOG, O_RDONLY);
-    if (tfd < 0) return -1;
-
-    FILE *fp = fdopen(tfd, "r");
-    if (!fp) { close(tfd); return -1; }
-
-    char *line = NULL;
-    size_t n = 0;
-    char tag[32];
-    snprintf(tag, sizeof(tag), "acct=%d", account_number);
-
-    while (getline(&line, &n, fp) != -1) {
-        if (!strstr(line, tag)) continue;
-
-        char *pbar = strchr(line, '|');
-        if (!pbar) continue;
+int db_format_txn(const txn_entry *e, char *buf, size_t cap) {
+    time_t tt = (time_t)e->ts;
+    struct tm tm;
+    localtime_r(&tt, &tm);
+    char ts[32], note[32] = "-";
+    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+    if (e->type == TXN_TRANSFER_OUT) snprintf(note, sizeof(note), "to=%d", e->peer);
+    else if (e->type == TXN_TRANSFER_IN) snprintf(note, sizeof(note), "from=%d", e->peer);
+    int n = snprintf(buf, cap, "%s|acct=%d|%s|amt=%lld|bal=%lld|%s",
+                     ts, e->acct_no, txnlog_type_name(e->type), e->amount, e->balance, note);
+    if (n < 0) return 0;
+    return (size_t)n >= cap ? (int)cap - 1 : n;
+}
 
-        long long secs = 0;
-        if (sscanf(line, "%lld", &secs) != 1) continue;
- 
-        time_t tt = (time_t)secs;
-        struct tm tm;
-        localtime_r(&tt, &tm);
-        char ts[32];
-        strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+int db_send_history_by_account(db_emit_fn emit, void *arg, int account_number) {
+    size_t n, total;
+    off_t *offs = txn_index_copy(account_number, 0, SIZE_MAX, &n, &total);
+    if (!offs) return n == total ? 0 : -1;
+
+    int rc = 0;
+    char out[512];
+    for (size_t i = 0; i < n && rc == 0; i++) {
+        txn_entry e;
+        if (read_txn_entry(offs[i], &e) < 0) { rc = -1; break; }
+        int len = db_format_txn(&e, out, sizeof(out) - 1);
+        out[len++] = '\n';
+        rc = emit(arg, out, (size_t)len);
+    }
+    free(offs);
+    return rc;
+}
 
-        char outbuf[1024];
-        snprintf(outbuf, sizeof(outbuf), "%s%s", ts, pbar);
-        send(fd, outbuf, strlen(outbuf), 0);
+// First position in the account's history with ts >= from_ts. Lines are
+// appended in LSN order with non-decreasing timestamps, so the account's
+// offset list is sorted by time too. The manifest narrows the search to
+// the segments that can hold the answer.
+static long long history_seek(int account_number, long long from_ts) {
+    off_t lo_pos, hi_pos;
+    seg_seek_bounds(from_ts, &lo_pos, &hi_pos);
+    size_t n, total;
+    size_t lo = txn_index_lower_bound(account_number, lo_pos);
+    size_t hi = txn_index_lower_bound(account_number, hi_pos);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        off_t *offs = txn_index_copy(account_number, mid, 1, &n, &total);
+        txn_entry e;
+        ssize_t rc = offs ? read_txn_entry(offs[0], &e) : -1;
+        free(offs);
+        if (rc < 0) return -1;
+        if (e.ts < from_ts) lo = mid + 1;
+        else hi = mid;
     }
+    return (long long)lo;
+}
 
-    free(line);
-    fclose(fp);
+int db_history_range(int account_number, long long from_ts, long long to_ts, long long cursor, int limit,
+                     txn_entry *out, int *n_out, long long *next_cursor) {
+    if (limit <= 0 || from_ts > to_ts) return -1;
+    if (cursor < 0 && (cursor = history_seek(account_number, from_ts)) < 0) return -1;
+
+    size_t n, total;
+    off_t *offs = txn_index_copy(account_number, (size_t)cursor, (size_t)limit, &n, &total);
+    if (!offs && n < total && (size_t)cursor < total) return -1;
+
+    // Segments that start after to_ts are not opened at all
+    off_t end = to_ts == LLONG_MAX ? TXN_POS(seg_head_id() + 1, 0) : seg_range_end(to_ts);
+    int got = 0, past_end = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (offs[i] >= end) { past_end = 1; break; }
+        if (read_txn_entry(offs[i], &out[got]) < 0) { free(offs); return -1; }
+        if (out[got].ts > to_ts) { past_end = 1; break; }
+        got++;
+    }
+    free(offs);
+    *n_out = got;
+    *next_cursor = !past_end && (size_t)cursor + n < total ? cursor + (long long)n : -1;
     return 0;
 }
 
+int db_history_page(int account_number, long long cursor, int limit,
+                    txn_entry *out, int *n_out, long long *next_cursor) {
+    if (cursor < 0) return -1;
+    return db_history_range(account_number, LLONG_MIN, LLONG_MAX, cursor, limit, out, n_out, next_cursor);
+}
+
 
 int db_assign_loan(int loan_id, const char *employee_username) {
-    int ufd = open(USERS_FILE, O_RDWR);
-    int lfd = open(LOANS_FILE, O_RDWR);
-    if (ufd < 0 || lfd < 0) { if (ufd >= 0) close(ufd); if (lfd >= 0) close(lfd); return -1; }
+    int ufd = g_fd.users;
+    int lfd = g_fd.loans;
 
-    if (lock_file_excl(lfd) < 0) { close(ufd); close(lfd); return -1; }
+    mu_lock(&g_loans_mu);
+    if (lock_file_excl(lfd) < 0) { mu_unlock(&g_loans_mu); return -1; }
 
     // Lookup employee
     user_record emp;
     off_t uoff = 0;
     if (read_user_by_username(ufd, employee_username, &emp, &uoff) != 0) {
-        unlock_file(lfd); close(ufd); close(lfd); return -3;
+        unlock_file(lfd); mu_unlock(&g_loans_mu); return -3;
     }
     if (emp.role != ROLE_EMPLOYEE || !emp.active) {
-        unlock_file(lfd); close(ufd); close(lfd); return -3;
+        unlock_file(lfd); mu_unlock(&g_loans_mu); return -3;
     }
 
     loan_record L;
     off_t off = 0;
     ssize_t rs;
     int rc = -4;
-    while ((rs = pread(lfd, &L, sizeof(L), off)) == (ssize_t)sizeof(L)) {
+    while ((rs = timed_pread(lfd, &L, sizeof(L), off)) == (ssize_t)sizeof(L)) {
         if (L.id == loan_id) {
             if (L.assigned_employee_user_id != 0) { rc = -2; break; }
-            // Journal loan assignment change
-            int jfd; if (journal_open_locked(&jfd) != 0) { rc = -1; break; }
-            journal_entry je; bzero(&je, sizeof(je));
-            je.kind = 11; je.loan_off1 = off; je.old_loan1 = L;
-            if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); rc = -1; break; }
-
             L.assigned_employee_user_id = emp.id;
-            if (pwrite(lfd, &L, sizeof(L), off) != (ssize_t)sizeof(L)) { unlock_file(jfd); close(jfd); rc = -1; break; }
-            fsync(lfd);
-            journal_clear(jfd);
-            unlock_file(jfd);
-            close(jfd);
+            if (timed_pwrite(lfd, &L, sizeof(L), off) != (ssize_t)sizeof(L)) { rc = -1; break; }
+            timed_fsync(lfd);
             rc = 0;
             break;
         }
@@ -778,26 +2721,25 @@ int db_assign_loan(int loan_id, const char *employee_username) {
     }
 
     unlock_file(lfd);
-    close(ufd);
-    close(lfd);
+    mu_unlock(&g_loans_mu);
     return rc;
 }
 
 int db_assign_loan_by_employee_id(int loan_id, int employee_user_id) {
-    int lfd = open(LOANS_FILE, O_RDWR);
-    if (lfd < 0) return -1;
-    if (lock_file_excl(lfd) < 0) { close(lfd); return -1; }
+    int lfd = g_fd.loans;
+    mu_lock(&g_loans_mu);
+    if (lock_file_excl(lfd) < 0) { mu_unlock(&g_loans_mu); return -1; }
 
     loan_record L;
     off_t off = 0;
     ssize_t rs;
     int rc = -4;
-    while ((rs = pread(lfd, &L, sizeof(L), off)) == (ssize_t)sizeof(L)) {
+    while ((rs = timed_pread(lfd, &L, sizeof(L), off)) == (ssize_t)sizeof(L)) {
         if (L.id == loan_id) {
             if (L.assigned_employee_user_id != 0) { rc = -2; break; }
             L.assigned_employee_user_id = employee_user_id;
-            if (pwrite(lfd, &L, sizeof(L), off) != (ssize_t)sizeof(L)) { rc = -1; break; }
-            fsync(lfd);
+            if (timed_pwrite(lfd, &L, sizeof(L), off) != (ssize_t)sizeof(L)) { rc = -1; break; }
+            timed_fsync(lfd);
             rc = 0;
             break;
         }
@@ -805,70 +2747,52 @@ int db_assign_loan_by_employee_id(int loan_id, int employee_user_id) {
     }
 
     unlock_file(lfd);
-    close(lfd);
+    mu_unlock(&g_loans_mu);
     return rc;
 }
 
 int db_set_user_active_by_id(int user_id, int active) {
-    int ufd = open(USERS_FILE, O_RDWR);
-    if (ufd < 0) return -1;
-    if (lock_file_excl(ufd) < 0) { close(ufd); return -1; }
+    int ufd = g_fd.users;
+    mu_lock(&g_users_mu);
+    if (lock_file_excl(ufd) < 0) { mu_unlock(&g_users_mu); return -1; }
 
     user_record u;
     off_t off;
     int rc = read_user_by_id(ufd, user_id, &u, &off);
     if (rc == 0) {
         u.active = active ? 1 : 0;
-        if (!u.active) u.session_active = 0;
-        pwrite(ufd, &u, sizeof(u), off);
-        fsync(ufd);
+        if (!u.active) session_end(u.id, 0);
+        timed_pwrite(ufd, &u, sizeof(u), off);
+        timed_fsync(ufd);
     }
 
     unlock_file(ufd);
-    close(ufd);
+    mu_unlock(&g_users_mu);
     return rc;
 }
 
 int db_get_user_id_by_account_number(int account_number, int *user_id_out) {
     if (!user_id_out) return -1;
-    int afd = open(ACCOUNTS_FILE, O_RDONLY);
-    if (afd < 0) return -1;
-    if (lock_file_shared(afd) < 0) { close(afd); return -1; }
-
-    account_record a;
-    off_t off;
-    int rc = read_account_by_account_number(afd, account_number, &a, &off);
-    if (rc == 0) {
-        *user_id_out = a.user_id;
-    }
-
-    unlock_file(afd);
-    close(afd);
+    rw_rdlock(&g_acct_idx_lock);
+    int rc = int_index_get(&g_acct_by_number, account_number, NULL, user_id_out);
+    rw_unlock(&g_acct_idx_lock);
     return rc;
 }
 
 int db_set_loan_status(int loan_id, int status) {
-    int lfd = open(LOANS_FILE, O_RDWR);
-    if (lfd < 0) return -1;
-    if (lock_file_excl(lfd) < 0) { close(lfd); return -1; }
+    int lfd = g_fd.loans;
+    mu_lock(&g_loans_mu);
+    if (lock_file_excl(lfd) < 0) { mu_unlock(&g_loans_mu); return -1; }
 
     off_t off = 0;
     loan_record L;
     ssize_t rs;
     int rc = -1;
-    while ((rs = pread(lfd, &L, sizeof(L), off)) == (ssize_t)sizeof(L)) {
+    while ((rs = timed_pread(lfd, &L, sizeof(L), off)) == (ssize_t)sizeof(L)) {
         if (L.id == loan_id) {
-            int jfd; if (journal_open_locked(&jfd) != 0) { unlock_file(lfd); close(lfd); return -1; }
-            journal_entry je; bzero(&je, sizeof(je));
-            je.kind = 11; je.loan_off1 = off; je.old_loan1 = L;
-            if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); unlock_file(lfd); close(lfd); return -1; }
-
             L.status = status;
-            if (pwrite(lfd, &L, sizeof(L), off) != (ssize_t)sizeof(L)) { unlock_file(lfd); close(lfd); unlock_file(jfd); close(jfd); return -1; }
-            fsync(lfd);
-            journal_clear(jfd);
-            unlock_file(jfd);
-            close(jfd);
+            if (timed_pwrite(lfd, &L, sizeof(L), off) != (ssize_t)sizeof(L)) { unlock_file(lfd); mu_unlock(&g_loans_mu); return -1; }
+            timed_fsync(lfd);
             rc = 0;
             break;
         }
@@ -876,60 +2800,63 @@ int db_set_loan_status(int loan_id, int status) {
     }
 
     unlock_file(lfd);
-    close(lfd);
+    mu_unlock(&g_loans_mu);
     return rc;
 }
 
 int db_set_loan_status_owned(int loan_id, int employee_user_id, int new_status) {
     if (new_status != LOAN_APPROVED && new_status != LOAN_REJECTED) return -5;
 
-    int lfd = open(LOANS_FILE, O_RDWR);
-    if (lfd < 0) return -1;
-    if (lock_file_excl(lfd) < 0) { close(lfd); return -1; }
+    int lfd = g_fd.loans;
+    mu_lock(&g_loans_mu);
+    if (lock_file_excl(lfd) < 0) { mu_unlock(&g_loans_mu); return -1; }
 
     loan_record L;
     off_t loff = 0;
     ssize_t rs;
     int found = 0;
-    while ((rs = pread(lfd, &L, sizeof(L), loff)) == (ssize_t)sizeof(L)) {
+    while ((rs = timed_pread(lfd, &L, sizeof(L), loff)) == (ssize_t)sizeof(L)) {
         if (L.id == loan_id) { found = 1; break; }
         loff += sizeof(L);
     }
-    if (!found) { unlock_file(lfd); close(lfd); return -4; }
+    if (!found) { unlock_file(lfd); mu_unlock(&g_loans_mu); return -4; }
 
-    if (L.assigned_employee_user_id != employee_user_id) { unlock_file(lfd); close(lfd); return -3; }
-    if (L.status != LOAN_PENDING) { unlock_file(lfd); close(lfd); return -5; }
+    if (L.assigned_employee_user_id != employee_user_id) { unlock_file(lfd); mu_unlock(&g_loans_mu); return -3; }
+    if (L.status != LOAN_PENDING) { unlock_file(lfd); mu_unlock(&g_loans_mu); return -5; }
 
     L.status = new_status;
-    if (pwrite(lfd, &L, sizeof(L), loff) != (ssize_t)sizeof(L)) { unlock_file(lfd); close(lfd); return -1; }
-    fsync(lfd);
+    if (timed_pwrite(lfd, &L, sizeof(L), loff) != (ssize_t)sizeof(L)) { unlock_file(lfd); mu_unlock(&g_loans_mu); return -1; }
+    timed_fsync(lfd);
 
     unlock_file(lfd);
-    close(lfd);
+    mu_unlock(&g_loans_mu);
 
     if (new_status == LOAN_APPROVED) {
-        int afd = open(ACCOUNTS_FILE, O_RDWR);
-        int tfd = open(TXN_LOG, O_WRONLY | O_APPEND);
-        if (afd < 0 || tfd < 0) { if (afd >= 0) close(afd); if (tfd >= 0) close(tfd); return -1; }
-        if (lock_file_excl(afd) < 0) { close(afd); close(tfd); return -1; }
+        int afd = g_fd.accounts;
 
         account_record a;
         off_t aoff;
-        if (read_account_by_user(afd, L.customer_user_id, &a, &aoff) != 0) {
-            unlock_file(afd); close(afd); close(tfd); return -1;
+        int acct_no;
+        if (account_slot_by_user(L.customer_user_id, &aoff, &acct_no) != 0) return -1;
+        wal_enter();
+        acct_lock_excl(acct_no);
+        if (read_account_at(afd, aoff, &a, NULL) != 0) {
+            acct_unlock(acct_no); wal_leave(); return -1;
         }
 
         a.balance += L.amount;
-        if (pwrite(afd, &a, sizeof(a), aoff) != (ssize_t)sizeof(a)) {
-            unlock_file(afd); close(afd); close(tfd); return -1;
-        }
-        fsync(afd);
-
-        append_txn(tfd, a.account_number, "LOAN_CREDIT", L.amount, a.balance, "-");
-
-        unlock_file(afd);
-        close(afd);
-        close(tfd);
+        wal_record r;
+        wal_record_init(&r);
+        wal_add_update(&r, aoff, &a);
+        wal_add_txn(&r, a.account_number, TXN_LOAN_CREDIT, L.amount, a.balance, 0);
+
+        int rc = wal_commit(&r);
+        if (rc == 0 && write_account_at(aoff, &a) != 0) rc = -1;
+
+        acct_unlock(acct_no);
+        wal_leave();
+        if (rc != 0) return -1;
+        wal_maybe_checkpoint();
     }
 
     return 0;
@@ -937,92 +2864,63 @@ int db_set_loan_status_owned(int loan_id, int employee_user_id, int new_status)
 
 
 int db_set_user_active(const char *username, int active) {
-    int ufd = open(USERS_FILE, O_RDWR);
-    if (ufd < 0) return -1;
-    if (lock_file_excl(ufd) < 0) { close(ufd); return -1; }
+    int ufd = g_fd.users;
+    mu_lock(&g_users_mu);
+    if (lock_file_excl(ufd) < 0) { mu_unlock(&g_users_mu); return -1; }
 
     user_record u;
     off_t off;
     int rc = read_user_by_username(ufd, username, &u, &off);
     if (rc == 0) {
-        int jfd; if (journal_open_locked(&jfd) != 0) { unlock_file(ufd); close(ufd); return -1; }
-        journal_entry je; bzero(&je, sizeof(je));
-        je.kind = 10; je.user_off1 = off; je.old_user1 = u;
-        if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); unlock_file(ufd); close(ufd); return -1; }
-
         u.active = active ? 1 : 0;
-        if (!u.active) u.session_active = 0;
-        if (pwrite(ufd, &u, sizeof(u), off) != (ssize_t)sizeof(u)) { unlock_file(ufd); close(ufd); unlock_file(jfd); close(jfd); return -1; }
-        fsync(ufd);
-        journal_clear(jfd);
-        unlock_file(jfd);
-        close(jfd);
+        if (!u.active) session_end(u.id, 0);
+        if (timed_pwrite(ufd, &u, sizeof(u), off) != (ssize_t)sizeof(u)) { unlock_file(ufd); mu_unlock(&g_users_mu); return -1; }
+        timed_fsync(ufd);
     }
 
     unlock_file(ufd);
-    close(ufd);
+    mu_unlock(&g_users_mu);
     return rc;
 }
 
-int db_send_feedback(int fd) {
-    int ffd = open(FEEDBACK_LOG, O_RDONLY);
-    if (ffd < 0) return -1;
-
-    FILE *fp = fdopen(ffd, "r");
-    if (!fp) { close(ffd); return -1; }
+typedef struct {
+    db_emit_fn emit;
+    void *arg;
+} feedback_ctx;
 
-    char *line = NULL;
-    size_t n = 0;
-    while (getline(&line, &n, fp) != -1) {
-        send(fd, line, strlen(line), 0);
-    }
+static int send_feedback_line(const char *line, size_t len, void *arg) {
+    feedback_ctx *f = (feedback_ctx *)arg;
+    return f->emit(f->arg, line, len);
+}
 
-    free(line);
-    fclose(fp);
-    return 0;
+int db_send_feedback(db_emit_fn emit, void *arg) {
+    feedback_ctx f = { emit, arg };
+    return scan_lines(g_fd.feedback, send_feedback_line, &f);
 }
 
 int db_set_user_role(const char *username, int role) {
-    int ufd = open(USERS_FILE, O_RDWR);
-    if (ufd < 0) return -1;
-    if (lock_file_excl(ufd) < 0) { close(ufd); return -1; }
+    int ufd = g_fd.users;
+    mu_lock(&g_users_mu);
+    if (lock_file_excl(ufd) < 0) { mu_unlock(&g_users_mu); return -1; }
 
     user_record u;
     off_t off;
     int rc = read_user_by_username(ufd, username, &u, &off);
     if (rc == 0) {
-        int jfd; if (journal_open_locked(&jfd) != 0) { unlock_file(ufd); close(ufd); return -1; }
-        journal_entry je; bzero(&je, sizeof(je));
-        je.kind = 10; je.user_off1 = off; je.old_user1 = u;
-        if (journal_write_and_sync(jfd, &je) != 0) { unlock_file(jfd); close(jfd); unlock_file(ufd); close(ufd); return -1; }
-
         u.role = role;
-        if (pwrite(ufd, &u, sizeof(u), off) != (ssize_t)sizeof(u)) { unlock_file(ufd); close(ufd); unlock_file(jfd); close(jfd); return -1; }
-        fsync(ufd);
-        journal_clear(jfd);
-        unlock_file(jfd);
-        close(jfd);
+        if (timed_pwrite(ufd, &u, sizeof(u), off) != (ssize_t)sizeof(u)) { unlock_file(ufd); mu_unlock(&g_users_mu); return -1; }
+        timed_fsync(ufd);
     }
 
     unlock_file(ufd);
-    close(ufd);
+    mu_unlock(&g_users_mu);
     return rc;
 }
 
 int db_get_account_number(int user_id, int *acct_no_out) {
     if (!acct_no_out) return -1;
-    int afd = open(ACCOUNTS_FILE, O_RDONLY);
-    if (afd < 0) return -1;
-    if (lock_file_shared(afd) < 0) { close(afd); return -1; }
-
-    account_record a;
-    off_t off;
-    int rc = read_account_by_user(afd, user_id, &a, &off);
-    if (rc == 0) {
-        *acct_no_out = a.account_number;
-    }
-
-    unlock_file(afd);
-    close(afd);
+    rw_rdlock(&g_acct_idx_lock);
+    int rc = int_index_get(&g_acct_by_user, user_id, NULL, acct_no_out);
+    rw_unlock(&g_acct_idx_lock);
     return rc;
 }
@@ -1,11 +1,27 @@
 
 #ifndef DB_H
 #define DB_H
+#include <stdint.h>
 #include "common.h"
 
+// Store transactions.log as checksummed binary records (txnlog.h) rather
+// than text lines. Call before db_init; an existing text log is converted.
+void db_set_binary_txn_log(int enable);
+// Size at which transactions.log is closed as a segment (0 = never).
+void db_set_txn_segment_bytes(long long bytes);
+// Map accounts.db and read and update balances in place. Call before
+// db_init; an existing file is converted to the headered slot layout.
+void db_set_mmap_accounts(int enable);
+// PBKDF2 iterations for new password hashes. Logins verifying a hash made
+// with a different count rewrite it with this one.
+void db_set_kdf_iterations(unsigned iterations);
 int db_init(void);
-int db_login(const char *username, const char *password, user_record *out);
-int db_logout(int user_id);
+void db_shutdown(void);
+// Sessions live in memory: a user holds at most one, identified by the
+// token db_login returns, and none survive a restart. db_logout ends the
+// session only if it still holds that token.
+int db_login(const char *username, const char *password, user_record *out, uint64_t *token_out);
+int db_logout(int user_id, uint64_t token);
 
 int db_get_balance(int user_id, long long *bal_out);
 int db_deposit(int user_id, long long amount, long long *new_bal);
@@ -13,7 +29,11 @@ int db_withdraw(int user_id, long long amount, long long *new_bal);
 
 int db_transfer_to_account(int from_user_id, int to_account_number, long long amount);
 
-int db_send_history(int fd, int user_id);
+// Streamed output (history, feedback) is handed to the caller a line at a
+// time; a non-zero return stops the scan.
+typedef int (*db_emit_fn)(void *arg, const char *data, size_t len);
+
+int db_send_history(db_emit_fn emit, void *arg, int user_id);
 
 int db_change_password(int user_id, const char *new_password);
 int db_apply_loan(int customer_user_id, long long amount, int *loan_id_out);
@@ -25,12 +45,27 @@ int db_set_loan_status_owned(int loan_id, int employee_user_id, int new_status);
 int db_add_user_with_account(const char *username, const char *password, int role, int active, long long initial_balance,
                              int *new_user_id, int *new_account_number);
 
-int db_send_history_by_account(int fd, int account_number);
+int db_send_history_by_account(db_emit_fn emit, void *arg, int account_number);
 
 int db_set_loan_status(int loan_id, int status);
 int db_set_user_active(const char *username, int active);
 int db_set_user_active_by_id(int user_id, int active);
-int db_send_feedback(int fd);
+int db_send_feedback(db_emit_fn emit, void *arg);
+
+// Copies up to `limit` of an account's transactions, oldest first, starting
+// at position `cursor` (0 = first). *next_cursor is the position of the
+// following page, or -1 once the history is exhausted.
+int db_history_page(int account_number, long long cursor, int limit,
+                    txn_entry *out, int *n_out, long long *next_cursor);
+
+// Like db_history_page, limited to from_ts <= ts <= to_ts. A negative
+// cursor starts at the first entry at or after from_ts (found by binary
+// search); continuation pages pass the returned cursor.
+int db_history_range(int account_number, long long from_ts, long long to_ts, long long cursor, int limit,
+                     txn_entry *out, int *n_out, long long *next_cursor);
+
+// Renders an entry the way history lines are sent to clients (no newline).
+int db_format_txn(const txn_entry *e, char *buf, size_t cap);
 int db_set_user_role(const char *username, int role);
 
 int db_get_account_number(int user_id, int *acct_no_out);
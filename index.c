@@ -0,0 +1,194 @@
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+
+#define INDEX_MIN_CAP 64
+
+static size_t round_cap(size_t hint) {
+    size_t cap = INDEX_MIN_CAP;
+    while (cap < hint * 2) cap <<= 1;
+    return cap;
+}
+
+static size_t hash_int(int key) {
+    uint64_t h = (uint64_t)(uint32_t)key * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(h >> 17);
+}
+
+static unsigned long hash_str(const char *s) {
+    unsigned long h = 1469598103934665603UL; /* FNV-1a */
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+int int_index_init(int_index *ix, size_t hint) {
+    ix->cap = round_cap(hint);
+    ix->count = 0;
+    ix->slots = (int_slot *)calloc(ix->cap, sizeof(int_slot));
+    return ix->slots ? 0 : -1;
+}
+
+void int_index_free(int_index *ix) {
+    free(ix->slots);
+    ix->slots = NULL;
+    ix->cap = ix->count = 0;
+}
+
+// Adopts a copy of another table's slot array, e.g. one saved in a
+// snapshot. cap must be a power of two.
+int int_index_load(int_index *ix, const int_slot *slots, size_t cap) {
+    if (cap == 0 || (cap & (cap - 1)) != 0) return -1;
+    int_slot *copy = (int_slot *)malloc(cap * sizeof(int_slot));
+    if (!copy) return -1;
+    memcpy(copy, slots, cap * sizeof(int_slot));
+    ix->slots = copy;
+    ix->cap = cap;
+    ix->count = 0;
+    for (size_t i = 0; i < cap; i++) ix->count += copy[i].used != 0;
+    return 0;
+}
+
+static int int_index_grow(int_index *ix) {
+    int_index bigger;
+    bigger.cap = ix->cap * 2;
+    bigger.count = 0;
+    bigger.slots = (int_slot *)calloc(bigger.cap, sizeof(int_slot));
+    if (!bigger.slots) return -1;
+    for (size_t i = 0; i < ix->cap; i++) {
+        if (ix->slots[i].used)
+            int_index_put(&bigger, ix->slots[i].key, ix->slots[i].off, ix->slots[i].aux);
+    }
+    free(ix->slots);
+    *ix = bigger;
+    return 0;
+}
+
+int int_index_put(int_index *ix, int key, off_t off, int aux) {
+    if ((ix->count + 1) * 10 > ix->cap * 7 && int_index_grow(ix) != 0) return -1;
+    size_t mask = ix->cap - 1;
+    size_t i = hash_int(key) & mask;
+    while (ix->slots[i].used && ix->slots[i].key != key) i = (i + 1) & mask;
+    if (!ix->slots[i].used) {
+        ix->slots[i].used = 1;
+        ix->slots[i].key = key;
+        ix->count++;
+    }
+    ix->slots[i].off = off;
+    ix->slots[i].aux = aux;
+    return 0;
+}
+
+int int_index_get(const int_index *ix, int key, off_t *off_out, int *aux_out) {
+    if (!ix->slots) return -1;
+    size_t mask = ix->cap - 1;
+    size_t i = hash_int(key) & mask;
+    while (ix->slots[i].used) {
+        if (ix->slots[i].key == key) {
+            if (off_out) *off_out = ix->slots[i].off;
+            if (aux_out) *aux_out = ix->slots[i].aux;
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+// Backward-shift deletion: later members of the probe run move up into
+// the hole, so lookups never need tombstones.
+int int_index_del(int_index *ix, int key) {
+    if (!ix->slots) return -1;
+    size_t mask = ix->cap - 1;
+    size_t i = hash_int(key) & mask;
+    while (ix->slots[i].used && ix->slots[i].key != key) i = (i + 1) & mask;
+    if (!ix->slots[i].used) return -1;
+    for (size_t j = (i + 1) & mask; ix->slots[j].used; j = (j + 1) & mask) {
+        size_t home = hash_int(ix->slots[j].key) & mask;
+        // Slot j stays put if its home lies cyclically in (i, j]
+        int stays = i < j ? (home > i && home <= j) : (home > i || home <= j);
+        if (stays) continue;
+        ix->slots[i] = ix->slots[j];
+        i = j;
+    }
+    memset(&ix->slots[i], 0, sizeof(ix->slots[i]));
+    ix->count--;
+    return 0;
+}
+
+int str_index_init(str_index *ix, size_t hint) {
+    ix->cap = round_cap(hint);
+    ix->count = 0;
+    ix->slots = (str_slot *)calloc(ix->cap, sizeof(str_slot));
+    return ix->slots ? 0 : -1;
+}
+
+void str_index_free(str_index *ix) {
+    for (size_t i = 0; i < ix->cap; i++) free(ix->slots[i].key);
+    free(ix->slots);
+    ix->slots = NULL;
+    ix->cap = ix->count = 0;
+}
+
+static void str_index_place(str_index *ix, char *key, unsigned long h, off_t off, int aux) {
+    size_t mask = ix->cap - 1;
+    size_t i = (size_t)h & mask;
+    while (ix->slots[i].key) i = (i + 1) & mask;
+    ix->slots[i].key = key;
+    ix->slots[i].hash = h;
+    ix->slots[i].off = off;
+    ix->slots[i].aux = aux;
+    ix->count++;
+}
+
+static int str_index_grow(str_index *ix) {
+    str_index bigger;
+    bigger.cap = ix->cap * 2;
+    bigger.count = 0;
+    bigger.slots = (str_slot *)calloc(bigger.cap, sizeof(str_slot));
+    if (!bigger.slots) return -1;
+    for (size_t i = 0; i < ix->cap; i++) {
+        if (ix->slots[i].key)
+            str_index_place(&bigger, ix->slots[i].key, ix->slots[i].hash, ix->slots[i].off, ix->slots[i].aux);
+    }
+    free(ix->slots);
+    *ix = bigger;
+    return 0;
+}
+
+int str_index_put(str_index *ix, const char *key, off_t off, int aux) {
+    unsigned long h = hash_str(key);
+    size_t mask = ix->cap - 1;
+    for (size_t i = (size_t)h & mask; ix->slots[i].key; i = (i + 1) & mask) {
+        if (ix->slots[i].hash == h && strcmp(ix->slots[i].key, key) == 0) {
+            ix->slots[i].off = off;
+            ix->slots[i].aux = aux;
+            return 0;
+        }
+    }
+    if ((ix->count + 1) * 10 > ix->cap * 7 && str_index_grow(ix) != 0) return -1;
+    char *copy = strdup(key);
+    if (!copy) return -1;
+    str_index_place(ix, copy, h, off, aux);
+    return 0;
+}
+
+int str_index_get(const str_index *ix, const char *key, off_t *off_out, int *aux_out) {
+    if (!ix->slots) return -1;
+    unsigned long h = hash_str(key);
+    size_t mask = ix->cap - 1;
+    for (size_t i = (size_t)h & mask; ix->slots[i].key; i = (i + 1) & mask) {
+        if (ix->slots[i].hash == h && strcmp(ix->slots[i].key, key) == 0) {
+            if (off_out) *off_out = ix->slots[i].off;
+            if (aux_out) *aux_out = ix->slots[i].aux;
+            return 0;
+        }
+    }
+    return -1;
+}
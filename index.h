@@ -0,0 +1,51 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Resident hash indexes mapping a record key to its file offset.
+ * Open addressing with linear probing; tables double when 70% full.
+ * Callers provide their own locking.
+ */
+
+typedef struct {
+    int key;
+    int used;
+    int aux;              /* small caller-defined payload stored with the key */
+    off_t off;
+} int_slot;
+
+typedef struct {
+    int_slot *slots;
+    size_t cap;           /* always a power of two */
+    size_t count;
+} int_index;
+
+typedef struct {
+    char *key;            /* NULL when the slot is empty */
+    unsigned long hash;
+    int aux;
+    off_t off;
+} str_slot;
+
+typedef struct {
+    str_slot *slots;
+    size_t cap;
+    size_t count;
+} str_index;
+
+int  int_index_init(int_index *ix, size_t hint);
+void int_index_free(int_index *ix);
+int  int_index_put(int_index *ix, int key, off_t off, int aux);
+int  int_index_get(const int_index *ix, int key, off_t *off_out, int *aux_out);
+int  int_index_del(int_index *ix, int key);
+int  int_index_load(int_index *ix, const int_slot *slots, size_t cap);
+
+int  str_index_init(str_index *ix, size_t hint);
+void str_index_free(str_index *ix);
+int  str_index_put(str_index *ix, const char *key, off_t off, int aux);
+int  str_index_get(const str_index *ix, const char *key, off_t *off_out, int *aux_out);
+
+#endif
@@ -0,0 +1,200 @@
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockprof.h"
+
+#define LOCKPROF_PROBE 64     /* probes before a site falls back to sub -1 */
+#define LOCKPROF_HELD  8      /* locks a thread can hold with hold times tracked */
+
+typedef struct {
+    const char *res, *op;     /* key; res is set last, with a release store */
+    int sub, excl;
+    uint64_t acquired, contended, wait_ns, wait_max, holds, hold_ns, hold_max;
+} lock_site;
+
+static lock_site g_sites[LOCKPROF_SLOTS];
+static pthread_mutex_t g_sites_mu = PTHREAD_MUTEX_INITIALIZER;
+
+// Locks the calling thread holds, to time them at release
+static __thread struct { lock_site *site; const char *res; int sub; unsigned long long since; } t_held[LOCKPROF_HELD];
+static __thread int t_nheld;
+
+static unsigned site_hash(const char *res, int sub, int excl, const char *op) {
+    uint64_t h = (uintptr_t)res * 0x9e3779b97f4a7c15ull;
+    h ^= ((uint64_t)(unsigned)sub << 1 | (unsigned)excl) * 0xbf58476d1ce4e5b9ull;
+    h ^= (uintptr_t)op * 0x94d049bb133111ebull;
+    return (unsigned)(h ^ (h >> 31)) & (LOCKPROF_SLOTS - 1);
+}
+
+static int site_is(const lock_site *s, const char *res, int sub, int excl, const char *op) {
+    return s->res == res && s->sub == sub && s->excl == excl && s->op == op;
+}
+
+static lock_site *site_find(const char *res, int sub, int excl, const char *op) {
+    unsigned h = site_hash(res, sub, excl, op);
+    for (unsigned i = 0; i < LOCKPROF_PROBE; i++) {
+        lock_site *s = &g_sites[(h + i) & (LOCKPROF_SLOTS - 1)];
+        const char *key = __atomic_load_n(&s->res, __ATOMIC_ACQUIRE);
+        if (key && site_is(s, res, sub, excl, op)) return s;
+        if (key) continue;
+
+        // First use of this site: claim the slot, or find it claimed meanwhile
+        pthread_mutex_lock(&g_sites_mu);
+        for (; i < LOCKPROF_PROBE; i++) {
+            s = &g_sites[(h + i) & (LOCKPROF_SLOTS - 1)];
+            if (!s->res) {
+                s->op = op;
+                s->sub = sub;
+                s->excl = excl;
+                __atomic_store_n(&s->res, res, __ATOMIC_RELEASE);
+                break;
+            }
+            if (site_is(s, res, sub, excl, op)) break;
+        }
+        pthread_mutex_unlock(&g_sites_mu);
+        if (i < LOCKPROF_PROBE) return s;
+        break;
+    }
+    return sub >= 0 ? site_find(res, -1, excl, op) : NULL;
+}
+
+static void raise_max(uint64_t *max, uint64_t v) {
+    uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(max, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+void lockprof_acquired(const char *res, int sub, int excl, const char *op, unsigned long long wait_ns) {
+    lock_site *s = site_find(res, sub, excl, op);
+    if (!s) return;
+    __atomic_fetch_add(&s->acquired, 1, __ATOMIC_RELAXED);
+    if (wait_ns >= LOCKPROF_CONTENDED_NS) __atomic_fetch_add(&s->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->wait_ns, wait_ns, __ATOMIC_RELAXED);
+    raise_max(&s->wait_max, wait_ns);
+    if (t_nheld == LOCKPROF_HELD) return;
+    t_held[t_nheld].site = s;
+    t_held[t_nheld].res = res;
+    t_held[t_nheld].sub = sub;
+    t_held[t_nheld].since = stats_now();
+    t_nheld++;
+}
+
+void lockprof_released(const char *res, int sub) {
+    for (int i = t_nheld - 1; i >= 0; i--) {
+        if (t_held[i].sub != sub || (t_held[i].res != res && strcmp(t_held[i].res, res))) continue;
+        lock_site *s = t_held[i].site;
+        uint64_t held = stats_now() - t_held[i].since;
+        __atomic_fetch_add(&s->holds, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&s->hold_ns, held, __ATOMIC_RELAXED);
+        raise_max(&s->hold_max, held);
+        t_held[i] = t_held[--t_nheld];
+        return;
+    }
+}
+
+// Rows are sites, or sites folded into a resource (op NULL) or an
+// operation (res NULL).
+static int by_wait(const void *a, const void *b) {
+    const lock_site *x = (const lock_site *)a, *y = (const lock_site *)b;
+    return x->wait_ns < y->wait_ns ? 1 : x->wait_ns > y->wait_ns ? -1 : 0;
+}
+
+static int by_res(const void *a, const void *b) {
+    const lock_site *x = (const lock_site *)a, *y = (const lock_site *)b;
+    int c = strcmp(x->res, y->res);
+    return c ? c : (x->sub > y->sub) - (x->sub < y->sub);
+}
+
+static int by_op(const void *a, const void *b) {
+    return strcmp(((const lock_site *)a)->op, ((const lock_site *)b)->op);
+}
+
+// Merges runs of rows that cmp calls equal; returns the new count.
+static int fold(lock_site *rows, int n, int (*cmp)(const void *, const void *)) {
+    qsort(rows, (size_t)n, sizeof(*rows), cmp);
+    int out = 0;
+    for (int i = 0; i < n; i++) {
+        if (out > 0 && cmp(&rows[out - 1], &rows[i]) == 0) {
+            lock_site *d = &rows[out - 1];
+            d->acquired += rows[i].acquired;
+            d->contended += rows[i].contended;
+            d->wait_ns += rows[i].wait_ns;
+            d->holds += rows[i].holds;
+            d->hold_ns += rows[i].hold_ns;
+            if (rows[i].wait_max > d->wait_max) d->wait_max = rows[i].wait_max;
+            if (rows[i].hold_max > d->hold_max) d->hold_max = rows[i].hold_max;
+            continue;
+        }
+        rows[out++] = rows[i];
+    }
+    qsort(rows, (size_t)out, sizeof(*rows), by_wait);
+    return out;
+}
+
+static int emit_rows(const char *section, const lock_site *rows, int n, int top, stats_emit_fn emit, void *arg) {
+    for (int i = 0; i < n && i < top; i++) {
+        const lock_site *r = &rows[i];
+        char name[128] = "", line[384];
+        if (r->res) {
+            if (r->sub >= 0) snprintf(name, sizeof(name), "%s#%d", r->res, r->sub);
+            else snprintf(name, sizeof(name), "%s", r->res);
+        }
+        if (r->res && r->op) {
+            size_t len = strlen(name);
+            snprintf(name + len, sizeof(name) - len, " %s %s", r->excl ? "excl" : "shared", r->op);
+        } else if (r->op) {
+            snprintf(name, sizeof(name), "%s", r->op);
+        }
+        snprintf(line, sizeof(line), "%s %s acquired=%llu contended=%llu wait_total_us=%llu wait_max_us=%llu "
+                 "hold_avg_us=%.1f hold_max_us=%llu", section, name, (unsigned long long)r->acquired,
+                 (unsigned long long)r->contended, (unsigned long long)(r->wait_ns / 1000),
+                 (unsigned long long)(r->wait_max / 1000), r->holds ? (double)r->hold_ns / (double)r->holds / 1000.0 : 0.0,
+                 (unsigned long long)(r->hold_max / 1000));
+        if (emit(arg, line)) return -1;
+    }
+    return 0;
+}
+
+void lockprof_report(int top, stats_emit_fn emit, void *arg) {
+    lock_site *sites = (lock_site *)malloc(sizeof(g_sites));
+    lock_site *rows = (lock_site *)malloc(sizeof(g_sites));
+    if (!sites || !rows) { free(sites); free(rows); return; }
+    int n = 0;
+    for (int i = 0; i < LOCKPROF_SLOTS; i++) {
+        lock_site *s = &g_sites[i];
+        const char *res = __atomic_load_n(&s->res, __ATOMIC_ACQUIRE);
+        if (!res) continue;
+        lock_site *r = &sites[n++];
+        r->res = res;
+        r->op = s->op;
+        r->sub = s->sub;
+        r->excl = s->excl;
+        r->acquired = __atomic_load_n(&s->acquired, __ATOMIC_RELAXED);
+        r->contended = __atomic_load_n(&s->contended, __ATOMIC_RELAXED);
+        r->wait_ns = __atomic_load_n(&s->wait_ns, __ATOMIC_RELAXED);
+        r->wait_max = __atomic_load_n(&s->wait_max, __ATOMIC_RELAXED);
+        r->holds = __atomic_load_n(&s->holds, __ATOMIC_RELAXED);
+        r->hold_ns = __atomic_load_n(&s->hold_ns, __ATOMIC_RELAXED);
+        r->hold_max = __atomic_load_n(&s->hold_max, __ATOMIC_RELAXED);
+    }
+
+    memcpy(rows, sites, (size_t)n * sizeof(*rows));
+    int m = fold(rows, n, by_res);
+    for (int i = 0; i < m; i++) rows[i].op = NULL;
+    int rc = emit_rows("resource", rows, m, top, emit, arg);
+
+    memcpy(rows, sites, (size_t)n * sizeof(*rows));
+    m = fold(rows, n, by_op);
+    for (int i = 0; i < m; i++) rows[i].res = NULL;
+    if (rc == 0) rc = emit_rows("op", rows, m, top, emit, arg);
+
+    qsort(sites, (size_t)n, sizeof(*sites), by_wait);
+    if (rc == 0) emit_rows("site", sites, n, top, emit, arg);
+    free(sites);
+    free(rows);
+}
@@ -0,0 +1,33 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include "stats.h"
+
+/*
+ * Lock-contention profile. Every acquisition is counted against a
+ * (resource, sub-resource, mode, operation) site: how often it was taken,
+ * how often the wait exceeded LOCKPROF_CONTENDED_NS, and the total and
+ * worst wait and hold times. Sites live in a fixed open-addressed table
+ * updated with relaxed atomics, so recording takes no locks after a site's
+ * first use.
+ *
+ * Resource and operation names are keyed by pointer and must outlive the
+ * process: string literals and __func__. sub tells apart instances of one
+ * resource (an account stripe); pass -1 when there is only one.
+ */
+
+#define LOCKPROF_SLOTS        4096
+#define LOCKPROF_CONTENDED_NS 10000
+
+// Call with the lock held and the time spent waiting for it.
+void lockprof_acquired(const char *res, int sub, int excl, const char *op, unsigned long long wait_ns);
+// Call just before the lock is released by the thread that took it.
+void lockprof_released(const char *res, int sub);
+
+// Up to `top` lines in each section, ranked by total wait:
+//   resource <name>[#sub] acquired=.. contended=.. wait_total_us=.. wait_max_us=.. hold_avg_us=.. hold_max_us=..
+//   op <operation> ...
+//   site <name>[#sub] <shared|excl> <operation> ...
+void lockprof_report(int top, stats_emit_fn emit, void *arg);
+
+#endif
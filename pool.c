@@ -0,0 +1,120 @@
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pool.h"
+
+typedef struct {
+    pool_fn fn;
+    void *arg;
+    unsigned long long queued_ns;
+} pool_job;
+
+struct pool {
+    char name[32];
+    pthread_mutex_t mu;
+    pthread_cond_t work;
+    pool_job *ring;
+    size_t cap, head, len;
+    int stopping;
+    int nthreads;
+    pthread_t *threads;
+    pool_stats st;            /* threads, depth and capacity filled in on read */
+};
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static void *pool_worker(void *arg) {
+    pool *p = (pool *)arg;
+    pthread_mutex_lock(&p->mu);
+    for (;;) {
+        while (p->len == 0 && !p->stopping) pthread_cond_wait(&p->work, &p->mu);
+        if (p->len == 0) break;
+        pool_job j = p->ring[p->head];
+        p->head = (p->head + 1) % p->cap;
+        p->len--;
+        unsigned long long wait = now_ns() - j.queued_ns;
+        p->st.jobs++;
+        p->st.wait_ns_total += wait;
+        if (wait > p->st.wait_ns_max) p->st.wait_ns_max = wait;
+        pthread_mutex_unlock(&p->mu);
+        j.fn(j.arg);
+        pthread_mutex_lock(&p->mu);
+    }
+    pthread_mutex_unlock(&p->mu);
+    return NULL;
+}
+
+pool *pool_create(const char *name, int threads, size_t max_queue) {
+    if (threads < 1 || max_queue < 1) return NULL;
+    pool *p = (pool *)calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    snprintf(p->name, sizeof(p->name), "%s", name);
+    p->ring = (pool_job *)calloc(max_queue, sizeof(pool_job));
+    p->threads = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+    if (!p->ring || !p->threads) { free(p->ring); free(p->threads); free(p); return NULL; }
+    p->cap = max_queue;
+    pthread_mutex_init(&p->mu, NULL);
+    pthread_cond_init(&p->work, NULL);
+    for (; p->nthreads < threads; p->nthreads++)
+        if (pthread_create(&p->threads[p->nthreads], NULL, pool_worker, p) != 0) break;
+    if (p->nthreads == 0) { pool_destroy(p); return NULL; }
+    return p;
+}
+
+int pool_submit(pool *p, pool_fn fn, void *arg) {
+    unsigned long long t = now_ns();
+    pthread_mutex_lock(&p->mu);
+    int rc = -1;
+    if (!p->stopping && p->len < p->cap) {
+        p->ring[(p->head + p->len) % p->cap] = (pool_job){ fn, arg, t };
+        p->len++;
+        if (p->len > p->st.max_depth) p->st.max_depth = p->len;
+        pthread_cond_signal(&p->work);
+        rc = 0;
+    } else {
+        p->st.rejected++;
+    }
+    pthread_mutex_unlock(&p->mu);
+    return rc;
+}
+
+const char *pool_name(const pool *p) { return p->name; }
+
+unsigned long long pool_oldest_wait_ns(pool *p) {
+    pthread_mutex_lock(&p->mu);
+    unsigned long long queued = p->len ? p->ring[p->head].queued_ns : 0;
+    pthread_mutex_unlock(&p->mu);
+    return queued ? now_ns() - queued : 0;
+}
+
+void pool_get_stats(pool *p, pool_stats *out) {
+    pthread_mutex_lock(&p->mu);
+    *out = p->st;
+    out->threads = p->nthreads;
+    out->depth = p->len;
+    out->capacity = p->cap;
+    pthread_mutex_unlock(&p->mu);
+}
+
+void pool_destroy(pool *p) {
+    if (!p) return;
+    pthread_mutex_lock(&p->mu);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->mu);
+    for (int i = 0; i < p->nthreads; i++) pthread_join(p->threads[i], NULL);
+    pthread_mutex_destroy(&p->mu);
+    pthread_cond_destroy(&p->work);
+    free(p->threads);
+    free(p->ring);
+    free(p);
+}
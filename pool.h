@@ -0,0 +1,37 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * Fixed-size worker pool fed from a bounded FIFO queue. pool_submit never
+ * blocks: it fails when the queue is full, so a caller can turn overload
+ * into an immediate "busy" reply instead of an ever-growing backlog.
+ */
+
+typedef void (*pool_fn)(void *arg);
+typedef struct pool pool;
+
+// Counters since pool_create. Wait is the time a job spent queued before
+// a worker picked it up.
+typedef struct {
+    int threads;
+    size_t depth;             /* jobs queued right now */
+    size_t max_depth;
+    size_t capacity;
+    unsigned long long jobs;  /* jobs started */
+    unsigned long long rejected;
+    unsigned long long wait_ns_total;
+    unsigned long long wait_ns_max;
+} pool_stats;
+
+pool *pool_create(const char *name, int threads, size_t max_queue);
+int   pool_submit(pool *p, pool_fn fn, void *arg);
+const char *pool_name(const pool *p);
+// How long the oldest queued job has been waiting; 0 with an empty queue.
+unsigned long long pool_oldest_wait_ns(pool *p);
+void  pool_get_stats(pool *p, pool_stats *out);
+// Runs every job already queued, then joins the workers.
+void  pool_destroy(pool *p);
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Binary protocol mode.
+ *
+ * A client that sends the text line "BINARY" before logging in gets
+ * "BINARY_OK" back, and from then on both directions carry frames: a
+ * proto_hdr followed by hdr.len payload bytes. Request payloads are the
+ * fixed structs below; a reply echoes the request's op and tag and sets
+ * status. Integers are in host byte order (client and server are built
+ * from the same tree).
+ */
+
+#define PROTO_SWITCH_CMD "BINARY"
+#define PROTO_SWITCH_ACK "BINARY_OK"
+
+#define PROTO_MAX_REQUEST 1024   /* largest request payload the server accepts */
+#define PROTO_HISTORY_MAX 128    /* entries per history page */
+
+enum {
+    BOP_LOGIN = 1,        /* proto_login_req    -> proto_login_resp */
+    BOP_BALANCE,          /* (empty)            -> proto_balance_resp */
+    BOP_DEPOSIT,          /* proto_amount_req   -> proto_balance_resp */
+    BOP_WITHDRAW,         /* proto_amount_req   -> proto_balance_resp */
+    BOP_TRANSFER,         /* proto_transfer_req -> (empty) */
+    BOP_HISTORY,          /* proto_history_req  -> proto_history_resp + entries */
+    BOP_LOGOUT            /* (empty)            -> (empty), then close */
+};
+
+enum {
+    BST_OK = 0,
+    BST_FAILED,           /* the operation was refused or failed */
+    BST_BAD_REQUEST,      /* unknown op or wrong payload size */
+    BST_NOT_LOGGED_IN,
+    BST_FORBIDDEN         /* not available to the caller's role */
+};
+
+typedef struct {
+    uint32_t len;         /* payload bytes following the header */
+    uint16_t op;
+    uint16_t status;      /* BST_* in replies, 0 in requests */
+    uint32_t tag;         /* chosen by the client, echoed in the reply */
+} proto_hdr;
+
+typedef struct {
+    char username[USERNAME_MAX];
+    char password[PASSWORD_MAX];
+} proto_login_req;
+
+typedef struct {
+    int32_t user_id;
+    int32_t role;
+} proto_login_resp;
+
+typedef struct {
+    int64_t amount;
+} proto_amount_req;
+
+typedef struct {
+    int32_t account_number;
+    int32_t pad;
+    int64_t balance;
+} proto_balance_resp;
+
+typedef struct {
+    int32_t to_account;
+    int32_t pad;
+    int64_t amount;
+} proto_transfer_req;
+
+typedef struct {
+    int32_t account_number; /* 0 = the caller's own account */
+    int32_t limit;          /* clamped to PROTO_HISTORY_MAX */
+    int64_t cursor;         /* 0 for the first page */
+} proto_history_req;
+
+typedef struct {
+    int64_t ts;
+    int32_t account_number;
+    int32_t type;           /* txn_type */
+    int32_t peer;
+    int32_t pad;
+    int64_t amount;
+    int64_t balance;
+} proto_txn;
+
+typedef struct {
+    int32_t count;          /* proto_txn entries following this struct */
+    int32_t pad;
+    int64_t next_cursor;    /* -1 when there are no more pages */
+} proto_history_resp;
+
+#endif
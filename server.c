@@ -2,8 +2,12 @@
 #define _XOPEN_SOURCE 700
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -12,15 +16,37 @@
 #include <strings.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "db.h"
+#include "lockprof.h"
+#include "pool.h"
+#include "proto.h"
+#include "stats.h"
 
 #define BACKLOG 64
 #define MAX_LINE 1024
+#define CONN_INBUF 16384
+#define CONN_OUTBUF 16384       /* queued output that triggers a send */
+#define CONN_OUTBUF_MAX 262144  /* unsent output at which a connection's requests wait */
+#define CONN_SEND_TIMEOUT_MS 30000
+#define SEND_LINE_MAX 2048
+#define TAG_MAX 32
+#define HISTORY_PAGE_MAX 500
+#define AUTH_THREADS 2
+#define AUTH_QUEUE 256
+#define COMMAND_QUEUE 1024
+#define BULK_QUEUE 256
+#define BULK_PACE_LINES 32
+#define LATENCY_BUDGET_MS 20
+#define MAX_CONNS 4096
+#define STATS_FILE "stats.txt"
+#define LOCK_STATS_TOP 10
 
 static volatile sig_atomic_t g_running = 1;
 
@@ -29,47 +55,239 @@ static void on_sigint(int sig) {
     g_running = 0;
 }
 
-static void send_line(int fd, const char *fmt, ...) {
-    char buf[2048];
+typedef enum {
+    CONN_LOGIN,            /* waiting for LOGIN */
+    CONN_AUTHED            /* running the role's command set */
+} conn_state;
+
+typedef enum {
+    JOB_NONE,
+    JOB_COMMAND,           /* a request running on a command pool */
+    JOB_AUTH               /* a login being verified on the auth pool */
+} conn_job;
+
+struct reactor;
+
+// Per-connection state shared by all serving modes. The role handlers take
+// one line at a time, so the same code runs from a blocking per-client
+// thread, from an epoll reactor, or from a command pool worker.
+typedef struct conn {
+    int fd;
+    struct sockaddr_in addr;
+    conn_state state;
+    int binary;            /* switched to proto.h framing */
+    user_record user;
+    uint64_t session;      /* token from db_login */
+    // Both buffers are allocated on first use and freed again while the
+    // connection sits idle (conn_trim)
+    char *in;              /* received bytes not yet consumed, CONN_INBUF */
+    size_t in_start, in_len;
+    char *out;             /* reply bytes, out_sent of them already sent */
+    size_t out_sent, out_len, out_cap;
+    int out_err;           /* peer gone; further output is dropped */
+    char tag[TAG_MAX];     /* "#id" of the command being served, echoed on replies */
+    size_t tag_len;
+    int unknown_cmd;       /* the role handler did not recognise the command */
+    struct conn *prev, *next;  /* the owning reactor's list, or g_clients */
+    struct reactor *reactor;   /* owning reactor; NULL in thread-per-client mode */
+    conn_job job;          /* pool job in flight; the reactor leaves the conn alone */
+    int job_rc;            /* conn_run_next result of a command job */
+    unsigned watched;      /* events in the reactor's epoll set */
+    struct conn *done_next; /* reactor's finished-job list */
+    int bulk;              /* the job runs on the bulk pool (bulk_pace) */
+    unsigned paced;        /* lines streamed since the last bulk_pace check */
+    // Login staged by handle_login (conn_begin_login)
+    int auth_pending;
+    int auth_rc;
+    char auth_user[USERNAME_MAX];
+    char auth_pass[PASSWORD_MAX];
+    proto_hdr auth_hdr;    /* binary login request being answered */
+    pthread_mutex_t auth_mu;
+    pthread_cond_t auth_cv;
+} conn_t;
+
+// Command pools: with reactors, requests run here rather than on the I/O
+// threads. Short account operations go to the latency pool (--workers);
+// statement and feedback scans go to the bulk pool (--bulk-workers), so a
+// few long scans cannot occupy every worker (conn_classify). Credential
+// checks have their own auth pool (conn_begin_login).
+static pool *g_latency_pool;
+static pool *g_bulk_pool;
+static pool *g_auth_pool;
+static unsigned long long g_latency_budget_ns = LATENCY_BUDGET_MS * 1000000ULL;
+
+// Called while a bulk job streams lines. The pools share the disk and the
+// db locks, so once latency requests have queued for half the budget the
+// scan pauses (at most a budget's worth per check) to let them through.
+static void bulk_pace(conn_t *c) {
+    if (!c->bulk || ++c->paced % BULK_PACE_LINES) return;
+    struct timespec ms = { 0, 1000000 };
+    unsigned long long paused = 0;
+    while (paused < g_latency_budget_ns && pool_oldest_wait_ns(g_latency_pool) > g_latency_budget_ns / 2) {
+        nanosleep(&ms, NULL);
+        paused += 1000000;
+    }
+}
+
+static size_t conn_pending(const conn_t *c) { return c->out_len - c->out_sent; }
+
+// Over CONN_OUTBUF_MAX the peer is not keeping up: the reactor stops
+// running its requests until the backlog drains (reactor_write).
+static int conn_backlogged(const conn_t *c) { return conn_pending(c) > CONN_OUTBUF_MAX; }
+
+// Sends queued output. Reactor client sockets are non-blocking, so what the
+// peer will not take yet stays queued for EPOLLOUT; per-client threads
+// block here as before. Returns -1 once the peer is gone.
+static int conn_flush(conn_t *c) {
+    while (c->out_sent < c->out_len && !c->out_err) {
+        unsigned long long t = stats_now();
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        stats_since(STAT_SEND, t);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            c->out_err = 1;
+            break;
+        }
+        c->out_sent += (size_t)n;
+    }
+    c->out_sent = c->out_len = 0;
+    return c->out_err ? -1 : 0;
+}
+
+// Room for `need` more bytes at the end of the output, growing the buffer
+// as needed; NULL (and output dropped) once the peer is gone or memory is.
+static char *conn_reserve(conn_t *c, size_t need) {
+    if (c->out_err) return NULL;
+    if (c->out_cap - c->out_len < need && c->out_sent > 0) {
+        memmove(c->out, c->out + c->out_sent, conn_pending(c));
+        c->out_len -= c->out_sent;
+        c->out_sent = 0;
+    }
+    if (c->out_cap - c->out_len < need) {
+        size_t cap = c->out_cap ? c->out_cap : CONN_OUTBUF;
+        while (cap - c->out_len < need) cap *= 2;
+        char *p = (char *)realloc(c->out, cap);
+        if (!p) { c->out_err = 1; return NULL; }
+        c->out = p;
+        c->out_cap = cap;
+    }
+    return c->out + c->out_len;
+}
+
+// Called after output is queued: sends once a buffer's worth has built up.
+// A pool worker streaming past CONN_OUTBUF_MAX waits here for the peer, as
+// the connection is its own until the job ends; the reactor never does.
+// A peer that takes nothing for CONN_SEND_TIMEOUT_MS is given up on.
+static void conn_queued(conn_t *c) {
+    if (conn_pending(c) < CONN_OUTBUF) return;
+    conn_flush(c);
+    while (c->job == JOB_COMMAND && conn_backlogged(c) && !c->out_err) {
+        struct pollfd pfd = { c->fd, POLLOUT, 0 };
+        unsigned long long t = stats_now();
+        int n = poll(&pfd, 1, CONN_SEND_TIMEOUT_MS);
+        stats_since(STAT_SEND, t);
+        if (n == 0 || (n < 0 && errno != EINTR)) c->out_err = 1;
+        else conn_flush(c);
+    }
+}
+
+static void conn_write(conn_t *c, const char *data, size_t len) {
+    char *p = conn_reserve(c, len);
+    if (!p) return;
+    memcpy(p, data, len);
+    c->out_len += len;
+    conn_queued(c);
+}
+
+// Frees the buffers of a connection with nothing buffered either way.
+static void conn_trim(conn_t *c) {
+    if (c->in && c->in_len == 0) { free(c->in); c->in = NULL; }
+    if (c->out && c->out_len == 0) { free(c->out); c->out = NULL; c->out_cap = 0; }
+}
+
+// db_emit_fn for history/feedback streams: lines pile up in the output
+// buffer and go out a buffer's worth at a time.
+static int conn_emit(void *arg, const char *data, size_t len) {
+    conn_t *c = (conn_t *)arg;
+    bulk_pace(c);
+    if (c->tag_len) conn_write(c, c->tag, c->tag_len);
+    conn_write(c, data, len);
+    return c->out_err ? -1 : 0;
+}
+
+// Formats straight into the output buffer; nothing is sent until the
+// command finishes (conn_flush) or a buffer's worth has queued up.
+static void send_line(conn_t *c, const char *fmt, ...) {
+    char *p = conn_reserve(c, TAG_MAX + SEND_LINE_MAX + 1);
+    if (!p) return;
+    memcpy(p, c->tag, c->tag_len);
     va_list ap;
     va_start(ap, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, ap);
+    int n = vsnprintf(p + c->tag_len, SEND_LINE_MAX, fmt, ap);
     va_end(ap);
-    strncat(buf, "\n", sizeof(buf) - strlen(buf) - 1);
-    send(fd, buf, strlen(buf), 0);
+    if (n < 0) return;
+    if (n >= SEND_LINE_MAX) n = SEND_LINE_MAX - 1;
+    p[c->tag_len + (size_t)n] = '\n';
+    c->out_len += c->tag_len + (size_t)n + 1;
+    conn_queued(c);
 }
 
-static void send_plain_menu(int fd, const char *title, const char *items[], int count) {
-    send_line(fd, "MENU %s", title ? title : "Menu");
+static void send_plain_menu(conn_t *c, const char *title, const char *items[], int count) {
+    send_line(c, "MENU %s", title ? title : "Menu");
     for (int i = 0; i < count; i++) {
-        send_line(fd, "%s", items[i] ? items[i] : "");
+        send_line(c, "%s", items[i] ? items[i] : "");
     }
 }
 
 
-static int recv_line(int fd, char *out, size_t cap) {
-    size_t pos = 0;
-    while (pos + 1 < cap) {
-        char c;
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n == 0) return 0;
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        if (c == '\n') break;
-        out[pos++] = c;
+// Pulls one complete line out of the input buffer. Lines longer than the
+// caller's buffer are handed over in pieces, as the old byte reader did.
+static int conn_take_line(conn_t *c, char *out, size_t cap) {
+    size_t avail = c->in_len - c->in_start;
+    if (avail == 0) return 0;
+    const char *p = c->in + c->in_start;
+    const char *nl = memchr(p, '\n', avail);
+    size_t len, used;
+    if (nl) {
+        len = used = (size_t)(nl - p);
+        used++;
+        if (len > cap - 1) len = used = cap - 1;
+    } else if (avail >= cap - 1) {
+        len = used = cap - 1;
+    } else {
+        return 0;
     }
-    out[pos] = '\0';
+    memcpy(out, p, len);
+    out[len] = '\0';
+    c->in_start += used;
+    if (c->in_start == c->in_len) c->in_start = c->in_len = 0;
     return 1;
 }
 
-typedef struct {
-    int fd;
-    struct sockaddr_in addr;
-} client_ctx_t;
+// One recv() into the free tail of the buffer. Returns bytes read, 0 on EOF,
+// -1 on error (errno set, EAGAIN included).
+static ssize_t conn_fill(conn_t *c, int flags) {
+    if (!c->in && !(c->in = (char *)malloc(CONN_INBUF))) { errno = ENOMEM; return -1; }
+    if (c->in_start > 0 && c->in_len == CONN_INBUF) {
+        memmove(c->in, c->in + c->in_start, c->in_len - c->in_start);
+        c->in_len -= c->in_start;
+        c->in_start = 0;
+    }
+    for (;;) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, CONN_INBUF - c->in_len, flags);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) c->in_len += (size_t)n;
+        return n;
+    }
+}
+
+// Usernames are parsed with one character to spare (%64s), so one too long
+// for the stored field is refused instead of being cut short and its tail
+// read as the next argument.
+static int username_fits(const char *name) { return strlen(name) < USERNAME_MAX; }
 
-static void show_customer_menu(int fd) {
+static void show_customer_menu(conn_t *c) {
     const char *items[] = {
         "1) VIEW_BALANCE",
         "2) DEPOSIT <amount>",
@@ -77,25 +295,27 @@ static void show_customer_menu(int fd) {
         "4) TRANSFER <to_acct_no> <amount>",
         "5) APPLY_LOAN <amount>",
         "6) CHANGE_PASSWORD <new_password>",
-        "7) HISTORY",
-        "8) FEEDBACK <text>",
-        "9) LOGOUT"
+        "7) HISTORY [limit] [cursor]",
+        "8) HISTORY_RANGE <from_ts> <to_ts> [limit] [cursor]",
+        "9) FEEDBACK <text>",
+        "10) LOGOUT"
     };
-    send_plain_menu(fd, "Customer Menu", items, (int)(sizeof(items) / sizeof(items[0])));
+    send_plain_menu(c, "Customer Menu", items, (int)(sizeof(items) / sizeof(items[0])));
 }
 
-static void show_employee_menu(int fd) {
+static void show_employee_menu(conn_t *c) {
     const char *items[] = {
         "1) ADD_CUSTOMER <username> <password> <initial_balance>",
-        "2) VIEW_TXNS <acct_no>",
-        "3) APPROVE_LOAN <loan_id> | REJECT_LOAN <loan_id>",
-        "4) CHANGE_PASSWORD <new_password>",
-        "5) LOGOUT"
+        "2) VIEW_TXNS <acct_no> [limit] [cursor]",
+        "3) VIEW_TXNS_RANGE <acct_no> <from_ts> <to_ts> [limit] [cursor]",
+        "4) APPROVE_LOAN <loan_id> | REJECT_LOAN <loan_id>",
+        "5) CHANGE_PASSWORD <new_password>",
+        "6) LOGOUT"
     };
-    send_plain_menu(fd, "Employee Menu", items, (int)(sizeof(items) / sizeof(items[0])));
+    send_plain_menu(c, "Employee Menu", items, (int)(sizeof(items) / sizeof(items[0])));
 }
 
-static void show_manager_menu(int fd) {
+static void show_manager_menu(conn_t *c) {
     const char *items[] = {
         "1) ACTIVATE <acct_no>",
         "2) DEACTIVATE <acct_no>",
@@ -104,321 +324,1084 @@ static void show_manager_menu(int fd) {
         "5) CHANGE_PASSWORD <new_password>",
         "6) LOGOUT"
     };
-    send_plain_menu(fd, "Manager Menu", items, (int)(sizeof(items) / sizeof(items[0])));
+    send_plain_menu(c, "Manager Menu", items, (int)(sizeof(items) / sizeof(items[0])));
 }
 
-static void show_admin_menu(int fd) {
+static void show_admin_menu(conn_t *c) {
     const char *items[] = {
         "1) ADD_EMPLOYEE <username> <password>",
         "2) SET_ROLE <username> <role_int>",
         "3) CHANGE_PASSWORD <new_password>",
-        "4) LOGOUT"
+        "4) POOL_STATS",
+        "5) STATS",
+        "6) LOCK_STATS [top]",
+        "7) LOGOUT"
     };
-    send_plain_menu(fd, "Admin Menu", items, (int)(sizeof(items) / sizeof(items[0])));
+    send_plain_menu(c, "Admin Menu", items, (int)(sizeof(items) / sizeof(items[0])));
 }
 
 
-static void handle_customer(int fd, user_record *u) {
-    show_customer_menu(fd);
-    char line[MAX_LINE];
+// One page of an account's history. The closing HISTORY_END carries
+// "NEXT <cursor>" while more entries remain; the client sends the cursor
+// back to continue. Callers reject limits below 1; larger ones than a page
+// are capped.
+static void send_history_page(conn_t *c, int acct_no, long long from_ts, long long to_ts,
+                              long long cursor, int limit) {
+    txn_entry ents[HISTORY_PAGE_MAX];
+    if (limit > HISTORY_PAGE_MAX) limit = HISTORY_PAGE_MAX;
+    int n;
+    long long next;
+    if (db_history_range(acct_no, from_ts, to_ts, cursor, limit, ents, &n, &next) != 0) {
+        send_line(c, "ERR History read failed");
+        return;
+    }
+    char buf[512];
+    for (int i = 0; i < n; i++) {
+        db_format_txn(&ents[i], buf, sizeof(buf));
+        bulk_pace(c);
+        send_line(c, "%s", buf);
+    }
+    if (next >= 0) send_line(c, "HISTORY_END NEXT %lld", next);
+    else send_line(c, "HISTORY_END");
+}
 
-    for (;;) {
-        send_line(fd, "OK Awaiting command");
-        int rr = recv_line(fd, line, sizeof(line));
-        if (rr <= 0) break;
-
-        char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
-        sscanf(line, "%1023s", cmd);
-
-        if (!strcasecmp(cmd, "VIEW_BALANCE")) {
-            long long bal; int acct_no = -1;
-            if (db_get_account_number(u->id, &acct_no) == 0 && db_get_balance(u->id, &bal) == 0)
-                send_line(fd, "BALANCE acct=%d %lld", acct_no, bal);
-            else
-                send_line(fd, "ERR Could not read balance");
-        } else if (!strcasecmp(cmd, "DEPOSIT")) {
-            long long amt;
-            if (sscanf(line, "%*s %lld", &amt) != 1 || amt <= 0) { send_line(fd, "ERR Invalid amount"); continue; }
-            long long nb; int acct_no = -1; db_get_account_number(u->id, &acct_no);
-            int rc = db_deposit(u->id, amt, &nb);
-            if (rc == 0) send_line(fd, "DEPOSITED acct=%d %lld NEW_BAL %lld", acct_no, amt, nb);
-            else send_line(fd, "ERR Deposit failed");
-        } else if (!strcasecmp(cmd, "WITHDRAW")) {
-            long long amt;
-            if (sscanf(line, "%*s %lld", &amt) != 1 || amt <= 0) { send_line(fd, "ERR Invalid amount"); continue; }
-            long long nb; int acct_no = -1; db_get_account_number(u->id, &acct_no);
-            int rc = db_withdraw(u->id, amt, &nb);
-            if (rc == 0) send_line(fd, "WITHDREW acct=%d %lld NEW_BAL %lld", acct_no, amt, nb);
-            else send_line(fd, "ERR Withdraw failed");
-        } else if (!strcasecmp(cmd, "TRANSFER")) {
-            int to_acct; long long amt;
-            if (sscanf(line, "%*s %d %lld", &to_acct, &amt) != 2 || amt <= 0) {
-                send_line(fd, "ERR Usage: TRANSFER <to_acct_no> <amount>");
-                continue;
-            }
-            int rc = db_transfer_to_account(u->id, to_acct, amt);
-            if (rc == 0) send_line(fd, "TRANSFER OK to acct=%d %lld", to_acct, amt);
-            else send_line(fd, "ERR Transfer failed");
-        } else if (!strcasecmp(cmd, "APPLY_LOAN")) {
-            long long amt;
-            if (sscanf(line, "%*s %lld", &amt) != 1 || amt <= 0) { send_line(fd, "ERR Invalid amount"); continue; }
-            int loan_id;
-            int rc = db_apply_loan(u->id, amt, &loan_id);
-            if (rc == 0) send_line(fd, "LOAN_APPLIED %d AMOUNT %lld", loan_id, amt);
-            else send_line(fd, "ERR Loan application failed");
-        } else if (!strcasecmp(cmd, "CHANGE_PASSWORD")) {
-            char npw[PASSWORD_MAX];
-            if (sscanf(line, "%*s %127s", npw) != 1) { send_line(fd, "ERR Usage: CHANGE_PASSWORD <new_password>"); continue; }
-            int rc = db_change_password(u->id, npw);
-            if (rc == 0) send_line(fd, "PASSWORD_CHANGED");
-            else send_line(fd, "ERR Change password failed");
-        } else if (!strcasecmp(cmd, "HISTORY")) {
-            int rc = db_send_history(fd, u->id);
-            if (rc == 0) send_line(fd, "HISTORY_END");
-            else send_line(fd, "ERR History read failed");
-        } else if (!strcasecmp(cmd, "FEEDBACK")) {
-            const char *p = strchr(line, ' ');
-            if (!p || !*(p + 1)) { send_line(fd, "ERR Provide feedback text"); continue; }
-            int rc = db_append_feedback(u->id, p + 1);
-            if (rc == 0) send_line(fd, "FEEDBACK_OK");
-            else send_line(fd, "ERR Feedback failed");
-        } else if (!strcasecmp(cmd, "LOGOUT")) {
-            send_line(fd, "BYE");
-            break;
-        } else {
-            send_line(fd, "ERR Unknown command");
+static int handle_customer(conn_t *c, const char *line) {
+    user_record *u = &c->user;
+    char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
+    sscanf(line, "%1023s", cmd);
+
+    if (!strcasecmp(cmd, "VIEW_BALANCE")) {
+        long long bal; int acct_no = -1;
+        if (db_get_account_number(u->id, &acct_no) == 0 && db_get_balance(u->id, &bal) == 0)
+            send_line(c, "BALANCE acct=%d %lld", acct_no, bal);
+        else
+            send_line(c, "ERR Could not read balance");
+    } else if (!strcasecmp(cmd, "DEPOSIT")) {
+        long long amt;
+        if (sscanf(line, "%*s %lld", &amt) != 1 || amt <= 0) { send_line(c, "ERR Invalid amount"); return 0; }
+        long long nb; int acct_no = -1; db_get_account_number(u->id, &acct_no);
+        int rc = db_deposit(u->id, amt, &nb);
+        if (rc == 0) send_line(c, "DEPOSITED acct=%d %lld NEW_BAL %lld", acct_no, amt, nb);
+        else send_line(c, "ERR Deposit failed");
+    } else if (!strcasecmp(cmd, "WITHDRAW")) {
+        long long amt;
+        if (sscanf(line, "%*s %lld", &amt) != 1 || amt <= 0) { send_line(c, "ERR Invalid amount"); return 0; }
+        long long nb; int acct_no = -1; db_get_account_number(u->id, &acct_no);
+        int rc = db_withdraw(u->id, amt, &nb);
+        if (rc == 0) send_line(c, "WITHDREW acct=%d %lld NEW_BAL %lld", acct_no, amt, nb);
+        else send_line(c, "ERR Withdraw failed");
+    } else if (!strcasecmp(cmd, "TRANSFER")) {
+        int to_acct; long long amt;
+        if (sscanf(line, "%*s %d %lld", &to_acct, &amt) != 2 || amt <= 0) {
+            send_line(c, "ERR Usage: TRANSFER <to_acct_no> <amount>");
+            return 0;
+        }
+        int rc = db_transfer_to_account(u->id, to_acct, amt);
+        if (rc == 0) send_line(c, "TRANSFER OK to acct=%d %lld", to_acct, amt);
+        else send_line(c, "ERR Transfer failed");
+    } else if (!strcasecmp(cmd, "APPLY_LOAN")) {
+        long long amt;
+        if (sscanf(line, "%*s %lld", &amt) != 1 || amt <= 0) { send_line(c, "ERR Invalid amount"); return 0; }
+        int loan_id;
+        int rc = db_apply_loan(u->id, amt, &loan_id);
+        if (rc == 0) send_line(c, "LOAN_APPLIED %d AMOUNT %lld", loan_id, amt);
+        else send_line(c, "ERR Loan application failed");
+    } else if (!strcasecmp(cmd, "CHANGE_PASSWORD")) {
+        char npw[PASSWORD_MAX];
+        if (sscanf(line, "%*s %127s", npw) != 1) { send_line(c, "ERR Usage: CHANGE_PASSWORD <new_password>"); return 0; }
+        int rc = db_change_password(u->id, npw);
+        if (rc == 0) send_line(c, "PASSWORD_CHANGED");
+        else send_line(c, "ERR Change password failed");
+    } else if (!strcasecmp(cmd, "HISTORY")) {
+        int limit; long long cursor = 0;
+        int k = sscanf(line, "%*s %d %lld", &limit, &cursor);
+        if (k >= 1) {
+            int acct_no;
+            if (limit <= 0 || cursor < 0) { send_line(c, "ERR Usage: HISTORY [limit] [cursor]"); return 0; }
+            if (db_get_account_number(u->id, &acct_no) != 0) { send_line(c, "ERR History read failed"); return 0; }
+            send_history_page(c, acct_no, LLONG_MIN, LLONG_MAX, cursor, limit);
+            return 0;
+        }
+        int rc = db_send_history(conn_emit, c, u->id);
+        if (rc == 0) send_line(c, "HISTORY_END");
+        else send_line(c, "ERR History read failed");
+    } else if (!strcasecmp(cmd, "HISTORY_RANGE")) {
+        long long from, to, cursor = -1; int limit = HISTORY_PAGE_MAX, acct_no;
+        int k = sscanf(line, "%*s %lld %lld %d %lld", &from, &to, &limit, &cursor);
+        if (k < 2 || from > to || (k >= 3 && limit <= 0) || (k == 4 && cursor < 0)) {
+            send_line(c, "ERR Usage: HISTORY_RANGE <from_ts> <to_ts> [limit] [cursor]");
+            return 0;
         }
+        if (db_get_account_number(u->id, &acct_no) != 0) { send_line(c, "ERR History read failed"); return 0; }
+        send_history_page(c, acct_no, from, to, cursor, limit);
+    } else if (!strcasecmp(cmd, "FEEDBACK")) {
+        const char *p = strchr(line, ' ');
+        if (!p || !*(p + 1)) { send_line(c, "ERR Provide feedback text"); return 0; }
+        int rc = db_append_feedback(u->id, p + 1);
+        if (rc == 0) send_line(c, "FEEDBACK_OK");
+        else send_line(c, "ERR Feedback failed");
+    } else if (!strcasecmp(cmd, "LOGOUT")) {
+        send_line(c, "BYE");
+        return -1;
+    } else {
+        send_line(c, "ERR Unknown command");
+        c->unknown_cmd = 1;
     }
+    return 0;
 }
 
-static void handle_employee(int fd, user_record *u) {
-    (void)u;
-    show_employee_menu(fd);
-    char line[MAX_LINE];
 
-    for (;;) {
-        send_line(fd, "OK Awaiting command");
-        int rr = recv_line(fd, line, sizeof(line));
-        if (rr <= 0) break;
-
-        char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
-        sscanf(line, "%1023s", cmd);
-
-        if (!strcasecmp(cmd, "ADD_CUSTOMER")) {
-            char uname[USERNAME_MAX], pw[PASSWORD_MAX]; long long initb;
-            if (sscanf(line, "%*s %63s %127s %lld", uname, pw, &initb) != 3 || initb < 0) {
-                send_line(fd, "ERR Usage: ADD_CUSTOMER <username> <password> <initial_balance>");
-                continue;
-            }
-            int uid, acct_no;
-            int rc = db_add_user_with_account(uname, pw, ROLE_CUSTOMER, 1, initb, &uid, &acct_no);
-            if (rc == 0) send_line(fd, "CUSTOMER_ADDED %s ID %d ACCT %d", uname, uid, acct_no);
-            else send_line(fd, "ERR Add customer failed");
-        } else if (!strcasecmp(cmd, "VIEW_TXNS")) {
-            int acct_no;
-            if (sscanf(line, "%*s %d", &acct_no) != 1) { send_line(fd, "ERR Usage: VIEW_TXNS <acct_no>"); continue; }
-            int rc = db_send_history_by_account(fd, acct_no);
-            if (rc == 0) send_line(fd, "HISTORY_END");
-            else send_line(fd, "ERR History failed");
-        } else if (!strcasecmp(cmd, "APPROVE_LOAN")) {
-            int id;
-            if (sscanf(line, "%*s %d", &id) != 1) { send_line(fd, "ERR Usage: APPROVE_LOAN <loan_id>"); continue; }
-            int rc = db_set_loan_status_owned(id, u->id, LOAN_APPROVED);
-            if (rc == 0) send_line(fd, "LOAN_APPROVED %d", id);
-            else if (rc == -3) send_line(fd, "ERR Not assigned to you");
-            else if (rc == -4) send_line(fd, "ERR Loan not found");
-            else if (rc == -5) send_line(fd, "ERR Invalid state");
-            else send_line(fd, "ERR Approve failed");
-        } else if (!strcasecmp(cmd, "REJECT_LOAN")) {
-            int id;
-            if (sscanf(line, "%*s %d", &id) != 1) { send_line(fd, "ERR Usage: REJECT_LOAN <loan_id>"); continue; }
-            int rc = db_set_loan_status_owned(id, u->id, LOAN_REJECTED);
-            if (rc == 0) send_line(fd, "LOAN_REJECTED %d", id);
-            else if (rc == -3) send_line(fd, "ERR Not assigned to you");
-            else if (rc == -4) send_line(fd, "ERR Loan not found");
-            else if (rc == -5) send_line(fd, "ERR Invalid state");
-            else send_line(fd, "ERR Reject failed");
-        } else if (!strcasecmp(cmd, "CHANGE_PASSWORD")) {
-            char npw[PASSWORD_MAX];
-            if (sscanf(line, "%*s %127s", npw) != 1) { send_line(fd, "ERR Usage: CHANGE_PASSWORD <new_password>"); continue; }
-            int rc = db_change_password(u->id, npw);
-            if (rc == 0) send_line(fd, "PASSWORD_CHANGED");
-            else send_line(fd, "ERR Change password failed");
-        } else if (!strcasecmp(cmd, "LOGOUT")) {
-            send_line(fd, "BYE");
-            break;
-        } else {
-            send_line(fd, "ERR Unknown command");
+static int handle_employee(conn_t *c, const char *line) {
+    user_record *u = &c->user;
+    char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
+    sscanf(line, "%1023s", cmd);
+
+    if (!strcasecmp(cmd, "ADD_CUSTOMER")) {
+        char uname[USERNAME_MAX + 1], pw[PASSWORD_MAX]; long long initb;
+        if (sscanf(line, "%*s %64s %127s %lld", uname, pw, &initb) != 3 || !username_fits(uname) || initb < 0) {
+            send_line(c, "ERR Usage: ADD_CUSTOMER <username> <password> <initial_balance>");
+            return 0;
+        }
+        int uid, acct_no;
+        int rc = db_add_user_with_account(uname, pw, ROLE_CUSTOMER, 1, initb, &uid, &acct_no);
+        if (rc == 0) send_line(c, "CUSTOMER_ADDED %s ID %d ACCT %d", uname, uid, acct_no);
+        else send_line(c, "ERR Add customer failed");
+    } else if (!strcasecmp(cmd, "VIEW_TXNS")) {
+        int acct_no, limit; long long cursor = 0;
+        int k = sscanf(line, "%*s %d %d %lld", &acct_no, &limit, &cursor);
+        if (k < 1 || (k >= 2 && limit <= 0) || cursor < 0) {
+            send_line(c, "ERR Usage: VIEW_TXNS <acct_no> [limit] [cursor]");
+            return 0;
         }
+        if (k >= 2) { send_history_page(c, acct_no, LLONG_MIN, LLONG_MAX, cursor, limit); return 0; }
+        int rc = db_send_history_by_account(conn_emit, c, acct_no);
+        if (rc == 0) send_line(c, "HISTORY_END");
+        else send_line(c, "ERR History failed");
+    } else if (!strcasecmp(cmd, "VIEW_TXNS_RANGE")) {
+        int acct_no, limit = HISTORY_PAGE_MAX; long long from, to, cursor = -1;
+        int k = sscanf(line, "%*s %d %lld %lld %d %lld", &acct_no, &from, &to, &limit, &cursor);
+        if (k < 3 || from > to || (k >= 4 && limit <= 0) || (k == 5 && cursor < 0)) {
+            send_line(c, "ERR Usage: VIEW_TXNS_RANGE <acct_no> <from_ts> <to_ts> [limit] [cursor]");
+            return 0;
+        }
+        send_history_page(c, acct_no, from, to, cursor, limit);
+    } else if (!strcasecmp(cmd, "APPROVE_LOAN")) {
+        int id;
+        if (sscanf(line, "%*s %d", &id) != 1) { send_line(c, "ERR Usage: APPROVE_LOAN <loan_id>"); return 0; }
+        int rc = db_set_loan_status_owned(id, u->id, LOAN_APPROVED);
+        if (rc == 0) send_line(c, "LOAN_APPROVED %d", id);
+        else if (rc == -3) send_line(c, "ERR Not assigned to you");
+        else if (rc == -4) send_line(c, "ERR Loan not found");
+        else if (rc == -5) send_line(c, "ERR Invalid state");
+        else send_line(c, "ERR Approve failed");
+    } else if (!strcasecmp(cmd, "REJECT_LOAN")) {
+        int id;
+        if (sscanf(line, "%*s %d", &id) != 1) { send_line(c, "ERR Usage: REJECT_LOAN <loan_id>"); return 0; }
+        int rc = db_set_loan_status_owned(id, u->id, LOAN_REJECTED);
+        if (rc == 0) send_line(c, "LOAN_REJECTED %d", id);
+        else if (rc == -3) send_line(c, "ERR Not assigned to you");
+        else if (rc == -4) send_line(c, "ERR Loan not found");
+        else if (rc == -5) send_line(c, "ERR Invalid state");
+        else send_line(c, "ERR Reject failed");
+    } else if (!strcasecmp(cmd, "CHANGE_PASSWORD")) {
+        char npw[PASSWORD_MAX];
+        if (sscanf(line, "%*s %127s", npw) != 1) { send_line(c, "ERR Usage: CHANGE_PASSWORD <new_password>"); return 0; }
+        int rc = db_change_password(u->id, npw);
+        if (rc == 0) send_line(c, "PASSWORD_CHANGED");
+        else send_line(c, "ERR Change password failed");
+    } else if (!strcasecmp(cmd, "LOGOUT")) {
+        send_line(c, "BYE");
+        return -1;
+    } else {
+        send_line(c, "ERR Unknown command");
+        c->unknown_cmd = 1;
     }
+    return 0;
 }
 
-static void handle_manager(int fd, user_record *u) {
-    (void)u;
-    show_manager_menu(fd);
-    char line[MAX_LINE];
 
-    for (;;) {
-        send_line(fd, "OK Awaiting command");
-        int rr = recv_line(fd, line, sizeof(line));
-        if (rr <= 0) break;
+static int handle_manager(conn_t *c, const char *line) {
+    user_record *u = &c->user;
+    char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
+    sscanf(line, "%1023s", cmd);
 
-        char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
-        sscanf(line, "%1023s", cmd);
+    if (!strcasecmp(cmd, "ACTIVATE")) {
+        int acct_no;
+        if (sscanf(line, "%*s %d", &acct_no) != 1) { send_line(c, "ERR Usage: ACTIVATE <acct_no>"); return 0; }
+        int uid;
+        if (db_get_user_id_by_account_number(acct_no, &uid) != 0) { send_line(c, "ERR Account not found"); return 0; }
+        int rc = db_set_user_active_by_id(uid, 1);
+        if (rc == 0) send_line(c, "ACTIVATED acct=%d uid=%d", acct_no, uid);
+        else send_line(c, "ERR Activate failed");
+    } else if (!strcasecmp(cmd, "DEACTIVATE")) {
+        int acct_no;
+        if (sscanf(line, "%*s %d", &acct_no) != 1) { send_line(c, "ERR Usage: DEACTIVATE <acct_no>"); return 0; }
+        int uid;
+        if (db_get_user_id_by_account_number(acct_no, &uid) != 0) { send_line(c, "ERR Account not found"); return 0; }
+        int rc = db_set_user_active_by_id(uid, 0);
+        if (rc == 0) send_line(c, "DEACTIVATED acct=%d uid=%d", acct_no, uid);
+        else send_line(c, "ERR Deactivate failed");
+    } else if (!strcasecmp(cmd, "REVIEW_FEEDBACK")) {
+        int rc = db_send_feedback(conn_emit, c);
+        if (rc == 0) send_line(c, "FEEDBACK_END");
+        else send_line(c, "ERR Feedback read failed");
+    } else if (!strcasecmp(cmd, "ASSIGN_LOAN")) {
+        int id; int emp_id;
+        if (sscanf(line, "%*s %d %d", &id, &emp_id) != 2) { send_line(c, "ERR Usage: ASSIGN_LOAN <loan_id> <employee_user_id>"); return 0; }
+        int rc = db_assign_loan_by_employee_id(id, emp_id);
+        if (rc == 0) send_line(c, "LOAN_ASSIGNED %d emp_id=%d", id, emp_id);
+        else if (rc == -2) send_line(c, "ERR Loan already assigned");
+        else if (rc == -4) send_line(c, "ERR Loan not found");
+        else send_line(c, "ERR Assign loan failed");
+    } else if (!strcasecmp(cmd, "CHANGE_PASSWORD")) {
+        char npw[PASSWORD_MAX];
+        if (sscanf(line, "%*s %127s", npw) != 1) { send_line(c, "ERR Usage: CHANGE_PASSWORD <new_password>"); return 0; }
+        int rc = db_change_password(u->id, npw);
+        if (rc == 0) send_line(c, "PASSWORD_CHANGED");
+        else send_line(c, "ERR Change password failed");
+    } else if (!strcasecmp(cmd, "LOGOUT")) {
+        send_line(c, "BYE");
+        return -1;
+    } else {
+        send_line(c, "ERR Unknown command");
+        c->unknown_cmd = 1;
+    }
+    return 0;
+}
 
-        if (!strcasecmp(cmd, "ACTIVATE")) {
-            int acct_no;
-            if (sscanf(line, "%*s %d", &acct_no) != 1) { send_line(fd, "ERR Usage: ACTIVATE <acct_no>"); continue; }
-            int uid;
-            if (db_get_user_id_by_account_number(acct_no, &uid) != 0) { send_line(fd, "ERR Account not found"); continue; }
-            int rc = db_set_user_active_by_id(uid, 1);
-            if (rc == 0) send_line(fd, "ACTIVATED acct=%d uid=%d", acct_no, uid);
-            else send_line(fd, "ERR Activate failed");
-        } else if (!strcasecmp(cmd, "DEACTIVATE")) {
-            int acct_no;
-            if (sscanf(line, "%*s %d", &acct_no) != 1) { send_line(fd, "ERR Usage: DEACTIVATE <acct_no>"); continue; }
-            int uid;
-            if (db_get_user_id_by_account_number(acct_no, &uid) != 0) { send_line(fd, "ERR Account not found"); continue; }
-            int rc = db_set_user_active_by_id(uid, 0);
-            if (rc == 0) send_line(fd, "DEACTIVATED acct=%d uid=%d", acct_no, uid);
-            else send_line(fd, "ERR Deactivate failed");
-        } else if (!strcasecmp(cmd, "REVIEW_FEEDBACK")) {
-            int rc = db_send_feedback(fd);
-            if (rc == 0) send_line(fd, "FEEDBACK_END");
-            else send_line(fd, "ERR Feedback read failed");
-        } else if (!strcasecmp(cmd, "ASSIGN_LOAN")) {
-            int id; int emp_id;
-            if (sscanf(line, "%*s %d %d", &id, &emp_id) != 2) { send_line(fd, "ERR Usage: ASSIGN_LOAN <loan_id> <employee_user_id>"); continue; }
-            int rc = db_assign_loan_by_employee_id(id, emp_id);
-            if (rc == 0) send_line(fd, "LOAN_ASSIGNED %d emp_id=%d", id, emp_id);
-            else if (rc == -2) send_line(fd, "ERR Loan already assigned");
-            else if (rc == -4) send_line(fd, "ERR Loan not found");
-            else send_line(fd, "ERR Assign loan failed");
-        } else if (!strcasecmp(cmd, "CHANGE_PASSWORD")) {
-            char npw[PASSWORD_MAX];
-            if (sscanf(line, "%*s %127s", npw) != 1) { send_line(fd, "ERR Usage: CHANGE_PASSWORD <new_password>"); continue; }
-            int rc = db_change_password(u->id, npw);
-            if (rc == 0) send_line(fd, "PASSWORD_CHANGED");
-            else send_line(fd, "ERR Change password failed");
-        } else if (!strcasecmp(cmd, "LOGOUT")) {
-            send_line(fd, "BYE");
-            break;
-        } else {
-            send_line(fd, "ERR Unknown command");
+
+// stats_emit_fn for STATS and LOCK_STATS
+static int send_stat(void *arg, const char *line) {
+    conn_t *c = (conn_t *)arg;
+    send_line(c, "STAT %s", line);
+    return c->out_err ? -1 : 0;
+}
+
+static int send_lock_stat(void *arg, const char *line) {
+    conn_t *c = (conn_t *)arg;
+    send_line(c, "LOCK %s", line);
+    return c->out_err ? -1 : 0;
+}
+
+static int handle_admin(conn_t *c, const char *line) {
+    user_record *u = &c->user;
+    char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
+    sscanf(line, "%1023s", cmd);
+
+    if (!strcasecmp(cmd, "ADD_EMPLOYEE")) {
+        char uname[USERNAME_MAX + 1], pw[PASSWORD_MAX];
+        if (sscanf(line, "%*s %64s %127s", uname, pw) != 2 || !username_fits(uname)) {
+            send_line(c, "ERR Usage: ADD_EMPLOYEE <username> <password>");
+            return 0;
+        }
+        int uid, acct_no;
+        int rc = db_add_user_with_account(uname, pw, ROLE_EMPLOYEE, 1, 0, &uid, &acct_no);
+        if (rc == 0) send_line(c, "EMPLOYEE_ADDED %s ID %d", uname, uid);
+        else send_line(c, "ERR Add employee failed");
+    } else if (!strcasecmp(cmd, "SET_ROLE")) {
+        char uname[USERNAME_MAX + 1]; int role;
+        if (sscanf(line, "%*s %64s %d", uname, &role) != 2 || !username_fits(uname) || role < ROLE_CUSTOMER || role > ROLE_ADMIN) {
+            send_line(c, "ERR Usage: SET_ROLE <username> <role_int>");
+            return 0;
         }
+        int rc = db_set_user_role(uname, role);
+        if (rc == 0) send_line(c, "ROLE_SET %s %d", uname, role);
+        else send_line(c, "ERR Set role failed");
+    } else if (!strcasecmp(cmd, "CHANGE_PASSWORD")) {
+        char npw[PASSWORD_MAX];
+        if (sscanf(line, "%*s %127s", npw) != 1) { send_line(c, "ERR Usage: CHANGE_PASSWORD <new_password>"); return 0; }
+        int rc = db_change_password(u->id, npw);
+        if (rc == 0) send_line(c, "PASSWORD_CHANGED");
+        else send_line(c, "ERR Change password failed");
+    } else if (!strcasecmp(cmd, "POOL_STATS")) {
+        pool *pools[] = { g_latency_pool, g_bulk_pool, g_auth_pool };
+        for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+            if (!pools[i]) continue;
+            pool_stats st;
+            pool_get_stats(pools[i], &st);
+            send_line(c, "POOL %s threads=%d queued=%zu max_queued=%zu capacity=%zu jobs=%llu rejected=%llu "
+                      "wait_avg_us=%llu wait_max_us=%llu", pool_name(pools[i]), st.threads, st.depth, st.max_depth,
+                      st.capacity, st.jobs, st.rejected, st.jobs ? st.wait_ns_total / st.jobs / 1000 : 0,
+                      st.wait_ns_max / 1000);
+        }
+    } else if (!strcasecmp(cmd, "STATS")) {
+        stats_report(send_stat, c);
+    } else if (!strcasecmp(cmd, "LOCK_STATS")) {
+        int top = LOCK_STATS_TOP;
+        if (sscanf(line, "%*s %d", &top) == 1 && top <= 0) { send_line(c, "ERR Usage: LOCK_STATS [top]"); return 0; }
+        lockprof_report(top, send_lock_stat, c);
+    } else if (!strcasecmp(cmd, "LOGOUT")) {
+        send_line(c, "BYE");
+        return -1;
+    } else {
+        send_line(c, "ERR Unknown command");
+        c->unknown_cmd = 1;
     }
+    return 0;
 }
 
-static void handle_admin(int fd, user_record *u) {
-    (void)u;
-    show_admin_menu(fd);
-    char line[MAX_LINE];
 
-    for (;;) {
-        send_line(fd, "OK Awaiting command");
-        int rr = recv_line(fd, line, sizeof(line));
-        if (rr <= 0) break;
-
-        char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
-        sscanf(line, "%1023s", cmd);
-
-        if (!strcasecmp(cmd, "ADD_EMPLOYEE")) {
-            char uname[USERNAME_MAX], pw[PASSWORD_MAX];
-            if (sscanf(line, "%*s %63s %127s", uname, pw) != 2) { send_line(fd, "ERR Usage: ADD_EMPLOYEE <username> <password>"); continue; }
-            int uid, acct_no;
-            int rc = db_add_user_with_account(uname, pw, ROLE_EMPLOYEE, 1, 0, &uid, &acct_no);
-            if (rc == 0) send_line(fd, "EMPLOYEE_ADDED %s ID %d", uname, uid);
-            else send_line(fd, "ERR Add employee failed");
-        } else if (!strcasecmp(cmd, "SET_ROLE")) {
-            char uname[USERNAME_MAX]; int role;
-            if (sscanf(line, "%*s %63s %d", uname, &role) != 2 || role < ROLE_CUSTOMER || role > ROLE_ADMIN) {
-                send_line(fd, "ERR Usage: SET_ROLE <username> <role_int>");
-                continue;
-            }
-            int rc = db_set_user_role(uname, role);
-            if (rc == 0) send_line(fd, "ROLE_SET %s %d", uname, role);
-            else send_line(fd, "ERR Set role failed");
-        } else if (!strcasecmp(cmd, "CHANGE_PASSWORD")) {
-            char npw[PASSWORD_MAX];
-            if (sscanf(line, "%*s %127s", npw) != 1) { send_line(fd, "ERR Usage: CHANGE_PASSWORD <new_password>"); continue; }
-            int rc = db_change_password(u->id, npw);
-            if (rc == 0) send_line(fd, "PASSWORD_CHANGED");
-            else send_line(fd, "ERR Change password failed");
-        } else if (!strcasecmp(cmd, "LOGOUT")) {
-            send_line(fd, "BYE");
-            break;
-        } else {
-            send_line(fd, "ERR Unknown command");
+
+static void conn_greet(conn_t *c) {
+    send_line(c, "WELCOME Banking Management System");
+    send_line(c, "LOGIN <username> <password>");
+    conn_flush(c);
+}
+
+static void send_frame(conn_t *c, const proto_hdr *req, int status, const void *body, size_t len) {
+    proto_hdr h;
+    h.len = (uint32_t)len;
+    h.op = req->op;
+    h.status = (uint16_t)status;
+    h.tag = req->tag;
+    conn_write(c, (const char *)&h, sizeof(h));
+    if (len) conn_write(c, (const char *)body, len);
+}
+
+// Credential checks run on a dedicated, bounded auth pool, so the password
+// KDF never occupies a reactor or command worker and at most AUTH_THREADS
+// (--auth-threads) of them run at once. A full queue is refused straight away.
+static void reactor_post(struct reactor *r, conn_t *c);
+
+static void auth_work(void *arg) {
+    conn_t *c = (conn_t *)arg;
+    unsigned long long t = stats_now();
+    c->auth_rc = db_login(c->auth_user, c->auth_pass, &c->user, &c->session);
+    stats_since(stats_metric("cmd.LOGIN"), t);
+    memset(c->auth_pass, 0, sizeof(c->auth_pass));
+    if (c->reactor) { reactor_post(c->reactor, c); return; }
+    pthread_mutex_lock(&c->auth_mu);
+    c->auth_pending = 0;
+    pthread_cond_signal(&c->auth_cv);
+    pthread_mutex_unlock(&c->auth_mu);
+}
+
+// Sends the reply for a login the auth pool has finished.
+static int conn_finish_login(conn_t *c) {
+    if (c->binary) {
+        if (c->auth_rc != 0) { send_frame(c, &c->auth_hdr, BST_FAILED, NULL, 0); return 0; }
+        c->state = CONN_AUTHED;
+        proto_login_resp r = { c->user.id, c->user.role };
+        send_frame(c, &c->auth_hdr, BST_OK, &r, sizeof(r));
+        return 0;
+    }
+    if (c->auth_rc != 0) {
+        send_line(c, "ERR Login failed");
+        return 0;
+    }
+    c->state = CONN_AUTHED;
+    send_line(c, "LOGIN_OK ROLE %d", c->user.role);
+
+    if (c->user.role == ROLE_CUSTOMER) show_customer_menu(c);
+    else if (c->user.role == ROLE_EMPLOYEE) show_employee_menu(c);
+    else if (c->user.role == ROLE_MANAGER) show_manager_menu(c);
+    else if (c->user.role == ROLE_ADMIN) show_admin_menu(c);
+    else { send_line(c, "ERR Unknown role"); return -1; }
+    send_line(c, "OK Awaiting command");
+    return 0;
+}
+
+static void conn_login_busy(conn_t *c) {
+    c->auth_pending = 0;
+    memset(c->auth_pass, 0, sizeof(c->auth_pass));
+    if (c->binary) send_frame(c, &c->auth_hdr, BST_FAILED, NULL, 0);
+    else send_line(c, "ERR Server busy");
+}
+
+// Stages a login for the auth pool. A reactor submits it once the request
+// that staged it has finished (reactor_advance); a per-client thread
+// submits it here and waits for the result.
+static int conn_begin_login(conn_t *c, const char *uname, const char *pw, const proto_hdr *h) {
+    snprintf(c->auth_user, sizeof(c->auth_user), "%s", uname);
+    snprintf(c->auth_pass, sizeof(c->auth_pass), "%s", pw);
+    if (h) c->auth_hdr = *h;
+    c->auth_pending = 1;
+    if (c->reactor) return 0;
+    if (pool_submit(g_auth_pool, auth_work, c) != 0) { conn_login_busy(c); return 0; }
+    pthread_mutex_lock(&c->auth_mu);
+    while (c->auth_pending) pthread_cond_wait(&c->auth_cv, &c->auth_mu);
+    pthread_mutex_unlock(&c->auth_mu);
+    return conn_finish_login(c);
+}
+
+static int handle_login(conn_t *c, const char *line) {
+    char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
+    sscanf(line, "%1023s", cmd);
+
+    if (!strcasecmp(cmd, PROTO_SWITCH_CMD)) {
+        send_line(c, PROTO_SWITCH_ACK);
+        c->binary = 1;
+        return 0;
+    }
+    if (strcasecmp(cmd, "LOGIN")) {
+        send_line(c, "ERR Please LOGIN first");
+        return 0;
+    }
+    char uname[USERNAME_MAX + 1], pw[PASSWORD_MAX];
+    if (sscanf(line, "%*s %64s %127s", uname, pw) != 2 || !username_fits(uname)) {
+        send_line(c, "ERR Usage: LOGIN <username> <password>");
+        return 0;
+    }
+    return conn_begin_login(c, uname, pw, NULL);
+}
+
+// Splits an optional "#<id> " prefix off a command line. Every reply line
+// for that command carries the same prefix, so a client that pipelines
+// commands can match replies without counting them.
+static const char *conn_take_tag(conn_t *c, const char *line) {
+    c->tag_len = 0;
+    if (line[0] != '#') return line;
+    size_t n = strcspn(line, " \t");
+    if (n >= TAG_MAX - 1) n = TAG_MAX - 2;
+    memcpy(c->tag, line, n);
+    c->tag[n] = ' ';
+    c->tag_len = n + 1;
+    line += strcspn(line, " \t");
+    while (*line == ' ' || *line == '\t') line++;
+    return line;
+}
+
+// Histogram for a dispatched command, e.g. "cmd.DEPOSIT". Commands the
+// handler did not recognise share one, so clients cannot fill the table.
+static int command_metric(const conn_t *c, const char *line) {
+    if (c->unknown_cmd) return stats_metric("cmd.unknown");
+    char name[STATS_NAME_MAX] = "cmd.";
+    size_t n = strlen(name);
+    while (*line && !isspace((unsigned char)*line) && n < sizeof(name) - 1)
+        name[n++] = (char)toupper((unsigned char)*line++);
+    name[n] = '\0';
+    return stats_metric(name);
+}
+
+// Runs one protocol line. Returns 0 to keep the connection, -1 to close it.
+// Replies are only buffered here; callers flush once no further command is
+// already queued, so pipelined commands share writes. `start` is when the
+// line began to be taken off the input buffer (phase.parse).
+static int conn_dispatch(conn_t *c, const char *line, unsigned long long start) {
+    line = conn_take_tag(c, line);
+    unsigned long long t = stats_now();
+    stats_record(STAT_PARSE, t - start);
+    if (c->state == CONN_LOGIN) return handle_login(c, line);
+
+    int rc;
+    c->unknown_cmd = 0;
+    if (c->user.role == ROLE_CUSTOMER) rc = handle_customer(c, line);
+    else if (c->user.role == ROLE_EMPLOYEE) rc = handle_employee(c, line);
+    else if (c->user.role == ROLE_MANAGER) rc = handle_manager(c, line);
+    else rc = handle_admin(c, line);
+    stats_since(command_metric(c, line), t);
+    if (rc == 0) send_line(c, "OK Awaiting command");
+    return rc;
+}
+
+static void send_history_frame(conn_t *c, const proto_hdr *req, int acct_no, const proto_history_req *q) {
+    txn_entry ents[PROTO_HISTORY_MAX];
+    int limit = q->limit > 0 && q->limit < PROTO_HISTORY_MAX ? q->limit : PROTO_HISTORY_MAX;
+    int n = 0;
+    long long next = -1;
+    if (db_history_page(acct_no, q->cursor, limit, ents, &n, &next) != 0) {
+        send_frame(c, req, BST_FAILED, NULL, 0);
+        return;
+    }
+
+    proto_history_resp r;
+    memset(&r, 0, sizeof(r));
+    r.count = n;
+    r.next_cursor = next;
+    proto_hdr h = { (uint32_t)(sizeof(r) + (size_t)n * sizeof(proto_txn)), req->op, BST_OK, req->tag };
+    conn_write(c, (const char *)&h, sizeof(h));
+    conn_write(c, (const char *)&r, sizeof(r));
+    for (int i = 0; i < n; i++) {
+        proto_txn t;
+        memset(&t, 0, sizeof(t));
+        t.ts = ents[i].ts;
+        t.account_number = ents[i].acct_no;
+        t.type = ents[i].type;
+        t.peer = ents[i].peer;
+        t.amount = ents[i].amount;
+        t.balance = ents[i].balance;
+        conn_write(c, (const char *)&t, sizeof(t));
+    }
+}
+
+// Binary counterpart of the text handlers for the hot customer commands
+// (plus VIEW_TXNS for employees via BOP_HISTORY with an account number).
+static int handle_frame(conn_t *c, const proto_hdr *h, const char *p) {
+    user_record *u = &c->user;
+
+    if (h->op == BOP_LOGIN) {
+        if (h->len != sizeof(proto_login_req) || c->state != CONN_LOGIN) {
+            send_frame(c, h, BST_BAD_REQUEST, NULL, 0);
+            return 0;
+        }
+        proto_login_req q;
+        memcpy(&q, p, sizeof(q));
+        if (!memchr(q.username, '\0', USERNAME_MAX)) { send_frame(c, h, BST_BAD_REQUEST, NULL, 0); return 0; }
+        q.password[PASSWORD_MAX - 1] = '\0';
+        int rc = conn_begin_login(c, q.username, q.password, h);
+        memset(q.password, 0, sizeof(q.password));
+        return rc;
+    }
+    if (c->state != CONN_AUTHED) { send_frame(c, h, BST_NOT_LOGGED_IN, NULL, 0); return 0; }
+
+    switch (h->op) {
+    case BOP_LOGOUT:
+        send_frame(c, h, BST_OK, NULL, 0);
+        return -1;
+    case BOP_BALANCE:
+    case BOP_DEPOSIT:
+    case BOP_WITHDRAW: {
+        size_t want = h->op == BOP_BALANCE ? 0 : sizeof(proto_amount_req);
+        if (h->len != want) { send_frame(c, h, BST_BAD_REQUEST, NULL, 0); return 0; }
+        if (u->role != ROLE_CUSTOMER) { send_frame(c, h, BST_FORBIDDEN, NULL, 0); return 0; }
+        proto_balance_resp r;
+        memset(&r, 0, sizeof(r));
+        long long bal;
+        int rc = db_get_account_number(u->id, &r.account_number);
+        if (rc == 0 && h->op == BOP_BALANCE) {
+            rc = db_get_balance(u->id, &bal);
+        } else if (rc == 0) {
+            proto_amount_req q;
+            memcpy(&q, p, sizeof(q));
+            if (q.amount <= 0) rc = -1;
+            else if (h->op == BOP_DEPOSIT) rc = db_deposit(u->id, q.amount, &bal);
+            else rc = db_withdraw(u->id, q.amount, &bal);
         }
+        if (rc != 0) { send_frame(c, h, BST_FAILED, NULL, 0); return 0; }
+        r.balance = bal;
+        send_frame(c, h, BST_OK, &r, sizeof(r));
+        return 0;
+    }
+    case BOP_TRANSFER: {
+        if (h->len != sizeof(proto_transfer_req)) { send_frame(c, h, BST_BAD_REQUEST, NULL, 0); return 0; }
+        if (u->role != ROLE_CUSTOMER) { send_frame(c, h, BST_FORBIDDEN, NULL, 0); return 0; }
+        proto_transfer_req q;
+        memcpy(&q, p, sizeof(q));
+        int rc = q.amount > 0 ? db_transfer_to_account(u->id, q.to_account, q.amount) : -1;
+        send_frame(c, h, rc == 0 ? BST_OK : BST_FAILED, NULL, 0);
+        return 0;
+    }
+    case BOP_HISTORY: {
+        if (h->len != sizeof(proto_history_req)) { send_frame(c, h, BST_BAD_REQUEST, NULL, 0); return 0; }
+        proto_history_req q;
+        memcpy(&q, p, sizeof(q));
+        int acct_no = q.account_number;
+        if (acct_no == 0 && u->role == ROLE_CUSTOMER) {
+            if (db_get_account_number(u->id, &acct_no) != 0) { send_frame(c, h, BST_FAILED, NULL, 0); return 0; }
+        } else if (acct_no == 0 || u->role != ROLE_EMPLOYEE) {
+            send_frame(c, h, BST_FORBIDDEN, NULL, 0);
+            return 0;
+        }
+        send_history_frame(c, h, acct_no, &q);
+        return 0;
+    }
+    default:
+        send_frame(c, h, BST_BAD_REQUEST, NULL, 0);
+        return 0;
+    }
+}
+
+// Runs the next complete request waiting in the input buffer: a text line,
+// or a frame once the connection has switched to binary. Returns 1 if one
+// ran, 0 if more input is needed, -1 to close the connection.
+static int conn_run_next(conn_t *c) {
+    static const char *frame_metrics[] = {
+        "bin.unknown", "bin.LOGIN", "bin.BALANCE", "bin.DEPOSIT", "bin.WITHDRAW", "bin.TRANSFER",
+        "bin.HISTORY", "bin.LOGOUT"
+    };
+    unsigned long long start = stats_now();
+    if (!c->binary) {
+        char line[MAX_LINE];
+        if (!conn_take_line(c, line, sizeof(line))) return 0;
+        return conn_dispatch(c, line, start) == 0 ? 1 : -1;
+    }
+
+    size_t avail = c->in_len - c->in_start;
+    proto_hdr h;
+    if (avail < sizeof(h)) return 0;
+    memcpy(&h, c->in + c->in_start, sizeof(h));
+    if (h.len > PROTO_MAX_REQUEST) return -1;
+    if (avail < sizeof(h) + h.len) return 0;
+
+    char payload[PROTO_MAX_REQUEST];
+    memcpy(payload, c->in + c->in_start + sizeof(h), h.len);
+    c->in_start += sizeof(h) + h.len;
+    if (c->in_start == c->in_len) c->in_start = c->in_len = 0;
+    unsigned long long t = stats_now();
+    stats_record(STAT_PARSE, t - start);
+    int rc = handle_frame(c, &h, payload);
+    // Logins are timed on the auth pool
+    if (h.op != BOP_LOGIN)
+        stats_since(stats_metric(frame_metrics[h.op < sizeof(frame_metrics) / sizeof(frame_metrics[0]) ? h.op : 0]), t);
+    return rc == 0 ? 1 : -1;
+}
+
+// Whether conn_run_next has something to do: a complete request, or a
+// frame header bad enough to close the connection over.
+static int conn_ready(const conn_t *c) {
+    size_t avail = c->in_len - c->in_start;
+    if (!c->binary) return avail && (memchr(c->in + c->in_start, '\n', avail) != NULL || avail >= MAX_LINE - 1);
+    proto_hdr h;
+    if (avail < sizeof(h)) return 0;
+    memcpy(&h, c->in + c->in_start, sizeof(h));
+    return h.len > PROTO_MAX_REQUEST || avail >= sizeof(h) + h.len;
+}
+
+// Whether the next buffered request is a long scan for the bulk pool:
+// full or ranged statements and the feedback dump.
+static int conn_classify(const conn_t *c) {
+    static const char *bulk[] = { "HISTORY", "HISTORY_RANGE", "VIEW_TXNS", "VIEW_TXNS_RANGE", "REVIEW_FEEDBACK" };
+    if (c->state != CONN_AUTHED) return 0;
+    const char *p = c->in + c->in_start, *end = c->in + c->in_len;
+    if (c->binary) {
+        proto_hdr h;
+        if ((size_t)(end - p) < sizeof(h)) return 0;
+        memcpy(&h, p, sizeof(h));
+        return h.op == BOP_HISTORY;
     }
+    if (p < end && *p == '#') while (p < end && *p != ' ' && *p != '\t' && *p != '\n') p++;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    size_t n = 0;
+    while (p + n < end && !isspace((unsigned char)p[n])) n++;
+    for (size_t i = 0; i < sizeof(bulk) / sizeof(bulk[0]); i++)
+        if (strlen(bulk[i]) == n && !strncasecmp(p, bulk[i], n)) return 1;
+    return 0;
 }
 
+// Consumes the next request without running it and answers it as busy.
+static int conn_refuse_next(conn_t *c) {
+    if (!c->binary) {
+        char line[MAX_LINE];
+        if (!conn_take_line(c, line, sizeof(line))) return 0;
+        conn_take_tag(c, line);
+        send_line(c, "ERR Server busy");
+        return 1;
+    }
+    proto_hdr h;
+    memcpy(&h, c->in + c->in_start, sizeof(h));
+    if (h.len > PROTO_MAX_REQUEST) return -1;
+    c->in_start += sizeof(h) + h.len;
+    if (c->in_start == c->in_len) c->in_start = c->in_len = 0;
+    send_frame(c, &h, BST_FAILED, NULL, 0);
+    return 1;
+}
+
+// Open connections, capped at --max-conns in every serving mode. Those
+// served by per-client threads are also listed in g_clients, so main can
+// end them at shutdown and wait for g_conns to reach 0 (g_conns_cv).
+static pthread_mutex_t g_conns_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_conns_cv = PTHREAD_COND_INITIALIZER;
+static int g_conns, g_max_conns = MAX_CONNS;
+static conn_t *g_clients;
+
+// NULL when out of memory or at the connection cap; conn_refuse the fd.
+static conn_t *conn_new(int fd, const struct sockaddr_in *addr) {
+    pthread_mutex_lock(&g_conns_mu);
+    int full = g_conns >= g_max_conns;
+    if (!full) g_conns++;
+    pthread_mutex_unlock(&g_conns_mu);
+    if (full) return NULL;
+    conn_t *c = (conn_t *)calloc(1, sizeof(*c));
+    if (!c) {
+        pthread_mutex_lock(&g_conns_mu);
+        g_conns--;
+        pthread_mutex_unlock(&g_conns_mu);
+        return NULL;
+    }
+    c->fd = fd;
+    c->addr = *addr;
+    c->state = CONN_LOGIN;
+    pthread_mutex_init(&c->auth_mu, NULL);
+    pthread_cond_init(&c->auth_cv, NULL);
+    return c;
+}
+
+static void conn_close(conn_t *c) {
+    // Unlisted before the fd closes, so main never shuts down a reused fd
+    if (!c->reactor) {
+        pthread_mutex_lock(&g_conns_mu);
+        if (c->prev) c->prev->next = c->next;
+        else if (g_clients == c) g_clients = c->next;
+        if (c->next) c->next->prev = c->prev;
+        pthread_mutex_unlock(&g_conns_mu);
+    }
+    conn_flush(c);
+    if (c->state == CONN_AUTHED) db_logout(c->user.id, c->session);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    pthread_mutex_destroy(&c->auth_mu);
+    pthread_cond_destroy(&c->auth_cv);
+    free(c);
+    pthread_mutex_lock(&g_conns_mu);
+    if (--g_conns == 0) pthread_cond_broadcast(&g_conns_cv);
+    pthread_mutex_unlock(&g_conns_mu);
+}
+
+static void conn_refuse(int fd) {
+    static const char msg[] = "ERR Server busy\n";
+    ssize_t n = send(fd, msg, sizeof(msg) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    (void)n;
+    close(fd);
+}
 
 static void *client_thread(void *arg) {
-    client_ctx_t *ctx = (client_ctx_t*)arg;
-    int fd = ctx->fd;
-    free(ctx);
+    conn_t *c = (conn_t *)arg;
+    conn_greet(c);
 
-    send_line(fd, "WELCOME Banking Management System");
-    send_line(fd, "LOGIN <username> <password>");
+    for (;;) {
+        int r = conn_run_next(c);
+        if (r < 0) break;
+        if (r > 0) continue;
+        // Nothing queued: send what the last batch produced, then wait
+        if (conn_flush(c) != 0 || conn_fill(c, 0) <= 0) break;
+    }
+    conn_close(c);
+    return NULL;
+}
+
+
+// Reactor mode: a few threads, each with its own epoll set, share the
+// listening socket (EPOLLEXCLUSIVE wakes one of them per connection) and do
+// the socket I/O. Complete requests are handed to the command pool when
+// there is one and run inline on the reactor otherwise. A connection with
+// a pool job in flight leaves the epoll set until the job comes back
+// through the reactor's wake pipe, so its requests still run one at a time
+// and in order. Client sockets are non-blocking: replies the peer is not
+// ready for stay queued on the connection and go out on EPOLLOUT, and past
+// CONN_OUTBUF_MAX of them the connection's requests wait for the backlog.
+#define REACTOR_MAX_EVENTS 256
 
-    char line[MAX_LINE];
-    user_record u;
-    bool authed = false;
+typedef struct reactor {
+    pthread_t thread;
+    int epfd;
+    int listen_fd;
+    conn_t *conns;         /* every connection owned by this reactor */
+    // Finished pool jobs, handed back through the wake pipe
+    int wake[2];
+    pthread_mutex_t done_mu;
+    conn_t *done;
+    int jobs;              /* connections with a pool job in flight */
+} reactor_t;
+
+// Sets the events the reactor waits for on the connection; 0 takes it out
+// of the epoll set.
+static int reactor_watch(reactor_t *r, conn_t *c, unsigned events) {
+    if (c->watched == events) return 0;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    int op = !events ? EPOLL_CTL_DEL : c->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(r->epfd, op, c->fd, &ev) != 0) return -1;
+    c->watched = events;
+    return 0;
+}
 
+static void reactor_drop(reactor_t *r, conn_t *c) {
+    reactor_watch(r, c, 0);
+    if (c->prev) c->prev->next = c->next;
+    else r->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    conn_close(c);
+}
+
+// Called on a pool thread when a connection's job has finished.
+static void reactor_post(struct reactor *r, conn_t *c) {
+    pthread_mutex_lock(&r->done_mu);
+    c->done_next = r->done;
+    r->done = c;
+    pthread_mutex_unlock(&r->done_mu);
+    ssize_t n = write(r->wake[1], "", 1);
+    (void)n;   /* a full pipe already has a wakeup pending */
+}
+
+static void command_work(void *arg) {
+    conn_t *c = (conn_t *)arg;
+    c->job_rc = conn_run_next(c);
+    c->bulk = 0;
+    reactor_post(c->reactor, c);
+}
+
+// Passes the connection to a pool. Replies so far go out as far as the
+// socket takes them without waiting; the rest stay queued, the worker adds
+// its own after them, and the reactor sends whatever is left once the job
+// comes back (EPOLLOUT). Returns 1 once handed off, 0 if the pool's queue
+// is full, -1 if the peer is gone.
+static int reactor_hand_off(reactor_t *r, conn_t *c, pool *p, pool_fn fn, conn_job job) {
+    if (conn_flush(c) != 0) return -1;
+    c->job = job;
+    if (pool_submit(p, fn, c) != 0) { c->job = JOB_NONE; return 0; }
+    r->jobs++;
+    return 1;
+}
+
+// Runs or hands off whatever the connection can do next. Returns 1 with a
+// job in flight, 0 once it needs more input or is backlogged (output sent
+// as far as the peer takes it), -1 to drop it.
+static int reactor_advance(reactor_t *r, conn_t *c) {
     for (;;) {
-        int rr = recv_line(fd, line, sizeof(line));
-        if (rr <= 0) goto out;
-
-        char cmd[MAX_LINE]; memset(cmd, 0, sizeof(cmd));
-        sscanf(line, "%1023s", cmd);
-
-        if (!authed) {
-            if (!strcasecmp(cmd, "LOGIN")) {
-                char uname[USERNAME_MAX], pw[PASSWORD_MAX];
-                if (sscanf(line, "%*s %63s %127s", uname, pw) != 2) {
-                    send_line(fd, "ERR Usage: LOGIN <username> <password>");
-                    continue;
-                }
-                int rc = db_login(uname, pw, &u);
-                if (rc == 0) {
-                    authed = true;
-                    send_line(fd, "LOGIN_OK ROLE %d", u.role);
-                    break;
-                } else {
-                    send_line(fd, "ERR Login failed");
-                }
-            } else {
-                send_line(fd, "ERR Please LOGIN first");
-            }
+        int rc;
+        if (c->auth_pending) {
+            if ((rc = reactor_hand_off(r, c, g_auth_pool, auth_work, JOB_AUTH)) != 0) return rc;
+            conn_login_busy(c);
+            continue;
         }
+        if (conn_backlogged(c) || !conn_ready(c)) return conn_flush(c);
+        if (!g_latency_pool) {
+            if (conn_run_next(c) < 0) return -1;
+            continue;
+        }
+        // Without bulk workers scans share the latency pool, unpaced
+        pool *p = g_latency_pool;
+        if (g_bulk_pool && conn_classify(c)) p = g_bulk_pool;
+        c->bulk = p == g_bulk_pool;
+        if ((rc = reactor_hand_off(r, c, p, command_work, JOB_COMMAND)) != 0) return rc;
+        c->bulk = 0;
+        if (conn_refuse_next(c) < 0) return -1;
     }
+}
 
-    if (u.role == ROLE_CUSTOMER) handle_customer(fd, &u);
-    else if (u.role == ROLE_EMPLOYEE) handle_employee(fd, &u);
-    else if (u.role == ROLE_MANAGER) handle_manager(fd, &u);
-    else if (u.role == ROLE_ADMIN) handle_admin(fd, &u);
-    else send_line(fd, "ERR Unknown role");
+// Applies a reactor_advance/reactor_read result to the epoll set: a
+// connection waiting on its peer is watched for input, for output while
+// replies are queued, and for output alone once backlogged.
+static void reactor_settle(reactor_t *r, conn_t *c, int rc) {
+    unsigned events = 0;
+    if (rc == 0) {
+        if (!conn_backlogged(c)) events |= EPOLLIN;
+        if (conn_pending(c)) events |= EPOLLOUT;
+        conn_trim(c);
+    }
+    if (rc < 0 || reactor_watch(r, c, events) != 0) reactor_drop(r, c);
+}
 
-out:
-    if (authed) db_logout(u.id);
-    close(fd);
+static void reactor_accept(reactor_t *r) {
+    for (;;) {
+        struct sockaddr_in caddr;
+        socklen_t clen = sizeof(caddr);
+        int cfd = accept(r->listen_fd, (struct sockaddr*)&caddr, &clen);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        int flags = fcntl(cfd, F_GETFL, 0);
+        if (flags < 0 || fcntl(cfd, F_SETFL, flags | O_NONBLOCK) < 0) { close(cfd); continue; }
+        conn_t *c = conn_new(cfd, &caddr);
+        if (!c) { conn_refuse(cfd); continue; }
+        c->reactor = r;
+        c->next = r->conns;
+        if (r->conns) r->conns->prev = c;
+        r->conns = c;
+        conn_greet(c);
+        reactor_settle(r, c, c->out_err ? -1 : 0);
+    }
+}
+
+// Drains the socket, running or handing off complete requests. Stops early
+// once a job is in flight. Same returns as reactor_advance.
+static int reactor_read(reactor_t *r, conn_t *c) {
+    for (;;) {
+        ssize_t n = conn_fill(c, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            return conn_flush(c);
+        }
+        int rc = reactor_advance(r, c);
+        if (rc != 0 || conn_backlogged(c)) return rc;
+    }
+}
+
+// Sends queued replies, then resumes requests held back by the backlog.
+static int reactor_write(reactor_t *r, conn_t *c) {
+    if (conn_flush(c) != 0) return -1;
+    return reactor_advance(r, c);
+}
+
+// Takes back connections whose jobs have finished: answers a verified
+// login, then carries on with any requests already buffered.
+static void reactor_complete(reactor_t *r) {
+    char buf[64];
+    while (read(r->wake[0], buf, sizeof(buf)) > 0) {}
+    pthread_mutex_lock(&r->done_mu);
+    conn_t *c = r->done;
+    r->done = NULL;
+    pthread_mutex_unlock(&r->done_mu);
+
+    while (c) {
+        conn_t *next = c->done_next;
+        conn_job job = c->job;
+        c->job = JOB_NONE;
+        r->jobs--;
+        int rc = 0;
+        if (job == JOB_AUTH) {
+            c->auth_pending = 0;
+            rc = conn_finish_login(c);
+        } else if (c->job_rc < 0) {
+            rc = -1;
+        }
+        if (rc == 0) rc = reactor_advance(r, c);
+        reactor_settle(r, c, rc);
+        c = next;
+    }
+}
+
+static void *reactor_thread(void *arg) {
+    reactor_t *r = (reactor_t *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (g_running) {
+        int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, 500);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) { reactor_accept(r); continue; }
+            if (events[i].data.ptr == r) { reactor_complete(r); continue; }
+            conn_t *c = (conn_t *)events[i].data.ptr;
+            int rc = events[i].events & EPOLLOUT ? reactor_write(r, c) : 0;
+            if (rc == 0 && (events[i].events & ~EPOLLOUT)) rc = reactor_read(r, c);
+            reactor_settle(r, c, rc);
+        }
+    }
+
+    // Connections with a job in flight are still in use by a pool
+    while (r->jobs > 0) {
+        int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++)
+            if (events[i].data.ptr == r) reactor_complete(r);
+    }
+    while (r->conns) reactor_drop(r, r->conns);
     return NULL;
 }
 
+static int run_reactors(int sfd, int nreactors) {
+    int flags = fcntl(sfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0) { perror("fcntl"); return -1; }
+
+    reactor_t *rs = (reactor_t *)calloc((size_t)nreactors, sizeof(*rs));
+    if (!rs) return -1;
+
+    int started = 0;
+    for (; started < nreactors; started++) {
+        reactor_t *r = &rs[started];
+        r->listen_fd = sfd;
+        r->epfd = epoll_create1(0);
+        if (r->epfd < 0) { perror("epoll_create1"); break; }
+        if (pipe(r->wake) != 0) { perror("pipe"); close(r->epfd); break; }
+        fcntl(r->wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(r->wake[1], F_SETFL, O_NONBLOCK);
+        pthread_mutex_init(&r->done_mu, NULL);
+        struct epoll_event ev, wev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+        ev.events |= EPOLLEXCLUSIVE;
+#endif
+        ev.data.ptr = NULL;
+        memset(&wev, 0, sizeof(wev));
+        wev.events = EPOLLIN;
+        wev.data.ptr = r;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, sfd, &ev) != 0 ||
+            epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wake[0], &wev) != 0 ||
+            pthread_create(&r->thread, NULL, reactor_thread, r) != 0) {
+            close(r->wake[0]);
+            close(r->wake[1]);
+            close(r->epfd);
+            break;
+        }
+    }
+
+    if (started > 0) {
+        if (g_latency_pool) {
+            pool_stats st, bst = {0};
+            pool_get_stats(g_latency_pool, &st);
+            if (g_bulk_pool) pool_get_stats(g_bulk_pool, &bst);
+            printf("Serving with %d epoll reactor thread(s), %d latency and %d bulk worker(s)\n",
+                   started, st.threads, bst.threads);
+        } else {
+            printf("Serving with %d epoll reactor thread(s)\n", started);
+        }
+        fflush(stdout);
+        while (g_running) pause();
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(rs[i].thread, NULL);
+        close(rs[i].wake[0]);
+        close(rs[i].wake[1]);
+        close(rs[i].epfd);
+    }
+    free(rs);
+    return started > 0 ? 0 : -1;
+}
+
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nreactors = 1, workers = cores > 0 ? (int)cores : 1, per_client = 0;
+    int auth_threads = AUTH_THREADS, bulk_workers = 1, bad = argc < 2;
+    for (int i = 2; i < argc && !bad; i++) {
+        if (!strcmp(argv[i], "--epoll") && i + 1 < argc && (nreactors = atoi(argv[i + 1])) > 0) i++;
+        else if (!strcmp(argv[i], "--workers") && i + 1 < argc && (workers = atoi(argv[i + 1])) >= 0) i++;
+        else if (!strcmp(argv[i], "--bulk-workers") && i + 1 < argc && (bulk_workers = atoi(argv[i + 1])) >= 0) i++;
+        else if (!strcmp(argv[i], "--latency-budget-ms") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            g_latency_budget_ns = (unsigned long long)atoi(argv[++i]) * 1000000ULL;
+        else if (!strcmp(argv[i], "--thread-per-client")) per_client = 1;
+        else if (!strcmp(argv[i], "--max-conns") && i + 1 < argc && (g_max_conns = atoi(argv[i + 1])) > 0) i++;
+        else if (!strcmp(argv[i], "--auth-threads") && i + 1 < argc && (auth_threads = atoi(argv[i + 1])) > 0) i++;
+        else if (!strcmp(argv[i], "--kdf-iterations") && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            db_set_kdf_iterations((unsigned)atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--binlog")) db_set_binary_txn_log(1);
+        else if (!strcmp(argv[i], "--mmap")) db_set_mmap_accounts(1);
+        else if (!strcmp(argv[i], "--segment-kb") && i + 1 < argc && atoll(argv[i + 1]) >= 0)
+            db_set_txn_segment_bytes(atoll(argv[++i]) * 1024);
+        else bad = 1;
+    }
+    if (bad) {
+        fprintf(stderr, "Usage: %s <port> [--epoll <reactor_threads>] [--workers <n>] [--thread-per-client]\n"
+                        "       [--bulk-workers <n>] [--latency-budget-ms <ms>]\n"
+                        "       [--max-conns <n>] [--binlog] [--mmap] [--segment-kb <kb>]\n"
+                        "       [--auth-threads <n>] [--kdf-iterations <n>]\n", argv[0]);
         return 1;
     }
 
-    signal(SIGINT, on_sigint);
+    // No SA_RESTART: a signal must interrupt accept() so main can shut down
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    // Before any other thread starts, so they all leave SIGUSR1 to it
+    if (stats_dump_on_signal(SIGUSR1, STATS_FILE) != 0) fprintf(stderr, "stats: SIGUSR1 dumps disabled\n");
 
     if (db_init() != 0) {
         fprintf(stderr, "Database init failed\n");
         return 1;
     }
+    g_auth_pool = pool_create("auth", auth_threads, AUTH_QUEUE);
+    if (!g_auth_pool) {
+        fprintf(stderr, "auth pool: could not start %d thread(s)\n", auth_threads);
+        db_shutdown();
+        return 1;
+    }
+    if (!per_client && workers > 0) {
+        g_latency_pool = pool_create("latency", workers, COMMAND_QUEUE);
+        if (g_latency_pool && bulk_workers > 0 && !(g_bulk_pool = pool_create("bulk", bulk_workers, BULK_QUEUE))) {
+            pool_destroy(g_latency_pool);
+            g_latency_pool = NULL;
+        }
+        if (!g_latency_pool) {
+            fprintf(stderr, "command pools: could not start %d+%d thread(s)\n", workers, bulk_workers);
+            pool_destroy(g_auth_pool);
+            db_shutdown();
+            return 1;
+        }
+    }
 
     int port = atoi(argv[1]);
     int sfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -438,6 +1421,19 @@ int main(int argc, char **argv) {
 
     printf("Server listening on port %d\n", port);
 
+    if (!per_client) {
+        int rc = run_reactors(sfd, nreactors);
+        close(sfd);
+        pool_destroy(g_latency_pool);
+        pool_destroy(g_bulk_pool);
+        pool_destroy(g_auth_pool);
+        db_shutdown();
+        return rc == 0 ? 0 : 1;
+    }
+
+    // --thread-per-client: the original mode, one blocking thread per
+    // connection, bounded only by --max-conns
+
     while (g_running) {
         struct sockaddr_in caddr;
         socklen_t clen = sizeof(caddr);
@@ -448,20 +1444,28 @@ int main(int argc, char **argv) {
             continue;
         }
 
-        client_ctx_t *ctx = (client_ctx_t*)malloc(sizeof(*ctx));
-        if (!ctx) { close(cfd); continue; }
-        ctx->fd = cfd;
-        ctx->addr = caddr;
+        conn_t *c = conn_new(cfd, &caddr);
+        if (!c) { conn_refuse(cfd); continue; }
+        pthread_mutex_lock(&g_conns_mu);
+        c->next = g_clients;
+        if (g_clients) g_clients->prev = c;
+        g_clients = c;
+        pthread_mutex_unlock(&g_conns_mu);
 
         pthread_t th;
-        if (pthread_create(&th, NULL, client_thread, ctx) == 0) {
-            pthread_detach(th);
-        } else {
-            close(cfd);
-            free(ctx);
-        }
+        if (pthread_create(&th, NULL, client_thread, c) == 0) pthread_detach(th);
+        else conn_close(c);
     }
 
+    // Client threads use the auth pool and the database until they return:
+    // wake them out of recv/send and wait for the last one to close
+    pthread_mutex_lock(&g_conns_mu);
+    for (conn_t *c = g_clients; c; c = c->next) shutdown(c->fd, SHUT_RDWR);
+    while (g_conns > 0) pthread_cond_wait(&g_conns_cv, &g_conns_mu);
+    pthread_mutex_unlock(&g_conns_mu);
+
     close(sfd);
+    pool_destroy(g_auth_pool);
+    db_shutdown();
     return 0;
 }
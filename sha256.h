@@ -0,0 +1,29 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SHA-256 (FIPS 180-4), HMAC-SHA256 (RFC 2104) and PBKDF2-HMAC-SHA256
+ * (RFC 8018), used for password hashing.
+ */
+
+#define SHA256_LEN 32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;         /* bytes hashed so far */
+    unsigned char buf[64];
+    size_t used;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *c);
+void sha256_update(sha256_ctx *c, const void *data, size_t len);
+void sha256_final(sha256_ctx *c, unsigned char out[SHA256_LEN]);
+
+void hmac_sha256(const void *key, size_t klen, const void *msg, size_t mlen, unsigned char out[SHA256_LEN]);
+void pbkdf2_sha256(const void *pw, size_t pwlen, const void *salt, size_t saltlen, uint32_t iters,
+                   unsigned char *out, size_t outlen);
+
+#endif
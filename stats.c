@@ -0,0 +1,225 @@
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define STATS_SUB     (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_SUB_BITS + 2) * STATS_SUB)
+
+typedef struct {
+    uint64_t count, sum, max;
+    uint64_t b[STATS_BUCKETS];
+} stats_hist;
+
+// One per recording thread, histograms allocated on first use. Only the
+// owner writes; readers merge under g_mu, which is also what a thread
+// takes to fold its block into g_retired on exit.
+typedef struct stats_thread {
+    stats_hist *h[STATS_MAX_METRICS];
+    struct stats_thread *prev, *next;
+} stats_thread;
+
+static pthread_mutex_t g_mu = PTHREAD_MUTEX_INITIALIZER;
+static char g_names[STATS_MAX_METRICS][STATS_NAME_MAX] = {
+    "phase.parse", "phase.lock_wait", "phase.stripe_wait", "phase.read",
+    "phase.write", "phase.fsync", "phase.send"
+};
+static int g_nmetrics = STAT_PHASES;   /* published with a release store */
+static stats_thread *g_threads;
+static stats_hist *g_retired[STATS_MAX_METRICS];
+static pthread_key_t g_key;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+
+unsigned long long stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+static unsigned bucket_of(uint64_t v) {
+    if (v < STATS_SUB) return (unsigned)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e > STATS_MAX_EXP) return STATS_BUCKETS - 1;
+    return (unsigned)((e - STATS_SUB_BITS + 1) * STATS_SUB) +
+           (unsigned)((v >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+// Middle of the bucket's value range
+static uint64_t bucket_value(unsigned i) {
+    if (i < STATS_SUB) return i;
+    unsigned shift = i / STATS_SUB - 1;
+    return ((uint64_t)(STATS_SUB + i % STATS_SUB) << shift) + ((1ull << shift) >> 1);
+}
+
+static void merge(stats_hist *dst, const stats_hist *src) {
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) dst->max = max;
+    for (int i = 0; i < STATS_BUCKETS; i++) dst->b[i] += __atomic_load_n(&src->b[i], __ATOMIC_RELAXED);
+}
+
+static void thread_exit(void *arg) {
+    stats_thread *t = (stats_thread *)arg;
+    pthread_mutex_lock(&g_mu);
+    for (int i = 0; i < STATS_MAX_METRICS; i++) {
+        if (!t->h[i]) continue;
+        if (!g_retired[i]) { g_retired[i] = t->h[i]; continue; }
+        merge(g_retired[i], t->h[i]);
+        free(t->h[i]);
+    }
+    if (t->prev) t->prev->next = t->next;
+    else g_threads = t->next;
+    if (t->next) t->next->prev = t->prev;
+    pthread_mutex_unlock(&g_mu);
+    free(t);
+}
+
+static void stats_init(void) { pthread_key_create(&g_key, thread_exit); }
+
+static stats_thread *thread_block(void) {
+    pthread_once(&g_once, stats_init);
+    stats_thread *t = (stats_thread *)pthread_getspecific(g_key);
+    if (t) return t;
+    if (!(t = (stats_thread *)calloc(1, sizeof(*t)))) return NULL;
+    pthread_mutex_lock(&g_mu);
+    t->next = g_threads;
+    if (g_threads) g_threads->prev = t;
+    g_threads = t;
+    pthread_mutex_unlock(&g_mu);
+    pthread_setspecific(g_key, t);
+    return t;
+}
+
+int stats_metric(const char *name) {
+    int n = __atomic_load_n(&g_nmetrics, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++)
+        if (!strcmp(g_names[i], name)) return i;
+    pthread_mutex_lock(&g_mu);
+    int id = -1;
+    for (int i = n; i < g_nmetrics && id < 0; i++)
+        if (!strcmp(g_names[i], name)) id = i;
+    if (id < 0 && g_nmetrics < STATS_MAX_METRICS) {
+        id = g_nmetrics;
+        snprintf(g_names[id], STATS_NAME_MAX, "%s", name);
+        __atomic_store_n(&g_nmetrics, id + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_mu);
+    return id;
+}
+
+// Single writer, so a plain read-modify-write; the atomic store only keeps
+// concurrent readers from seeing torn values.
+static void bump(uint64_t *x, uint64_t by) { __atomic_store_n(x, *x + by, __ATOMIC_RELAXED); }
+
+void stats_record(int id, unsigned long long ns) {
+    if (id < 0 || id >= STATS_MAX_METRICS) return;
+    stats_thread *t = thread_block();
+    if (!t) return;
+    stats_hist *h = t->h[id];
+    if (!h) {
+        if (!(h = (stats_hist *)calloc(1, sizeof(*h)))) return;
+        __atomic_store_n(&t->h[id], h, __ATOMIC_RELEASE);
+    }
+    bump(&h->count, 1);
+    bump(&h->sum, ns);
+    if (ns > h->max) __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    bump(&h->b[bucket_of(ns)], 1);
+}
+
+void stats_since(int id, unsigned long long start) { stats_record(id, stats_now() - start); }
+
+static double percentile_us(const stats_hist *h, double q) {
+    double want = q * (double)h->count;
+    uint64_t rank = (uint64_t)want;
+    if (rank < want || rank < 1) rank++;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < STATS_BUCKETS; i++) {
+        seen += h->b[i];
+        if (seen < rank) continue;
+        uint64_t v = bucket_value(i);
+        return (v < h->max ? v : h->max) / 1000.0;
+    }
+    return h->max / 1000.0;
+}
+
+void stats_report(stats_emit_fn emit, void *arg) {
+    pthread_once(&g_once, stats_init);
+    stats_hist *sum = (stats_hist *)malloc(sizeof(*sum));
+    if (!sum) return;
+    int n = __atomic_load_n(&g_nmetrics, __ATOMIC_ACQUIRE);
+    for (int id = 0; id < n; id++) {
+        memset(sum, 0, sizeof(*sum));
+        pthread_mutex_lock(&g_mu);
+        if (g_retired[id]) merge(sum, g_retired[id]);
+        for (stats_thread *t = g_threads; t; t = t->next) {
+            stats_hist *h = __atomic_load_n(&t->h[id], __ATOMIC_ACQUIRE);
+            if (h) merge(sum, h);
+        }
+        pthread_mutex_unlock(&g_mu);
+        if (!sum->count) continue;
+
+        char line[256];
+        snprintf(line, sizeof(line), "%s count=%llu avg_us=%.1f p50_us=%.1f p90_us=%.1f p99_us=%.1f "
+                 "p999_us=%.1f max_us=%.1f", g_names[id], (unsigned long long)sum->count,
+                 (double)sum->sum / (double)sum->count / 1000.0, percentile_us(sum, 0.5),
+                 percentile_us(sum, 0.9), percentile_us(sum, 0.99), percentile_us(sum, 0.999),
+                 sum->max / 1000.0);
+        if (emit(arg, line)) break;
+    }
+    free(sum);
+}
+
+static int emit_file(void *arg, const char *line) { return fprintf((FILE *)arg, "%s\n", line) < 0; }
+
+int stats_dump(const char *path) {
+    char tmpname[512];
+    snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", path);
+    int fd = mkstemp(tmpname);
+    if (fd < 0) return -1;
+    fchmod(fd, 0644);
+    FILE *out = fdopen(fd, "w");
+    if (!out) { close(fd); unlink(tmpname); return -1; }
+    fprintf(out, "# %lld\n", (long long)time(NULL));
+    stats_report(emit_file, out);
+    int rc = fflush(out) == 0 && !ferror(out) ? 0 : -1;
+    if (fclose(out) != 0) rc = -1;
+    if (rc == 0 && rename(tmpname, path) != 0) rc = -1;
+    if (rc != 0) unlink(tmpname);
+    return rc;
+}
+
+static sigset_t g_dump_sigs;
+static char g_dump_path[256];
+
+static void *dump_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        int sig;
+        if (sigwait(&g_dump_sigs, &sig) != 0) continue;
+        if (stats_dump(g_dump_path) == 0) fprintf(stderr, "stats: wrote %s\n", g_dump_path);
+        else perror(g_dump_path);
+    }
+    return NULL;
+}
+
+int stats_dump_on_signal(int sig, const char *path) {
+    snprintf(g_dump_path, sizeof(g_dump_path), "%s", path);
+    sigemptyset(&g_dump_sigs);
+    sigaddset(&g_dump_sigs, sig);
+    if (pthread_sigmask(SIG_BLOCK, &g_dump_sigs, NULL) != 0) return -1;
+    pthread_t th;
+    if (pthread_create(&th, NULL, dump_thread, NULL) != 0) return -1;
+    pthread_detach(th);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ * Latency histograms. Samples are recorded per thread without locks and
+ * merged only when read, so instrumenting hot paths costs two clock reads
+ * and a few stores.
+ *
+ * Each metric is a log-linear histogram of nanoseconds: values below
+ * 2^STATS_SUB_BITS are exact, larger ones fall in one of 2^STATS_SUB_BITS
+ * buckets per power of two, so a percentile is reported to within about
+ * 6% (HDR-style). Samples above 2^STATS_MAX_EXP ns land in the top bucket.
+ *
+ * The phases below always exist. Other metrics (one per command) are
+ * registered by name with stats_metric.
+ */
+
+#define STATS_SUB_BITS    4
+#define STATS_MAX_EXP     36    /* ~69 s */
+#define STATS_MAX_METRICS 128
+#define STATS_NAME_MAX    40
+
+enum {
+    STAT_PARSE,           /* framing a request and splitting off its command */
+    STAT_LOCK_WAIT,       /* blocked in lock_region (fcntl F_SETLKW) */
+    STAT_STRIPE_WAIT,     /* blocked on an in-process account stripe lock */
+    STAT_READ,            /* pread */
+    STAT_WRITE,           /* write / pwrite */
+    STAT_FSYNC,           /* fsync / fdatasync */
+    STAT_SEND,            /* send() of reply bytes */
+    STAT_PHASES
+};
+
+unsigned long long stats_now(void);
+
+// Finds or registers a metric; -1 once STATS_MAX_METRICS are in use.
+int  stats_metric(const char *name);
+void stats_record(int id, unsigned long long ns);
+void stats_since(int id, unsigned long long start);
+
+// One line per metric with samples, without a trailing newline:
+//   <name> count=<n> avg_us=.. p50_us=.. p90_us=.. p99_us=.. p999_us=.. max_us=..
+// Stops early if emit returns non-zero.
+typedef int (*stats_emit_fn)(void *arg, const char *line);
+void stats_report(stats_emit_fn emit, void *arg);
+
+// Writes the report to path (replaced atomically).
+int  stats_dump(const char *path);
+
+// Blocks sig in the calling thread, and in every thread it creates from
+// then on, and starts a thread that dumps the report to path each time the
+// signal arrives. Call from main before starting other threads.
+int  stats_dump_on_signal(int sig, const char *path);
+
+#endif
@@ -0,0 +1,84 @@
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "txnlog.h"
+
+const char *txnlog_type_name(int type) {
+    switch (type) {
+    case TXN_DEPOSIT:      return "DEPOSIT";
+    case TXN_WITHDRAW:     return "WITHDRAW";
+    case TXN_TRANSFER_OUT: return "TRANSFER_OUT";
+    case TXN_TRANSFER_IN:  return "TRANSFER_IN";
+    case TXN_LOAN_CREDIT:  return "LOAN_CREDIT";
+    default:               return "UNKNOWN";
+    }
+}
+
+static int txnlog_type_code(const char *name) {
+    for (int type = TXN_DEPOSIT; type <= TXN_LOAN_CREDIT; type++)
+        if (!strcmp(name, txnlog_type_name(type))) return type;
+    return 0;
+}
+
+int txnlog_format_line(const txn_entry *e, char *buf, size_t cap) {
+    char note[32] = "-";
+    if (e->type == TXN_TRANSFER_OUT) snprintf(note, sizeof(note), "to=%d", e->peer);
+    else if (e->type == TXN_TRANSFER_IN) snprintf(note, sizeof(note), "from=%d", e->peer);
+    int n = snprintf(buf, cap, "%lld|acct=%d|%s|amt=%lld|bal=%lld|%s\n",
+                     e->ts, e->acct_no, txnlog_type_name(e->type), e->amount, e->balance, note);
+    if (n < 0) return 0;
+    return (size_t)n >= cap ? (int)cap - 1 : n;
+}
+
+// Matches the account number exactly, unlike a strstr tag filter.
+int txnlog_parse_line(const char *line, txn_entry *e) {
+    char type[32];
+    if (sscanf(line, "%lld|acct=%d|%31[^|]|amt=%lld|bal=%lld|",
+               &e->ts, &e->acct_no, type, &e->amount, &e->balance) != 5) return -1;
+    e->type = txnlog_type_code(type);
+    e->peer = 0;
+    const char *note = strrchr(line, '|');
+    if (note && sscanf(note, "|to=%d", &e->peer) != 1) sscanf(note, "|from=%d", &e->peer);
+    return 0;
+}
+
+void txnlog_encode(const txn_entry *e, uint64_t seq, txnlog_rec *r) {
+    memset(r, 0, sizeof(*r));
+    r->seq = seq;
+    r->ts = e->ts;
+    r->acct_no = e->acct_no;
+    r->type = e->type;
+    r->peer = e->peer;
+    r->amount = e->amount;
+    r->balance = e->balance;
+    r->crc = crc32_buf(r, sizeof(*r));
+}
+
+int txnlog_decode(const txnlog_rec *r, txn_entry *e) {
+    txnlog_rec tmp = *r;
+    tmp.crc = 0;
+    if (r->seq == 0 || crc32_buf(&tmp, sizeof(tmp)) != r->crc) return -1;
+    e->ts = r->ts;
+    e->acct_no = r->acct_no;
+    e->type = r->type;
+    e->peer = r->peer;
+    e->amount = r->amount;
+    e->balance = r->balance;
+    return 0;
+}
+
+void txnlog_header_init(txnlog_header *h) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, TXNLOG_MAGIC, sizeof(h->magic));
+    h->version = TXNLOG_VERSION;
+    h->rec_size = sizeof(txnlog_rec);
+}
+
+int txnlog_header_valid(const txnlog_header *h) {
+    return memcmp(h->magic, TXNLOG_MAGIC, sizeof(h->magic)) == 0 &&
+           h->version == TXNLOG_VERSION && h->rec_size == sizeof(txnlog_rec);
+}
@@ -0,0 +1,55 @@
+#ifndef TXNLOG_H
+#define TXNLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * transactions.log record formats.
+ *
+ * Text (the original format): one line per entry,
+ *   <epoch>|acct=<n>|<TYPE>|amt=<amount>|bal=<balance>|<note>
+ * where note is to=<acct>, from=<acct> or "-".
+ *
+ * Binary: a txnlog_header followed by fixed-width txnlog_rec records.
+ * Each record carries a sequence number (consecutive from 1) and a CRC-32
+ * over the rest of the record, so readers need no parsing and can detect
+ * torn or damaged records. The header's magic tells the formats apart.
+ */
+
+#define TXNLOG_MAGIC   "BMSTXLG1"
+#define TXNLOG_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;    /* sizeof(txnlog_rec) */
+} txnlog_header;
+
+typedef struct {
+    uint64_t seq;
+    int64_t ts;
+    int32_t acct_no;
+    int32_t type;         /* txn_type */
+    int32_t peer;         /* counterparty account for transfers, 0 otherwise */
+    uint32_t crc;         /* over the record with this field zeroed */
+    int64_t amount;
+    int64_t balance;
+} txnlog_rec;
+
+const char *txnlog_type_name(int type);
+
+// Text format. txnlog_format_line includes the trailing newline and returns
+// the length written (truncated to cap - 1).
+int txnlog_format_line(const txn_entry *e, char *buf, size_t cap);
+int txnlog_parse_line(const char *line, txn_entry *e);
+
+// Binary format. txnlog_decode returns -1 if the checksum does not match.
+void txnlog_encode(const txn_entry *e, uint64_t seq, txnlog_rec *r);
+int  txnlog_decode(const txnlog_rec *r, txn_entry *e);
+
+void txnlog_header_init(txnlog_header *h);
+int  txnlog_header_valid(const txnlog_header *h);
+
+#endif